@@ -0,0 +1,379 @@
+// Allocator.cpp : fits sampled waveforms with linear segments and shares each channel's memory between them
+#include "stdafx.h"
+using namespace std;
+
+#include <queue> // for the splits and allocations waiting, best first
+#include <set> // for the errors of the current segments
+#include <algorithm> // for sorting knots and errors
+#include <chrono> // for timing the fit
+#include "Allocator.h"
+#include "Work_Pool.h"
+#include "Step_Cache.h" // for the step kinds
+#include "properties.h"
+
+// Priority of a segment that is longer than one line can be, so it is split before anything else
+#define ALLOC_TOO_LONG 1e300
+
+// A segment of a fit, from sample a to sample b
+struct USB_Fit_Segment {
+	size_t a;
+	size_t b;
+	size_t split; // sample to split at, a if it can't be split
+	double err; // largest distance of a sample from the line
+	bool tooLong;
+};
+
+// Measures how far the samples of a segment are from the straight line between its ends, and where to split it
+// Splits are at the worst sample, or the middle of a segment that is too long, leaving no line shorter than MIN_LINE_TIME
+static void FitSegment(const std::vector<double> & t, const std::vector<double> & v, USB_Fit_Segment & seg)
+{
+	double span = t[seg.b] - t[seg.a];
+	double worst = -1;
+	seg.err = 0;
+	seg.split = seg.a;
+	seg.tooLong = span > MAX_LINE_TIME;
+	for (size_t i = seg.a + 1; i < seg.b; i++) {
+		double line = v[seg.a] + (v[seg.b] - v[seg.a]) * (t[i] - t[seg.a]) / span;
+		double e = fabs(v[i] - line);
+		if (e > seg.err) {
+			seg.err = e;
+		}
+		if (!seg.tooLong && e > worst && t[i] - t[seg.a] >= MIN_LINE_TIME && t[seg.b] - t[i] >= MIN_LINE_TIME) {
+			worst = e;
+			seg.split = i;
+		}
+	}
+	if (seg.tooLong) {
+		size_t mid = size_t(std::lower_bound(t.begin() + seg.a, t.begin() + seg.b, t[seg.a] + span / 2) - t.begin());
+		if (mid > seg.a && mid < seg.b) {
+			seg.split = mid;
+		}
+		else if (seg.b - seg.a > 1) {
+			seg.split = seg.a + 1;
+		}
+	}
+}
+
+// Waveform lines a segment is encoded as: one, or as many as the encoder splits it into when it is longer than one line can be
+static unsigned SegmentLines(const std::vector<double> & t, const USB_Fit_Segment & seg)
+{
+	long long ticks = USB_Waveform_Manager::DacTicks(t[seg.b] - t[0]) - USB_Waveform_Manager::DacTicks(t[seg.a] - t[0]);
+	return ticks > MAX_LINE_TICKS ? unsigned((ticks + MAX_LINE_TICKS - 1) / MAX_LINE_TICKS) : 1;
+}
+
+// Adds a fitted segment to the fit, queueing it to be split if splitting can help
+static void AddSegment(std::vector<USB_Fit_Segment> & segs, std::multiset<double> & errs,
+	std::priority_queue<std::pair<double, size_t> > & splits, unsigned & tooLong, const USB_Fit_Segment & seg)
+{
+	segs.push_back(seg);
+	errs.insert(seg.err);
+	if (seg.tooLong) {
+		tooLong++;
+	}
+	if (seg.split > seg.a && (seg.tooLong || seg.err > 0)) {
+		splits.push(std::make_pair(seg.tooLong ? ALLOC_TOO_LONG : seg.err, segs.size() - 1));
+	}
+}
+
+void USB_Allocator::ErrorCurve(const std::vector<double> & vTime, const std::vector<double> & vVolt,
+	unsigned maxSegments, USB_Error_Curve & curve)
+{
+	curve.order.clear();
+	curve.error.clear();
+	curve.best.clear();
+	curve.lines.clear();
+	curve.kMin = 1;
+	if (vTime.size() < 2) {
+		return;
+	}
+
+	std::vector<USB_Fit_Segment> segs;
+	std::multiset<double> errs; // errors of the segments in the fit, to find the largest
+	std::priority_queue<std::pair<double, size_t> > splits; // segments to split, worst first
+	unsigned tooLong = 0; // segments in the fit longer than one line
+
+	USB_Fit_Segment whole = { 0, vTime.size() - 1, 0, 0, false };
+	FitSegment(vTime, vVolt, whole);
+	AddSegment(segs, errs, splits, tooLong, whole);
+	curve.error.push_back(*errs.rbegin());
+	unsigned lines = SegmentLines(vTime, whole);
+	curve.lines.push_back(lines);
+	curve.kMin = tooLong ? 0 : 1;
+
+	// Each split replaces the worst segment with two, adding one segment
+	unsigned k = 1;
+	while (k < maxSegments && !splits.empty()) {
+		USB_Fit_Segment seg = segs[splits.top().second];
+		splits.pop();
+		errs.erase(errs.find(seg.err));
+		if (seg.tooLong) {
+			tooLong--;
+		}
+		USB_Fit_Segment left = { seg.a, seg.split, 0, 0, false };
+		USB_Fit_Segment right = { seg.split, seg.b, 0, 0, false };
+		FitSegment(vTime, vVolt, left);
+		FitSegment(vTime, vVolt, right);
+		AddSegment(segs, errs, splits, tooLong, left);
+		AddSegment(segs, errs, splits, tooLong, right);
+		lines += SegmentLines(vTime, left) + SegmentLines(vTime, right) - SegmentLines(vTime, seg);
+
+		curve.order.push_back(seg.split);
+		k++;
+		curve.error.push_back(*errs.rbegin());
+		curve.lines.push_back(lines);
+		if (curve.kMin == 0 && tooLong == 0) {
+			curve.kMin = k;
+		}
+	}
+	if (curve.kMin == 0) {
+		// samples too far apart for one line; the encoder splits the long segments, and StepWords counts their lines
+		curve.kMin = k;
+	}
+
+	// A split can leave the worst error higher than before, so from kMin on each count keeps the best fit with no more segments
+	double lowest = curve.error[curve.kMin - 1];
+	unsigned lowestK = curve.kMin;
+	curve.best.resize(curve.error.size());
+	for (unsigned j = 0; j < curve.error.size(); j++) {
+		if (j + 1 >= curve.kMin) {
+			if (curve.error[j] < lowest) {
+				lowest = curve.error[j];
+				lowestK = j + 1;
+			}
+			curve.error[j] = lowest;
+			curve.best[j] = lowestK;
+		}
+		else {
+			curve.best[j] = j + 1;
+		}
+	}
+}
+
+unsigned USB_Allocator::StepWords(const USB_Error_Curve & curve, unsigned segments)
+{
+	// the lines of the fit actually encoded for that many segments, and the op-codes
+	return USB_LINE_WORDS * curve.lines[curve.best[segments - 1] - 1] + EndWords();
+}
+
+unsigned USB_Allocator::EndWords()
+{
+	// the op-code to wait for the trigger, and the op-code to loop in FREERUN
+	return 1 + (FREERUN == TRUE ? 1 : 0);
+}
+
+// Cross product of the turn from p0 to p1 to p2, positive for a turn to the left
+static double Turn(double x0, double y0, double x1, double y1, double x2, double y2)
+{
+	return (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+}
+
+bool USB_Allocator::AllocateTotal(std::vector<USB_Alloc_Wave *> & waves, unsigned budget)
+{
+	// Only the lower convex hull of each curve is worth stepping along: every step on it buys less error per word
+	// than the step before, so the best step across all waveforms is taken each time. This is a greedy approximation:
+	// it is optimal until a step doesn't fit what is left of the budget, and from there choosing steps is a knapsack
+	std::vector<std::vector<unsigned> > hulls(waves.size());
+	std::vector<size_t> at(waves.size(), 0);
+	unsigned used = 0;
+	for (size_t w = 0; w < waves.size(); w++) {
+		USB_Error_Curve & curve = waves[w]->curve;
+		std::vector<unsigned> & hull = hulls[w];
+		for (unsigned k = curve.kMin; k <= curve.error.size(); k++) {
+			if (!hull.empty() && StepWords(curve, hull.back()) == StepWords(curve, k)) {
+				// no more words, and never more error
+				hull.pop_back();
+			}
+			while (hull.size() >= 2 && Turn(StepWords(curve, hull[hull.size() - 2]), curve.error[hull[hull.size() - 2] - 1],
+				StepWords(curve, hull.back()), curve.error[hull.back() - 1], StepWords(curve, k), curve.error[k - 1]) <= 0) {
+				hull.pop_back();
+			}
+			hull.push_back(k);
+		}
+		used += StepWords(curve, hull[0]);
+	}
+	if (used > budget) {
+		return false;
+	}
+
+	// Steps by error saved per word, best first
+	std::priority_queue<std::pair<double, size_t> > steps;
+	for (size_t w = 0; w < waves.size(); w++) {
+		if (hulls[w].size() > 1) {
+			USB_Error_Curve & curve = waves[w]->curve;
+			double gain = (curve.error[hulls[w][0] - 1] - curve.error[hulls[w][1] - 1]) / (StepWords(curve, hulls[w][1]) - StepWords(curve, hulls[w][0]));
+			steps.push(std::make_pair(gain, w));
+		}
+	}
+	while (!steps.empty()) {
+		double gain = steps.top().first;
+		size_t w = steps.top().second;
+		steps.pop();
+		std::vector<unsigned> & hull = hulls[w];
+		USB_Error_Curve & curve = waves[w]->curve;
+		unsigned extra = StepWords(curve, hull[at[w] + 1]) - StepWords(curve, hull[at[w]]);
+		if (gain <= 0 || used + extra > budget) {
+			// this waveform can't grow any further
+			continue;
+		}
+		used += extra;
+		at[w]++;
+		if (at[w] + 1 < hull.size()) {
+			gain = (curve.error[hull[at[w]] - 1] - curve.error[hull[at[w] + 1] - 1]) / (StepWords(curve, hull[at[w] + 1]) - StepWords(curve, hull[at[w]]));
+			steps.push(std::make_pair(gain, w));
+		}
+	}
+
+	for (size_t w = 0; w < waves.size(); w++) {
+		waves[w]->segments = waves[w]->curve.best[hulls[w][at[w]] - 1];
+	}
+	return true;
+}
+
+// Fewest segments at or above kMin with an error no more than a limit, 0 if there are none
+static unsigned SegmentsFor(const USB_Error_Curve & curve, double limit)
+{
+	std::vector<double>::const_iterator first = curve.error.begin() + (curve.kMin - 1);
+	// errors never increase from kMin on, so the first one within the limit is found by bisection
+	std::vector<double>::const_iterator found = std::lower_bound(first, curve.error.end(), limit, std::greater<double>());
+	if (found == curve.error.end()) {
+		return 0;
+	}
+	return unsigned(found - curve.error.begin()) + 1;
+}
+
+bool USB_Allocator::AllocateWorst(std::vector<USB_Alloc_Wave *> & waves, unsigned budget)
+{
+	// Every error on any curve is a possible worst case; find the lowest that fits by bisection
+	std::vector<double> limits;
+	for (size_t w = 0; w < waves.size(); w++) {
+		USB_Error_Curve & curve = waves[w]->curve;
+		limits.insert(limits.end(), curve.error.begin() + (curve.kMin - 1), curve.error.end());
+	}
+	std::sort(limits.begin(), limits.end());
+	limits.erase(std::unique(limits.begin(), limits.end()), limits.end());
+
+	size_t lo = 0, hi = limits.size();
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		unsigned used = 0;
+		bool fits = true;
+		for (size_t w = 0; w < waves.size() && fits; w++) {
+			unsigned k = SegmentsFor(waves[w]->curve, limits[mid]);
+			fits = (k > 0);
+			used += fits ? StepWords(waves[w]->curve, k) : 0;
+		}
+		if (fits && used <= budget) {
+			hi = mid;
+		}
+		else {
+			lo = mid + 1;
+		}
+	}
+	if (lo == limits.size()) {
+		return false;
+	}
+	for (size_t w = 0; w < waves.size(); w++) {
+		USB_Error_Curve & curve = waves[w]->curve;
+		waves[w]->segments = curve.best[SegmentsFor(curve, limits[lo]) - 1];
+	}
+	return true;
+}
+
+void USB_Allocator::Encode(const USB_Alloc_Wave & wave)
+{
+	// The ends of the waveform and the first knots the fit added
+	std::vector<size_t> knots;
+	knots.push_back(0);
+	knots.push_back(wave.vTime.size() - 1);
+	knots.insert(knots.end(), wave.curve.order.begin(), wave.curve.order.begin() + (wave.segments - 1));
+	std::sort(knots.begin(), knots.end());
+
+	// One line per segment, with the end time from the start of the step as in the waveform files
+	std::vector<double> vTime, vVals, vdV;
+	for (size_t i = 0; i + 1 < knots.size(); i++) {
+		vTime.push_back(wave.vTime[knots[i + 1]] - wave.vTime[0]);
+		vVals.push_back(wave.vVolt[knots[i]]);
+		vdV.push_back(wave.vVolt[knots[i + 1]]);
+	}
+	USB_Waveform_Manager::WvfClear(int(wave.entry->wvfchan), int(wave.entry->step));
+	USB_Waveform_Manager::WvfFill(wave.entry->wvfchan, wave.entry->step, vTime, vVals, vdV);
+}
+
+// Reads the samples of a waveform and fits it
+static void LoadWave(USB_Alloc_Wave & wave, unsigned maxSegments)
+{
+	ifstream fs(wave.entry->file.c_str());
+	std::string line;
+	double t, v, unused;
+	while (getline(fs, line)) {
+		if (USB_Waveform_Manager::ParseLine(line, false, t, v, unused) > 0) {
+			wave.vTime.push_back(t);
+			wave.vVolt.push_back(v);
+		}
+	}
+	USB_Allocator::ErrorCurve(wave.vTime, wave.vVolt, maxSegments, wave.curve);
+}
+
+bool USB_Allocator::Compile(const std::vector<USB_Experiment_Entry> & entries, bool worstCase)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<USB_Alloc_Wave> waves(entries.size());
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (entries[i].kind != STEP_KIND_DAC) {
+			std::cout << entries[i].file << " is on a logic channel; only DAC waveforms are sampled" << std::endl;
+			return false;
+		}
+		waves[i].entry = &entries[i];
+		waves[i].segments = 0;
+	}
+
+	// No waveform can have more segments than fit in memory by itself
+	unsigned maxSegments = (USB_MEMORY_WORDS - 1 - EndWords()) / USB_LINE_WORDS;
+	{
+		Work_Pool pool;
+		for (size_t i = 0; i < waves.size(); i++) {
+			USB_Alloc_Wave * wave = &waves[i];
+			pool.Submit([wave, maxSegments] { LoadWave(*wave, maxSegments); });
+		}
+	}
+	for (size_t i = 0; i < waves.size(); i++) {
+		if (waves[i].vTime.size() < 2) {
+			std::cout << waves[i].entry->file << " needs at least two samples" << std::endl;
+			return false;
+		}
+	}
+	double fitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	// Every channel has its own memory, less the word for the end of memory op-code
+	std::vector<unsigned> channels = USB_Experiment::Channels(entries);
+	for (size_t c = 0; c < channels.size(); c++) {
+		std::vector<USB_Alloc_Wave *> onChannel;
+		for (size_t i = 0; i < waves.size(); i++) {
+			if (waves[i].entry->wvfchan == channels[c]) {
+				onChannel.push_back(&waves[i]);
+			}
+		}
+		unsigned budget = USB_MEMORY_WORDS - 1;
+		bool fits = worstCase ? AllocateWorst(onChannel, budget) : AllocateTotal(onChannel, budget);
+		if (!fits) {
+			std::cout << "Channel " << channels[c] << " can't fit its waveforms even with the fewest segments" << std::endl;
+			return false;
+		}
+
+		unsigned used = 0;
+		double total = 0, worst = 0;
+		for (size_t w = 0; w < onChannel.size(); w++) {
+			USB_Alloc_Wave & wave = *onChannel[w];
+			double err = wave.curve.error[wave.segments - 1];
+			used += StepWords(wave.curve, wave.segments);
+			total += err;
+			if (err > worst) { worst = err; }
+			std::cout << "  step " << wave.entry->step << ": " << wave.segments << " segments, error " << err << " V" << std::endl;
+			Encode(wave);
+		}
+		std::cout << "Channel " << channels[c] << ": " << used << " of " << budget << " words, total error "
+			<< total << " V, worst error " << worst << " V" << std::endl;
+	}
+	std::cout << "Fitted " << waves.size() << " waveforms in " << fitMs << " ms" << std::endl;
+	return true;
+}
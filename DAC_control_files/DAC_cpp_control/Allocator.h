@@ -0,0 +1,61 @@
+/*
+Header file for the memory allocator for sampled waveforms
+Each waveform is given as dense samples and is fitted with linear segments, the way the python spline tools do.
+A greedy fit records the error of the waveform for every number of segments, and the allocator then picks
+the number of segments of every waveform so that each channel fits in the FPGA's memory with the least
+total error, or the least worst-case error, before the waveforms are encoded
+*/
+
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <vector> // needed for samples and curves
+#include <string> // needed for file names
+#include "USB_Device.h" // for the waveform manager
+#include "Experiment.h" // experiments of sampled waveforms are listed like any other experiment
+
+// Words taken by each waveform line
+#define USB_LINE_WORDS 4
+
+// Error of a waveform for each number of segments, from a greedy fit that splits the worst segment each time
+struct USB_Error_Curve {
+	std::vector<size_t> order; // sample index of each knot added, in the order they were added
+	std::vector<double> error; // largest error in volts with k segments at error[k - 1], never increasing with k
+	std::vector<unsigned> best; // fewest segments reaching error[k - 1], which may be fewer than k
+	std::vector<unsigned> lines; // waveform lines the fit with k segments encodes to at lines[k - 1], long segments split
+	unsigned kMin; // fewest segments with no line longer than MAX_LINE_TIME
+};
+
+// A sampled waveform for one step of an experiment
+struct USB_Alloc_Wave {
+	const USB_Experiment_Entry * entry;
+	std::vector<double> vTime; // sample times, from the start of the step
+	std::vector<double> vVolt; // sample voltages
+	USB_Error_Curve curve;
+	unsigned segments; // number of segments picked by the allocator
+};
+
+class USB_Allocator{
+public:
+	// Fit, allocate and encode every waveform of an experiment of sampled waveforms ("time voltage" per line)
+	// worstCase picks the least worst-case error on each channel, otherwise the least total error
+	static bool Compile(const std::vector<USB_Experiment_Entry> & entries, bool worstCase);
+
+	// Greedy fit of samples by linear segments, up to maxSegments
+	static void ErrorCurve(const std::vector<double> & vTime, const std::vector<double> & vVolt,
+		unsigned maxSegments, USB_Error_Curve & curve);
+
+	// Words the fit picked for k segments takes in memory, with the op-codes ending its step
+	static unsigned StepWords(const USB_Error_Curve & curve, unsigned segments);
+	// Words of the op-codes ending a step
+	static unsigned EndWords();
+
+	// Pick the segments of the waveforms on one channel within a budget of words; false if even the fewest don't fit
+	static bool AllocateTotal(std::vector<USB_Alloc_Wave *> & waves, unsigned budget);
+	static bool AllocateWorst(std::vector<USB_Alloc_Wave *> & waves, unsigned budget);
+
+	// Encode a waveform with its picked number of segments into its step
+	static void Encode(const USB_Alloc_Wave & wave);
+};
+
+#endif
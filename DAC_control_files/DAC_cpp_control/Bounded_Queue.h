@@ -0,0 +1,61 @@
+/*
+Header file for a queue of fixed capacity shared between threads
+A producer waits while the queue is full and a consumer waits while it is empty, so a fast stage
+can't run ahead of a slow one by more than the capacity
+*/
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <deque> // holds the queued items
+#include <mutex> // guards the queue
+#include <condition_variable> // for waiting on a full or empty queue
+
+template <typename T>
+class Bounded_Queue{
+public:
+	explicit Bounded_Queue(size_t limit) : capacity(limit ? limit : 1), closed(false) {}
+
+	// Add an item, waiting for room; returns false if the queue was closed, and the item is dropped
+	bool Push(T item) {
+		std::unique_lock<std::mutex> lock(guard);
+		notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+		if (closed) {
+			return false;
+		}
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	};
+
+	// Take the oldest item, waiting for one; returns false once the queue is closed and empty
+	bool Pop(T & item) {
+		std::unique_lock<std::mutex> lock(guard);
+		notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty()) {
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	};
+
+	// No more items will be pushed; waiting producers give up and consumers drain what is left
+	void Close() {
+		std::lock_guard<std::mutex> lock(guard);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	};
+
+private:
+	std::deque<T> items;
+	size_t capacity;
+	bool closed;
+	std::mutex guard;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+};
+
+#endif
@@ -0,0 +1,273 @@
+// DAC_sequencer_api.cpp : C interface to the sequencer for DAC_sequencer_api.dll
+#include "stdafx.h"
+using namespace std;
+
+#include <chrono> // for timing each call
+#include "USB_Device.h"
+#include "properties.h"
+#include "DAC_sequencer_api.h"
+#include "Wvf_Algebra.h"
+#include "Dac_Calibration.h"
+
+// Milliseconds since a time point
+static double MsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int dacseq_set_transport(const char * name)
+{
+	return (name && USB_Transport::Select(name)) ? DACSEQ_OK : DACSEQ_ERR_ARGS;
+}
+
+int dacseq_load_calibration(const char * file)
+{
+	return USB_Dac_Calibration::Load(file ? file : CALIBRATION_FILE) ? int(USB_Dac_Calibration::Tables.size()) : DACSEQ_ERR_ARGS;
+}
+
+int dacseq_open(const char * device_list)
+{
+	// The calibration file is read with the devices, unless one was read already
+	if (USB_Dac_Calibration::Tables.empty()) {
+		USB_Dac_Calibration::Load(CALIBRATION_FILE);
+	}
+	unsigned numDevs = device_list ? USB_Waveform_Manager::OpenDevices(device_list) : USB_Waveform_Manager::OpenTopology(TOPOLOGY_FILE);
+	return numDevs ? int(numDevs) : DACSEQ_ERR_DEVICE;
+}
+
+unsigned dacseq_global_channel(unsigned device, unsigned channel)
+{
+	return USB_Waveform_Manager::GlobalChannel(device, channel);
+}
+
+unsigned dacseq_logic_channel(unsigned device)
+{
+	return USB_Waveform_Manager::LogicChannel(device);
+}
+
+int dacseq_close(void)
+{
+	int result = DACSEQ_OK;
+	for (unsigned i = 0; i < USB_Waveform_Manager::USBWaveDevList.size(); i++) {
+		if (USB_Waveform_Manager::CloseDevice(i) != FT_OK) {
+			result = DACSEQ_ERR_DEVICE;
+		}
+	}
+	USB_Waveform_Manager::ListSize(0);
+	USB_Waveform_Manager::Routes.clear();
+	USB_Waveform_Manager::FirstChannel.clear();
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	return result;
+}
+
+// Whether a channel is routed to a device, and if so whether it is the device's logic channel
+// With no devices open, channels are numbered as if every board had two DACs and the logic lines
+static bool ChannelIsLogic(unsigned channel, bool & logic)
+{
+	unsigned devIndex, local_chan;
+	if (!USB_Waveform_Manager::Route(channel, devIndex, local_chan)) {
+		return false;
+	}
+	unsigned device = USB_Waveform_Manager::FirstChannel.empty() ? channel / 3 : devIndex;
+	logic = (channel == USB_Waveform_Manager::LogicChannel(device));
+	return true;
+}
+
+int dacseq_load_waveform(unsigned channel, unsigned step,
+	const double * time, const double * start, const double * end, size_t count, dacseq_timing * timing)
+{
+	bool logic;
+	if ((count > 0 && (!time || !start || !end)) || !ChannelIsLogic(channel, logic) || logic) {
+		return DACSEQ_ERR_ARGS;
+	}
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	USBWVF_data & wvfchanstep = USB_Waveform_Manager::USBWvf[channel][step];
+	size_t before = wvfchanstep.size();
+	if (!USB_Waveform_Manager::WvfEncode(wvfchanstep, time, start, end, count, USB_Dac_Calibration::Find(channel))) {
+		return DACSEQ_ERR_ARGS;
+	}
+	wvfchanstep.intern();
+	if (timing) {
+		timing->encode_ms = MsSince(t0);
+		timing->upload_ms = 0;
+		timing->bytes = (unsigned long) (wvfchanstep.size() - before);
+	}
+	return DACSEQ_OK;
+}
+
+int dacseq_load_logic(unsigned channel, unsigned step,
+	const double * duration, const double * logic, size_t count, dacseq_timing * timing)
+{
+	bool isLogic;
+	if ((count > 0 && (!duration || !logic)) || !ChannelIsLogic(channel, isLogic) || !isLogic) {
+		return DACSEQ_ERR_ARGS;
+	}
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	USBWVF_data & wvfchanstep = USB_Waveform_Manager::USBWvf[channel][step];
+	size_t before = wvfchanstep.size();
+	if (!USB_Waveform_Manager::LogicEncode(wvfchanstep, duration, logic, count)) {
+		return DACSEQ_ERR_ARGS;
+	}
+	wvfchanstep.intern();
+	if (timing) {
+		timing->encode_ms = MsSince(t0);
+		timing->upload_ms = 0;
+		timing->bytes = (unsigned long) (wvfchanstep.size() - before);
+	}
+	return DACSEQ_OK;
+}
+
+int dacseq_copy_step(unsigned src_channel, unsigned src_step, unsigned dst_channel, unsigned dst_step)
+{
+	return USB_Waveform_Manager::CopyStep(src_channel, src_step, dst_channel, dst_step) ? DACSEQ_OK : DACSEQ_ERR_ARGS;
+}
+
+int dacseq_write(unsigned channel, dacseq_timing * timing)
+{
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	bool written = USB_Waveform_Manager::Write(channel);
+	if (timing) {
+		unsigned long bytes = 0;
+		USBWVF_channel & chan = USB_Waveform_Manager::USBWvf[channel];
+		for (USBWVF_channel::iterator its = chan.begin(); its != chan.end(); ++its) {
+			bytes += (unsigned long) (its->second).size();
+		}
+		timing->encode_ms = 0;
+		timing->upload_ms = MsSince(t0);
+		timing->bytes = bytes;
+	}
+	return written ? DACSEQ_OK : DACSEQ_ERR_WRITE;
+}
+
+int dacseq_run(unsigned channel)
+{
+	return USB_Waveform_Manager::Run(channel) ? DACSEQ_OK : DACSEQ_ERR_WRITE;
+}
+
+int dacseq_clear(int channel, int step)
+{
+	USB_Waveform_Manager::WvfClear(channel, step);
+	return DACSEQ_OK;
+}
+
+size_t dacseq_step_size(unsigned channel, unsigned step)
+{
+	USBWVF::iterator itc = USB_Waveform_Manager::USBWvf.find(channel);
+	if (itc == USB_Waveform_Manager::USBWvf.end()) {
+		return 0;
+	}
+	USBWVF_channel::iterator its = (itc->second).find(step);
+	return its == (itc->second).end() ? 0 : (its->second).size();
+}
+
+// Expressions handed out to callers, by handle
+static std::map<dacseq_wvf, USB_Wvf_Expr> WvfHandles;
+static dacseq_wvf NextWvfHandle = 1;
+
+// Hands out a handle for an expression, 0 for an expression that couldn't be built
+static dacseq_wvf WvfHandle(const USB_Wvf_Expr & wvf)
+{
+	if (!wvf) {
+		return 0;
+	}
+	dacseq_wvf handle = NextWvfHandle++;
+	WvfHandles[handle] = wvf;
+	return handle;
+}
+
+// The expression behind a handle, empty for an unknown handle
+static USB_Wvf_Expr WvfExpr(dacseq_wvf handle)
+{
+	std::map<dacseq_wvf, USB_Wvf_Expr>::iterator ith = WvfHandles.find(handle);
+	return ith == WvfHandles.end() ? USB_Wvf_Expr() : ith->second;
+}
+
+dacseq_wvf dacseq_wvf_segments(const double * duration, const double * start, const double * end, size_t count)
+{
+	if (count > 0 && (!duration || !start || !end)) {
+		return 0;
+	}
+	USB_Wvf_Segments segments(count);
+	for (size_t i = 0; i < count; i++) {
+		segments[i].duration = duration[i];
+		segments[i].vStart = start[i];
+		segments[i].vEnd = end[i];
+	}
+	return WvfHandle(USB_Wvf_Algebra::Segments(segments));
+}
+
+dacseq_wvf dacseq_wvf_file(const char * file)
+{
+	return file ? WvfHandle(USB_Wvf_Algebra::File(file)) : 0;
+}
+
+dacseq_wvf dacseq_wvf_concat(const dacseq_wvf * parts, size_t count)
+{
+	if (count > 0 && !parts) {
+		return 0;
+	}
+	std::vector<USB_Wvf_Expr> exprs(count);
+	for (size_t i = 0; i < count; i++) {
+		exprs[i] = WvfExpr(parts[i]);
+	}
+	return WvfHandle(USB_Wvf_Algebra::Concat(exprs));
+}
+
+dacseq_wvf dacseq_wvf_offset(dacseq_wvf wvf, double volts)
+{
+	return WvfHandle(USB_Wvf_Algebra::Offset(WvfExpr(wvf), volts));
+}
+
+dacseq_wvf dacseq_wvf_scale(dacseq_wvf wvf, double factor)
+{
+	return WvfHandle(USB_Wvf_Algebra::Scale(WvfExpr(wvf), factor));
+}
+
+dacseq_wvf dacseq_wvf_stretch(dacseq_wvf wvf, double factor)
+{
+	return WvfHandle(USB_Wvf_Algebra::Stretch(WvfExpr(wvf), factor));
+}
+
+dacseq_wvf dacseq_wvf_repeat(dacseq_wvf wvf, unsigned times)
+{
+	return WvfHandle(USB_Wvf_Algebra::Repeat(WvfExpr(wvf), times));
+}
+
+dacseq_wvf dacseq_wvf_slice(dacseq_wvf wvf, double t_start, double t_end)
+{
+	return WvfHandle(USB_Wvf_Algebra::Slice(WvfExpr(wvf), t_start, t_end));
+}
+
+dacseq_wvf dacseq_wvf_splice(dacseq_wvf wvf, double t_start, double t_end, dacseq_wvf insert)
+{
+	return WvfHandle(USB_Wvf_Algebra::Splice(WvfExpr(wvf), t_start, t_end, WvfExpr(insert)));
+}
+
+double dacseq_wvf_duration(dacseq_wvf wvf)
+{
+	USB_Wvf_Expr expr = WvfExpr(wvf);
+	return expr ? expr->duration : 0;
+}
+
+int dacseq_wvf_load(unsigned channel, unsigned step, dacseq_wvf wvf, dacseq_timing * timing)
+{
+	USB_Wvf_Expr expr = WvfExpr(wvf);
+	if (!expr) {
+		return DACSEQ_ERR_ARGS;
+	}
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	if (!USB_Wvf_Algebra::Load(expr, channel, step)) {
+		return DACSEQ_ERR_ARGS;
+	}
+	if (timing) {
+		timing->encode_ms = MsSince(t0);
+		timing->upload_ms = 0;
+		timing->bytes = (unsigned long) USB_Waveform_Manager::USBWvf[channel][step].size();
+	}
+	return DACSEQ_OK;
+}
+
+int dacseq_wvf_release(dacseq_wvf wvf)
+{
+	return WvfHandles.erase(wvf) ? DACSEQ_OK : DACSEQ_ERR_ARGS;
+}
@@ -0,0 +1,116 @@
+/*
+Header file for the C interface to the sequencer, built as DAC_sequencer_api.dll
+Waveforms and logic steps are handed over as arrays and encoded straight from them,
+so callers such as ctypes with numpy skip writing and parsing text files
+*/
+
+#ifndef DAC_SEQUENCER_API_H
+#define DAC_SEQUENCER_API_H
+
+#include <stddef.h> // for size_t
+
+#ifdef _WIN32
+#ifdef DACSEQ_EXPORTS
+#define DACSEQ_API __declspec(dllexport)
+#else
+#define DACSEQ_API __declspec(dllimport)
+#endif
+#else
+#define DACSEQ_API __attribute__ ((visibility("default")))
+#endif
+
+// Return values; anything below zero is a failure
+#define DACSEQ_OK 0
+#define DACSEQ_ERR_DEVICE -1 // no device could be opened, or a device failed to close
+#define DACSEQ_ERR_ARGS -2 // missing arrays or a bad channel
+#define DACSEQ_ERR_WRITE -3 // the USB transfer failed
+
+// Timing of a call, filled out when a pointer is given
+typedef struct dacseq_timing {
+	double encode_ms; // time spent encoding
+	double upload_ms; // time spent sending to the device
+	unsigned long bytes; // bytes encoded or sent
+} dacseq_timing;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Pick how devices opened from now on are reached: "d2xx", "ftdi" or "loopback", an emulated board with no hardware
+DACSEQ_API int dacseq_set_transport(const char * name);
+
+// Read the calibration of the DAC channels from a file, or from the calibration file when NULL
+// Waveforms loaded from now on are corrected with it; returns the number of channels calibrated
+DACSEQ_API int dacseq_load_calibration(const char * file);
+
+// Open the devices in a "serial# #ofDACs serial# #ofDACs ..." list
+// When NULL, the boards in the topology file are opened, or USB_DEVICE_LIST if there is no topology file
+// The calibration file is read too, if no calibration was read before
+// Returns the number of devices opened
+DACSEQ_API int dacseq_open(const char * device_list);
+
+// Global channel number of a channel on a device, or of the logic channel of a device
+// 0xFFFFFFFF when the device or channel is not in the topology
+DACSEQ_API unsigned dacseq_global_channel(unsigned device, unsigned channel);
+DACSEQ_API unsigned dacseq_logic_channel(unsigned device);
+
+// Close all devices and clear all waveform data
+DACSEQ_API int dacseq_close(void);
+
+// Encode count waveform lines onto the end of a step: end time from the step start, start voltage and end voltage
+// DACSEQ_ERR_ARGS for a channel no device routes, or a logic channel
+DACSEQ_API int dacseq_load_waveform(unsigned channel, unsigned step,
+	const double * time, const double * start, const double * end, size_t count, dacseq_timing * timing);
+
+// Encode count logic vectors onto the end of a step: duration and logic vector of each
+// DACSEQ_ERR_ARGS for a channel that isn't the logic channel of a device
+DACSEQ_API int dacseq_load_logic(unsigned channel, unsigned step,
+	const double * duration, const double * logic, size_t count, dacseq_timing * timing);
+
+// Share an encoded step with another step, on any channel or board, without encoding it again
+DACSEQ_API int dacseq_copy_step(unsigned src_channel, unsigned src_step, unsigned dst_channel, unsigned dst_step);
+
+// Send all the steps of a channel to its device
+// Channels whose steps are the very same buffers as the last write to that channel are not sent again
+DACSEQ_API int dacseq_write(unsigned channel, dacseq_timing * timing);
+
+// Run the next sequence in a channel
+DACSEQ_API int dacseq_run(unsigned channel);
+
+// Clear a step, a channel with step -1, or everything with channel -1
+DACSEQ_API int dacseq_clear(int channel, int step);
+
+// Number of encoded bytes held for a step
+DACSEQ_API size_t dacseq_step_size(unsigned channel, unsigned step);
+
+// Waveform expressions, combined without evaluating anything until one is loaded into a step
+// Parts that two expressions share, or that an earlier expression already had, are not evaluated or encoded again
+// Handles are released with dacseq_wvf_release; 0 is returned when an expression can't be built
+typedef unsigned dacseq_wvf;
+
+// A waveform from count linear segments: duration, start voltage and end voltage of each
+DACSEQ_API dacseq_wvf dacseq_wvf_segments(const double * duration, const double * start, const double * end, size_t count);
+// A waveform from a waveform file
+DACSEQ_API dacseq_wvf dacseq_wvf_file(const char * file);
+// Waveforms one after the other
+DACSEQ_API dacseq_wvf dacseq_wvf_concat(const dacseq_wvf * parts, size_t count);
+// Voltages shifted or multiplied, durations multiplied, or the whole waveform repeated
+DACSEQ_API dacseq_wvf dacseq_wvf_offset(dacseq_wvf wvf, double volts);
+DACSEQ_API dacseq_wvf dacseq_wvf_scale(dacseq_wvf wvf, double factor);
+DACSEQ_API dacseq_wvf dacseq_wvf_stretch(dacseq_wvf wvf, double factor);
+DACSEQ_API dacseq_wvf dacseq_wvf_repeat(dacseq_wvf wvf, unsigned times);
+// The part of a waveform between two times, or the waveform with that part replaced by another waveform
+DACSEQ_API dacseq_wvf dacseq_wvf_slice(dacseq_wvf wvf, double t_start, double t_end);
+DACSEQ_API dacseq_wvf dacseq_wvf_splice(dacseq_wvf wvf, double t_start, double t_end, dacseq_wvf insert);
+// Duration of a waveform in milliseconds
+DACSEQ_API double dacseq_wvf_duration(dacseq_wvf wvf);
+// Evaluate and encode a waveform into a step, replacing what the step held
+DACSEQ_API int dacseq_wvf_load(unsigned channel, unsigned step, dacseq_wvf wvf, dacseq_timing * timing);
+// Release a handle; parts still used by other expressions are kept
+DACSEQ_API int dacseq_wvf_release(dacseq_wvf wvf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,307 @@
+// Dac_Calibration.cpp : calibration tables of the DAC channels, and fitting them from measurements
+#include "stdafx.h"
+using namespace std;
+
+#include <iomanip> // for the precision of saved tables
+#include <algorithm> // for std::min and std::max
+#include <cmath> // for std::isfinite
+#include "Dac_Calibration.h"
+#include "USB_Device.h"
+
+// Tables read at start-up, only read from while steps are being encoded
+std::map<std::pair<std::string, unsigned>, USB_Dac_Cal> USB_Dac_Calibration::Tables;
+
+void USB_Dac_Calibration::Finish(USB_Dac_Cal & cal)
+{
+	std::vector<double> numbers;
+	numbers.push_back(cal.gain);
+	numbers.push_back(cal.offset);
+	numbers.insert(numbers.end(), cal.inl.begin(), cal.inl.end());
+	cal.hash = USB_Step_Pool::HashBytes(&numbers[0], numbers.size() * sizeof(double));
+	if (cal.hash == 0) {
+		// 0 is kept for channels with no table
+		cal.hash = 1;
+	}
+}
+
+bool USB_Dac_Calibration::Load(const std::string & file)
+{
+	ifstream fs(file.c_str());
+	if (!fs.is_open()) {
+		return false;
+	}
+	Tables.clear();
+	std::string line;
+	unsigned lineNum = 0;
+	while (getline(fs, line)) {
+		lineNum++;
+		std::stringstream sss(line);
+		std::string serial;
+		if (!(sss >> serial) || serial[0] == '#') {
+			// blank line or comment
+			continue;
+		}
+		unsigned channel;
+		USB_Dac_Cal cal;
+		if (!(sss >> channel >> cal.gain >> cal.offset)) {
+			std::cout << file << " line " << lineNum << ": expected serial channel gain offset" << std::endl;
+			continue;
+		}
+		double correction;
+		while (sss >> correction) {
+			cal.inl.push_back(correction);
+		}
+		// A table that would flip, flatten or poison every voltage sent is a mistake in the file, not a calibration
+		bool finite = std::isfinite(cal.gain) && std::isfinite(cal.offset);
+		for (size_t p = 0; p < cal.inl.size(); p++) {
+			finite = finite && std::isfinite(cal.inl[p]);
+		}
+		if (!finite || cal.gain <= 0) {
+			std::cout << file << " line " << lineNum << ": gain must be above 0, and every number finite" << std::endl;
+			continue;
+		}
+		if (cal.inl.size() == 1) {
+			// one correction is just more offset
+			cal.offset += cal.inl[0];
+			cal.inl.clear();
+		}
+		Finish(cal);
+		Tables[std::make_pair(serial, channel)] = cal;
+	}
+	return true;
+}
+
+bool USB_Dac_Calibration::Save(const std::string & file)
+{
+	ofstream fs(file.c_str(), ios::out | ios::trunc);
+	if (!fs.is_open()) {
+		return false;
+	}
+	fs << "# serial channel gain offset [nonlinearity corrections in volts from " << MIN_VOLTAGE << " V to " << MAX_VOLTAGE << " V]" << std::endl;
+	fs << std::setprecision(12);
+	std::map<std::pair<std::string, unsigned>, USB_Dac_Cal>::const_iterator itt;
+	for (itt = Tables.begin(); itt != Tables.end(); ++itt) {
+		const USB_Dac_Cal & cal = itt->second;
+		fs << itt->first.first << " " << itt->first.second << " " << cal.gain << " " << cal.offset;
+		for (size_t p = 0; p < cal.inl.size(); p++) {
+			fs << " " << cal.inl[p];
+		}
+		fs << std::endl;
+	}
+	return bool(fs);
+}
+
+const USB_Dac_Cal * USB_Dac_Calibration::Find(const std::string & serial, unsigned channel)
+{
+	if (Tables.empty()) {
+		return NULL;
+	}
+	std::map<std::pair<std::string, unsigned>, USB_Dac_Cal>::const_iterator itt = Tables.find(std::make_pair(serial, channel));
+	return (itt == Tables.end()) ? NULL : &(itt->second);
+}
+
+const USB_Dac_Cal * USB_Dac_Calibration::Find(unsigned channel)
+{
+	unsigned devIndex, local_chan;
+	if (Tables.empty() || !USB_Waveform_Manager::Route(channel, devIndex, local_chan)
+		|| devIndex >= USB_Waveform_Manager::USBWaveDevList.size()) {
+		return NULL;
+	}
+	return Find(std::string(USB_Waveform_Manager::USBWaveDevList[devIndex].Serial), local_chan);
+}
+
+unsigned long long USB_Dac_Calibration::Hash(unsigned channel)
+{
+	const USB_Dac_Cal * cal = Find(channel);
+	return cal ? cal->hash : 0;
+}
+
+/*	1) gain and offset, 2) the nonlinearity correction interpolated at the voltage asked for, 3) clamp into range
+	Both loops work each voltage out in the same order, so they give the same codes to the last bit */
+void USB_Dac_Calibration::Apply(const USB_Dac_Cal * cal, const double * vIn, double * vOut, size_t count)
+{
+	double gain = cal ? cal->gain : 1;
+	double offset = cal ? cal->offset : 0;
+	const double * inl = (cal && cal->inl.size() >= 2) ? &cal->inl[0] : NULL;
+	// position in the corrections is worked out from 0 to last, and the interval from 0 to last - 1
+	double last = inl ? double(cal->inl.size() - 1) : 1;
+	double lastInterval = last - 1;
+	double scale = last / (MAX_VOLTAGE - MIN_VOLTAGE);
+	size_t i = 0;
+
+#ifdef DAC_CAL_SSE2
+	__m128d g = _mm_set1_pd(gain);
+	__m128d o = _mm_set1_pd(offset);
+	__m128d lo = _mm_set1_pd(MIN_VOLTAGE);
+	__m128d hi = _mm_set1_pd(MAX_VOLTAGE);
+	__m128d zero = _mm_setzero_pd();
+	__m128d sc = _mm_set1_pd(scale);
+	__m128d top = _mm_set1_pd(last);
+	__m128d topInterval = _mm_set1_pd(lastInterval);
+	for (; i + 2 <= count; i += 2) {
+		__m128d v = _mm_loadu_pd(vIn + i);
+		__m128d c = _mm_add_pd(_mm_mul_pd(v, g), o);
+		if (inl) {
+			__m128d x = _mm_mul_pd(_mm_sub_pd(v, lo), sc);
+			x = _mm_min_pd(_mm_max_pd(x, zero), top);
+			__m128i k = _mm_cvttpd_epi32(_mm_min_pd(x, topInterval));
+			__m128d f = _mm_sub_pd(x, _mm_cvtepi32_pd(k));
+			// the table lookups are the only part done a voltage at a time
+			int k0 = _mm_cvtsi128_si32(k);
+			int k1 = _mm_cvtsi128_si32(_mm_shuffle_epi32(k, 1));
+			__m128d a = _mm_set_pd(inl[k1], inl[k0]);
+			__m128d b = _mm_set_pd(inl[k1 + 1], inl[k0 + 1]);
+			c = _mm_add_pd(c, _mm_add_pd(a, _mm_mul_pd(f, _mm_sub_pd(b, a))));
+		}
+		c = _mm_min_pd(_mm_max_pd(c, lo), hi);
+		_mm_storeu_pd(vOut + i, c);
+	}
+#endif
+
+	for (; i < count; i++) {
+		double v = vIn[i];
+		double c = v * gain + offset;
+		if (inl) {
+			double x = (v - MIN_VOLTAGE) * scale;
+			x = (x > 0) ? x : 0;
+			x = (x < last) ? x : last;
+			int k = int((x < lastInterval) ? x : lastInterval);
+			double f = x - double(k);
+			c = c + (inl[k] + f * (inl[k + 1] - inl[k]));
+		}
+		c = (c > MIN_VOLTAGE) ? c : MIN_VOLTAGE;
+		c = (c < MAX_VOLTAGE) ? c : MAX_VOLTAGE;
+		vOut[i] = c;
+	}
+}
+
+/*	1) a straight line fit of the voltage measured against the voltage asked for gives the gain and offset
+	2) what is left over is shared out onto the nonlinearity points it falls between, and averaged
+	3) points no reading fell near are filled in from their neighbours */
+bool USB_Dac_Calibration::Fit(const std::string & measurements, const std::string & file)
+{
+	ifstream fs(measurements.c_str());
+	if (!fs.is_open()) {
+		std::cout << "Could not open measurement file " << measurements << std::endl;
+		return false;
+	}
+	std::map<std::pair<std::string, unsigned>, std::vector<std::pair<double, double> > > readings;
+	std::string line;
+	while (getline(fs, line)) {
+		std::stringstream sss(line);
+		std::string serial;
+		unsigned channel;
+		double asked, measured;
+		if (!(sss >> serial) || serial[0] == '#') {
+			continue;
+		}
+		if (sss >> channel >> asked >> measured) {
+			readings[std::make_pair(serial, channel)].push_back(std::make_pair(asked, measured));
+		}
+	}
+
+	bool fitted = false;
+	std::map<std::pair<std::string, unsigned>, std::vector<std::pair<double, double> > >::const_iterator itr;
+	for (itr = readings.begin(); itr != readings.end(); ++itr) {
+		const std::vector<std::pair<double, double> > & r = itr->second;
+		double n = double(r.size());
+		double sx = 0, sy = 0, sxx = 0, sxy = 0;
+		for (size_t j = 0; j < r.size(); j++) {
+			sx += r[j].first;
+			sy += r[j].second;
+			sxx += r[j].first * r[j].first;
+			sxy += r[j].first * r[j].second;
+		}
+		double det = n * sxx - sx * sx;
+		double slope = (det > 0) ? (n * sxy - sx * sy) / det : 0;
+		if (slope <= 0) {
+			std::cout << "Channel " << itr->first.second << " of " << itr->first.first
+				<< " needs readings at two or more voltages that rise with the voltage asked for" << std::endl;
+			continue;
+		}
+		double intercept = (sy - slope * sx) / n;
+
+		USB_Dac_Cal cal;
+		cal.gain = 1 / slope;
+		cal.offset = -intercept / slope;
+
+		// Left over after the straight line, in volts at the output, shared onto the points either side
+		std::vector<double> left(r.size());
+		unsigned points = CALIBRATION_INL_POINTS;
+		std::vector<double> weight(points, 0), sum(points, 0);
+		double scale = (points - 1) / (MAX_VOLTAGE - MIN_VOLTAGE);
+		for (size_t j = 0; j < r.size(); j++) {
+			left[j] = r[j].second - (slope * r[j].first + intercept);
+			double x = std::min(std::max((r[j].first - MIN_VOLTAGE) * scale, 0.0), double(points - 1));
+			unsigned k = std::min(unsigned(x), points - 2);
+			double f = x - k;
+			weight[k] += 1 - f;
+			sum[k] += (1 - f) * left[j];
+			weight[k + 1] += f;
+			sum[k + 1] += f * left[j];
+		}
+		bool useInl = r.size() >= CALIBRATION_INL_POINTS * CALIBRATION_READINGS_PER_POINT;
+		std::vector<double> est(points, 0);
+		if (useInl) {
+			std::vector<int> known;
+			for (unsigned p = 0; p < points; p++) {
+				if (weight[p] > 1e-9) {
+					est[p] = sum[p] / weight[p];
+					known.push_back(p);
+				}
+			}
+			for (unsigned p = 0; p < points; p++) {
+				if (weight[p] > 1e-9) {
+					continue;
+				}
+				// nearest points either side with readings
+				int below = -1, above = -1;
+				for (size_t q = 0; q < known.size(); q++) {
+					if (known[q] < int(p)) { below = known[q]; }
+					if (known[q] > int(p) && above < 0) { above = known[q]; }
+				}
+				if (below >= 0 && above >= 0) {
+					est[p] = est[below] + (est[above] - est[below]) * double(int(p) - below) / double(above - below);
+				}
+				else {
+					est[p] = est[(below >= 0) ? below : above];
+				}
+			}
+			// A voltage that comes out too high is asked for that much lower, in the voltage asked for
+			for (unsigned p = 0; p < points; p++) {
+				cal.inl.push_back(-est[p] / slope);
+			}
+		}
+		Finish(cal);
+		Tables[itr->first] = cal;
+		fitted = true;
+
+		// How far off the channel was, and how far off the fit still is, as rms
+		double before = 0, after = 0;
+		for (size_t j = 0; j < r.size(); j++) {
+			double rest = left[j];
+			if (useInl) {
+				double x = std::min(std::max((r[j].first - MIN_VOLTAGE) * scale, 0.0), double(points - 1));
+				unsigned k = std::min(unsigned(x), points - 2);
+				rest -= est[k] + (x - k) * (est[k + 1] - est[k]);
+			}
+			before += (r[j].second - r[j].first) * (r[j].second - r[j].first);
+			after += rest * rest;
+		}
+		std::cout << "Channel " << itr->first.second << " of " << itr->first.first << ": gain " << cal.gain
+			<< ", offset " << cal.offset << " V, " << (useInl ? "with" : "too few readings for")
+			<< " nonlinearity corrections; rms error " << 1000 * sqrt(before / n) << " mV before, "
+			<< 1000 * sqrt(after / n) << " mV after, from " << r.size() << " readings" << std::endl;
+	}
+
+	if (!fitted) {
+		std::cout << "No channel could be fitted from " << measurements << std::endl;
+		return false;
+	}
+	if (!Save(file)) {
+		std::cout << "Could not write calibration file " << file << std::endl;
+		return false;
+	}
+	std::cout << "Calibration for " << Tables.size() << " channels written to " << file << std::endl;
+	return true;
+}
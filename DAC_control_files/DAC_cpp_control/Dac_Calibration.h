@@ -0,0 +1,72 @@
+/*
+Header file for the calibration of each DAC channel
+Every board and channel has its own gain, offset and integral nonlinearity, so a table for each serial and channel
+corrects the voltages asked for before they are turned into DAC codes. The tables are read at start-up from
+CALIBRATION_FILE, and a channel with no table keeps the ideal transfer function
+
+The correction is made by the encoder on blocks of voltages at a time, with SSE2 where the compiler has it,
+together with the clamping into range the encoder does anyway, so a calibrated channel costs no more to encode
+
+Calibration file, one channel per line, # for comments:
+	serial channel gain offset [inl_0 inl_1 ... inl_n-1]
+	the voltage sent is gain * v + offset + inl(v), where inl is interpolated between n corrections in volts
+	at evenly spaced voltages from MIN_VOLTAGE to MAX_VOLTAGE
+
+Measurement file for fitting the tables, one reading per line:
+	serial channel voltage_asked_for voltage_measured
+*/
+
+#ifndef DAC_CALIBRATION_H
+#define DAC_CALIBRATION_H
+
+#include <vector> // needed for the nonlinearity corrections
+#include <map> // needed for the tables by channel
+#include <string> // needed for serial numbers and file names
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h> // SSE2 for the batch conversion
+#define DAC_CAL_SSE2
+#endif
+
+// Nonlinearity corrections fitted per channel, and the fewest readings per correction to fit them at all
+#define CALIBRATION_INL_POINTS 33
+#define CALIBRATION_READINGS_PER_POINT 2
+// Voltages corrected at a time by the encoder
+#define CALIBRATION_BLOCK 256
+
+// Calibration of one channel
+struct USB_Dac_Cal {
+	double gain;
+	double offset;
+	std::vector<double> inl; // corrections in volts, evenly spaced from MIN_VOLTAGE to MAX_VOLTAGE; empty for none
+	unsigned long long hash; // hash of the table, to tell steps encoded with different tables apart
+};
+
+class USB_Dac_Calibration{
+public:
+	// Read the tables from a calibration file, replacing any read before; returns false if it can't be read
+	static bool Load(const std::string & file);
+	// Write the tables to a calibration file
+	static bool Save(const std::string & file);
+
+	// Table for a channel of a device by serial, or for a global channel once the boards are open; NULL for none
+	static const USB_Dac_Cal * Find(const std::string & serial, unsigned channel);
+	static const USB_Dac_Cal * Find(unsigned channel);
+	// Hash of a global channel's table, 0 when it has none
+	static unsigned long long Hash(unsigned channel);
+
+	// Correct count voltages and clamp them into range; with no table they are only clamped
+	static void Apply(const USB_Dac_Cal * cal, const double * vIn, double * vOut, size_t count);
+
+	// Fit a table for every channel in a measurement file, then write them to a calibration file
+	static bool Fit(const std::string & measurements, const std::string & file);
+
+	// Tables by serial and channel on that device
+	static std::map<std::pair<std::string, unsigned>, USB_Dac_Cal> Tables;
+
+private:
+	// Work out the hash of a table from its numbers
+	static void Finish(USB_Dac_Cal & cal);
+};
+
+#endif
@@ -0,0 +1,226 @@
+// Experiment.cpp : parallel compile of every step of an experiment
+#include "stdafx.h"
+using namespace std;
+
+#include <chrono> // for timing the compile
+#include <algorithm> // for sorting the channel list
+#include "Experiment.h"
+#include "Work_Pool.h"
+#include "Step_Cache.h"
+#include "Dac_Calibration.h"
+
+// A step being compiled; each job writes only its own parts, so no locks are needed
+struct USB_Compile_Step {
+	const USB_Experiment_Entry * entry;
+	USB_Step_Key key;
+	bool keyed;
+	bool ok;
+	std::string error; // printed once the pool is done, so messages from different threads don't mix
+	std::vector<double> vTime, vVals, vdV;
+	std::vector<USBWVF_bytes> parts; // encoded ranges of lines, in order
+	std::vector<USB_Logic_Encode_State> logicStarts; // where each range of a logic step starts
+};
+
+bool USB_Experiment::Load(const std::string & file, std::vector<USB_Experiment_Entry> & entries)
+{
+	ifstream fs(file.c_str());
+	if (!fs.is_open()) {
+		std::cout << "Could not open experiment file " << file << std::endl;
+		return false;
+	}
+	entries.clear();
+	std::string line;
+	unsigned lineNum = 0;
+	while (getline(fs, line)) {
+		lineNum++;
+		std::stringstream sss(line);
+		USB_Experiment_Entry entry;
+		if (!(sss >> entry.device)) {
+			// blank line or comment
+			continue;
+		}
+		if (!(sss >> entry.channel >> entry.step >> entry.file)) {
+			std::cout << file << " line " << lineNum << ": expected device channel step file" << std::endl;
+			return false;
+		}
+		entry.wvfchan = USB_Waveform_Manager::GlobalChannel(entry.device, entry.channel);
+		if (entry.wvfchan == USB_NO_CHANNEL) {
+			std::cout << file << " line " << lineNum << ": device " << entry.device << " has no channel " << entry.channel << std::endl;
+			return false;
+		}
+		entry.kind = (entry.wvfchan == USB_Waveform_Manager::LogicChannel(entry.device)) ? STEP_KIND_LOGIC : STEP_KIND_DAC;
+		entries.push_back(entry);
+	}
+	return true;
+}
+
+// Encodes one range of lines of a step; waveform times start from the end of the line before the range,
+// which is long enough that no line is held over it, and logic times from where the vectors before it end,
+// so the ranges join up as if encoded in one go
+static void EncodeRange(USB_Compile_Step & cs, size_t part, size_t first, size_t last)
+{
+	USBWVF_bytes & out = cs.parts[part];
+	size_t count = last - first;
+	bool end = (part + 1 == cs.parts.size());
+	if (cs.entry->kind == STEP_KIND_LOGIC) {
+		out.reserve(4 * count + 2);
+		if (count) {
+			USB_Logic_Encode_State state = cs.logicStarts[part];
+			USB_Waveform_Manager::LogicEncodeLines(out, &cs.vTime[first], &cs.vVals[first], count, state);
+		}
+		if (end) {
+			USB_Waveform_Manager::LogicEncodeEnd(out);
+		}
+	}
+	else {
+		out.reserve(8 * count + 4);
+		USB_Wvf_Encode_State state(USB_Dac_Calibration::Find(cs.entry->wvfchan));
+		state.tick = first ? USB_Waveform_Manager::DacTicks(cs.vTime[first - 1]) : 0;
+		state.lineEnd = state.tick;
+		if (count) {
+			USB_Waveform_Manager::WvfEncodeLines(out, &cs.vTime[first], &cs.vVals[first], &cs.vdV[first], count, state);
+		}
+		if (end) {
+			USB_Waveform_Manager::WvfEncodeEnd(out, state);
+		}
+	}
+}
+
+// Reads a step's file, then hands its ranges of lines to the pool to encode
+static void ParseStep(Work_Pool & pool, USB_Compile_Step & cs)
+{
+	ifstream fs(cs.entry->file.c_str());
+	if (!fs.is_open()) {
+		cs.error = "Could not open " + cs.entry->file;
+		return;
+	}
+	std::string line;
+	double t, val, dV;
+	bool logic = (cs.entry->kind == STEP_KIND_LOGIC);
+	while (getline(fs, line)) {
+		int parsed = USB_Waveform_Manager::ParseLine(line, logic, t, val, dV);
+		if (parsed < 0) {
+			cs.error = "Error: unidentified logic signals found in " + cs.entry->file;
+			return;
+		}
+		if (parsed > 0) {
+			cs.vTime.push_back(t);
+			cs.vVals.push_back(val);
+			if (!logic) {
+				cs.vdV.push_back(dV);
+			}
+		}
+	}
+	cs.ok = true;
+
+	// Waveform ranges start after a line of at least 3 * MIN_LINE_TICKS updates: a held line can take less than
+	// MIN_LINE_TICKS from it, and the rounding before it less again, so the line is always encoded whole and on time
+	size_t lines = cs.vTime.size();
+	std::vector<size_t> starts(1, 0);
+	for (size_t first = COMPILE_SPLIT_LINES; first < lines; first += COMPILE_SPLIT_LINES) {
+		if (!logic) {
+			while (first < lines && USB_Waveform_Manager::DacTicks(cs.vTime[first - 1])
+				- (first > 1 ? USB_Waveform_Manager::DacTicks(cs.vTime[first - 2]) : 0) < 3 * MIN_LINE_TICKS) {
+				first++;
+			}
+		}
+		if (first < lines) {
+			starts.push_back(first);
+		}
+	}
+	if (logic) {
+		// A lengthened logic vector can push any number of vectors after it late, so the update each range starts
+		// on is found by running through the durations before it, which costs little next to encoding them
+		USB_Logic_Encode_State state;
+		for (size_t part = 0, k = 0; part < starts.size(); part++) {
+			for (; k < starts[part]; k++) {
+				USB_Waveform_Manager::LogicVectorTicks(cs.vTime[k], state);
+			}
+			cs.logicStarts.push_back(state);
+		}
+	}
+	cs.parts.resize(starts.size());
+	for (size_t part = 0; part < cs.parts.size(); part++) {
+		size_t first = starts[part];
+		size_t last = (part + 1 < starts.size()) ? starts[part + 1] : lines;
+		USB_Compile_Step * step = &cs;
+		pool.Submit([step, part, first, last] { EncodeRange(*step, part, first, last); });
+	}
+}
+
+bool USB_Experiment::Compile(const std::vector<USB_Experiment_Entry> & entries, unsigned threads)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// Steps in the cache need no work; the cache isn't shared between threads, so this is done first
+	std::vector<USB_Compile_Step> work;
+	work.reserve(entries.size());
+	for (size_t i = 0; i < entries.size(); i++) {
+		const USB_Experiment_Entry & entry = entries[i];
+		USB_Compile_Step cs;
+		cs.entry = &entry;
+		cs.ok = false;
+		cs.keyed = USB_Step_Cache::MakeKey(entry.file, entry.kind, entry.wvfchan, cs.key);
+		if (cs.keyed && USB_Step_Cache::Fetch(cs.key, USB_Waveform_Manager::USBWvf[entry.wvfchan][entry.step])) {
+			continue;
+		}
+		work.push_back(cs);
+	}
+
+	// Parse every step on the pool; each parse submits the encoding of its ranges
+	unsigned used;
+	unsigned long steals;
+	{
+		Work_Pool pool(threads);
+		used = pool.Threads();
+		for (size_t i = 0; i < work.size(); i++) {
+			USB_Compile_Step * step = &work[i];
+			Work_Pool * workers = &pool;
+			pool.Submit([workers, step] { ParseStep(*workers, *step); });
+		}
+		pool.Wait();
+		steals = pool.Steals();
+	}
+
+	// Join the ranges of each step in order, and keep the steps like any others
+	bool compiled = true;
+	for (size_t i = 0; i < work.size(); i++) {
+		USB_Compile_Step & cs = work[i];
+		if (!cs.ok) {
+			std::cout << cs.error << std::endl;
+			compiled = false;
+			continue;
+		}
+		size_t total = 0;
+		for (size_t part = 0; part < cs.parts.size(); part++) {
+			total += cs.parts[part].size();
+		}
+		USBWVF_bytes bytes;
+		bytes.reserve(total);
+		for (size_t part = 0; part < cs.parts.size(); part++) {
+			bytes.insert(bytes.end(), cs.parts[part].begin(), cs.parts[part].end());
+		}
+		USBWVF_data & wvfchanstep = USB_Waveform_Manager::USBWvf[cs.entry->wvfchan][cs.entry->step];
+		wvfchanstep = USBWVF_data(bytes);
+		wvfchanstep.intern();
+		if (cs.keyed) {
+			USB_Step_Cache::Store(cs.key, wvfchanstep);
+		}
+	}
+
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Compiled " << entries.size() << " steps (" << entries.size() - work.size() << " from cache) in "
+		<< ms << " ms on " << used << " threads, " << steals << " jobs stolen" << std::endl;
+	return compiled;
+}
+
+std::vector<unsigned> USB_Experiment::Channels(const std::vector<USB_Experiment_Entry> & entries)
+{
+	std::vector<unsigned> channels;
+	for (size_t i = 0; i < entries.size(); i++) {
+		channels.push_back(entries[i].wvfchan);
+	}
+	std::sort(channels.begin(), channels.end());
+	channels.erase(std::unique(channels.begin(), channels.end()), channels.end());
+	return channels;
+}
@@ -0,0 +1,40 @@
+/*
+Header file for compiling a whole experiment: every step of every channel on every board
+An experiment file lists the file for each step; all of them are parsed and encoded in parallel
+on a work-stealing pool, with big steps split into ranges of lines encoded on their own
+*/
+
+#ifndef EXPERIMENT_H
+#define EXPERIMENT_H
+
+#include <vector> // needed for the steps of an experiment
+#include <string> // needed for file names
+#include "USB_Device.h" // for the waveform manager
+
+// Steps with more lines than this are encoded in ranges of this many lines
+#define COMPILE_SPLIT_LINES 8192
+
+// One step of an experiment, one line of the experiment file
+struct USB_Experiment_Entry {
+	unsigned device; // device and channel as chosen in the menu
+	unsigned channel;
+	unsigned step;
+	std::string file;
+	unsigned wvfchan; // channel number in the waveform map
+	unsigned kind; // STEP_KIND_LOGIC on the logic channel of a device, STEP_KIND_DAC otherwise
+};
+
+class USB_Experiment{
+public:
+	// Read an experiment file: one "device channel step file" per line, lines starting with # are skipped
+	static bool Load(const std::string & file, std::vector<USB_Experiment_Entry> & entries);
+
+	// Encode every step of an experiment into USBWvf, using a number of threads, one per core when 0
+	// Steps already in the step cache are taken from there
+	static bool Compile(const std::vector<USB_Experiment_Entry> & entries, unsigned threads);
+
+	// The channels an experiment uses, in order
+	static std::vector<unsigned> Channels(const std::vector<USB_Experiment_Entry> & entries);
+};
+
+#endif
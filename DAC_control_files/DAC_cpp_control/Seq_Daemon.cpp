@@ -0,0 +1,267 @@
+// Seq_Daemon.cpp : sequencer daemon serving requests over a local socket
+#include "stdafx.h"
+using namespace std;
+
+#include <chrono> // for timing each request
+#include <string.h> // for memcpy
+#include <stdio.h> // for remove
+#ifdef _WIN32
+#include <winsock2.h> // for sockets
+#include <afunix.h> // for local sockets, Windows 10 and later
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET daemon_socket;
+#define DAEMON_CLOSE closesocket
+#define DAEMON_SEND_FLAGS 0
+#else
+#include <sys/socket.h> // for sockets
+#include <sys/un.h> // for local sockets
+#include <unistd.h> // for close
+#include <signal.h> // for ignoring SIGPIPE
+typedef int daemon_socket;
+#define INVALID_SOCKET (-1)
+#define DAEMON_CLOSE close
+// A client that goes away before reading its replies must not take the daemon, and the boards, down with it
+#ifdef MSG_NOSIGNAL
+#define DAEMON_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define DAEMON_SEND_FLAGS 0
+#endif
+#endif
+#include "USB_Device.h"
+#include "Step_Cache.h" // for the step kinds
+#include "Seq_Daemon.h"
+
+bool Seq_Daemon::stopping = false;
+
+// Reads little endian words out of a request
+static unsigned ReadWord(const unsigned char * p, unsigned bytes)
+{
+	unsigned value = 0;
+	for (unsigned j = 0; j < bytes; j++) {
+		value |= unsigned(p[j]) << (8 * j);
+	}
+	return value;
+}
+
+// Writes little endian words into a reply
+static void PutWord(std::vector<unsigned char> & out, unsigned value, unsigned bytes)
+{
+	for (unsigned j = 0; j < bytes; j++) {
+		out.push_back((unsigned char) (value >> (8 * j)));
+	}
+}
+
+// Reads an array of little endian doubles from a payload
+static void ReadDoubles(const unsigned char * p, unsigned count, std::vector<double> & out)
+{
+	out.resize(count);
+	for (unsigned i = 0; i < count; i++) {
+		unsigned long long bits = 0;
+		for (unsigned j = 0; j < 8; j++) {
+			bits |= (unsigned long long) p[8 * i + j] << (8 * j);
+		}
+		memcpy(&out[i], &bits, sizeof(double));
+	}
+}
+
+unsigned char Seq_Daemon::Handle(unsigned char op, unsigned char kind, unsigned channel, unsigned step,
+	const unsigned char * payload, unsigned length)
+{
+	switch (op)
+	{
+	case DAEMON_OP_PING:
+		return DAEMON_OK;
+
+	case DAEMON_OP_LOAD_FILE:
+	{
+		std::string file((const char *) payload, length);
+		unsigned devIndex, local_chan;
+		if (!USB_Waveform_Manager::Route(channel, devIndex, local_chan)) {
+			return DAEMON_BAD_REQUEST;
+		}
+		bool loaded;
+		if (kind == STEP_KIND_LOGIC) {
+			// logic files always go to the logic channel of the device holding the channel
+			loaded = Logicstep(file, devIndex, step);
+		}
+		else if (kind == STEP_KIND_DAC) {
+			loaded = Waveform(file, devIndex, local_chan, step);
+		}
+		else {
+			return DAEMON_BAD_REQUEST;
+		}
+		return loaded ? DAEMON_OK : DAEMON_FAILED;
+	}
+
+	case DAEMON_OP_LOAD_POINTS:
+	{
+		std::vector<double> values;
+		if (kind == STEP_KIND_DAC && length % 24 == 0) {
+			ReadDoubles(payload, length / 8, values);
+			unsigned n = length / 24;
+			std::vector<double> vT(n), vV(n), vD(n);
+			for (unsigned i = 0; i < n; i++) {
+				vT[i] = values[3 * i];
+				vV[i] = values[3 * i + 1];
+				vD[i] = values[3 * i + 2];
+			}
+			return USB_Waveform_Manager::WvfFill(channel, step, vT, vV, vD) ? DAEMON_OK : DAEMON_FAILED;
+		}
+		if (kind == STEP_KIND_LOGIC && length % 16 == 0) {
+			ReadDoubles(payload, length / 8, values);
+			unsigned n = length / 16;
+			std::vector<double> vT(n), vL(n);
+			for (unsigned i = 0; i < n; i++) {
+				vT[i] = values[2 * i];
+				vL[i] = values[2 * i + 1];
+			}
+			return USB_Waveform_Manager::LogicFill(channel, step, vT, vL) ? DAEMON_OK : DAEMON_FAILED;
+		}
+		return DAEMON_BAD_REQUEST;
+	}
+
+	case DAEMON_OP_WRITE:
+		return USB_Waveform_Manager::Write(channel) ? DAEMON_OK : DAEMON_FAILED;
+
+	case DAEMON_OP_RUN:
+		return USB_Waveform_Manager::Run(channel) ? DAEMON_OK : DAEMON_FAILED;
+
+	case DAEMON_OP_CLEAR:
+		USB_Waveform_Manager::WvfClear(channel == 0xFFFF ? -1 : int(channel), step == 0xFFFFFFFF ? -1 : int(step));
+		return DAEMON_OK;
+
+	case DAEMON_OP_SHUTDOWN:
+		stopping = true;
+		return DAEMON_OK;
+
+	default:
+		return DAEMON_BAD_REQUEST;
+	}
+}
+
+bool Seq_Daemon::Serve(const std::string & socketPath)
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+		std::cout << "Could not start Windows sockets" << std::endl;
+		return false;
+	}
+#endif
+
+#ifndef _WIN32
+	// Where send can't be told not to raise SIGPIPE, a closed client fails the send instead
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	struct sockaddr_un addr;
+	if (socketPath.size() >= sizeof(addr.sun_path)) {
+		std::cout << "Socket path is too long: " << socketPath << std::endl;
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, socketPath.c_str(), socketPath.size());
+
+	daemon_socket listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET) {
+		std::cout << "Could not create the daemon socket" << std::endl;
+		return false;
+	}
+	// A socket left behind by an earlier daemon would block the bind
+	remove(socketPath.c_str());
+	if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, 4) != 0) {
+		std::cout << "Could not listen on " << socketPath << std::endl;
+		DAEMON_CLOSE(listener);
+		return false;
+	}
+	std::cout << "Sequencer daemon listening on " << socketPath << std::endl;
+
+	stopping = false;
+	while (!stopping) {
+		daemon_socket client = accept(listener, NULL, NULL);
+		if (client == INVALID_SOCKET) {
+			continue;
+		}
+		std::cout << "Client connected" << std::endl;
+
+		// Bytes received but not yet handled, and replies not yet sent
+		std::vector<unsigned char> inbuf;
+		std::vector<unsigned char> outbuf;
+		char chunk[65536];
+		unsigned long served = 0;
+		double totalUs = 0;
+		double maxUs = 0;
+
+		bool connected = true;
+		while (connected && !stopping) {
+			int got = recv(client, chunk, sizeof(chunk), 0);
+			if (got <= 0) {
+				connected = false;
+				break;
+			}
+			inbuf.insert(inbuf.end(), chunk, chunk + got);
+
+			// Handle every complete request received so far; pipelined requests are answered together
+			size_t pos = 0;
+			while (inbuf.size() - pos >= DAEMON_HEADER_SIZE) {
+				const unsigned char * h = &inbuf[pos];
+				unsigned length = ReadWord(h + 12, 4);
+				if (length > DAEMON_MAX_PAYLOAD) {
+					// The stream can't be followed past a bad length
+					std::cout << "Request payload too large, dropping the client" << std::endl;
+					connected = false;
+					break;
+				}
+				if (inbuf.size() - pos < DAEMON_HEADER_SIZE + length) {
+					break;
+				}
+
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				unsigned char op = h[0];
+				unsigned char status = Handle(op, h[1], ReadWord(h + 2, 2), ReadWord(h + 8, 4),
+					length ? h + DAEMON_HEADER_SIZE : NULL, length);
+				double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+				PutWord(outbuf, ReadWord(h + 4, 4), 4);
+				outbuf.push_back(op);
+				outbuf.push_back(status);
+				PutWord(outbuf, 0, 2);
+				PutWord(outbuf, unsigned(us), 4);
+				PutWord(outbuf, 0, 4);
+
+				served++;
+				totalUs += us;
+				if (us > maxUs) { maxUs = us; }
+				pos += DAEMON_HEADER_SIZE + length;
+			}
+			inbuf.erase(inbuf.begin(), inbuf.begin() + pos);
+
+			// Send the replies for this batch
+			size_t sent = 0;
+			while (sent < outbuf.size()) {
+				int n = send(client, (const char *) &outbuf[sent], int(outbuf.size() - sent), DAEMON_SEND_FLAGS);
+				if (n <= 0) {
+					connected = false;
+					break;
+				}
+				sent += n;
+			}
+			outbuf.clear();
+		}
+
+		DAEMON_CLOSE(client);
+		std::cout << "Client disconnected after " << served << " requests";
+		if (served) {
+			std::cout << ", mean " << totalUs / served << " us, max " << maxUs << " us per request";
+		}
+		std::cout << std::endl;
+	}
+
+	DAEMON_CLOSE(listener);
+	remove(socketPath.c_str());
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return true;
+}
@@ -0,0 +1,54 @@
+/*
+Header file for the sequencer daemon
+Keeps the USB devices open and takes upload, run and clear requests from a local socket
+
+Every request is a 16 byte header followed by its payload, all little endian like the data sent to the FPGA:
+	BYTE op, BYTE kind, 2 bytes channel, 4 bytes id, 4 bytes step, 4 bytes payload length
+Every request gets a 16 byte reply, in the order the requests were sent:
+	4 bytes id, BYTE op, BYTE status, 2 bytes reserved, 4 bytes latency in microseconds, 4 bytes reserved
+Requests may be sent back to back without waiting for their replies
+*/
+
+#ifndef SEQ_DAEMON_H
+#define SEQ_DAEMON_H
+
+#include <string> // needed for the socket path
+
+// Default place for the socket, relative to the working folder
+#define DAEMON_SOCKET "dac_sequencer.sock"
+
+// Sizes of the request and reply headers
+#define DAEMON_HEADER_SIZE 16
+#define DAEMON_REPLY_SIZE 16
+// Largest payload accepted in one request
+#define DAEMON_MAX_PAYLOAD (64 * 1024 * 1024)
+
+// Request op-codes
+#define DAEMON_OP_PING 0 // does nothing, for measuring round trips
+#define DAEMON_OP_LOAD_FILE 1 // payload is a file name; kind picks a waveform or logic file
+#define DAEMON_OP_LOAD_POINTS 2 // payload is doubles: time, start and end voltage per line, or duration and logic vector per line
+#define DAEMON_OP_WRITE 3 // send all the steps of a channel to its device
+#define DAEMON_OP_RUN 4 // run the next sequence in a channel
+#define DAEMON_OP_CLEAR 5 // clear a step, or a channel with step 0xFFFFFFFF, or everything with channel 0xFFFF
+#define DAEMON_OP_SHUTDOWN 6 // stop the daemon
+
+// Reply status values
+#define DAEMON_OK 0
+#define DAEMON_FAILED 1 // the request was understood but did not succeed
+#define DAEMON_BAD_REQUEST 2 // unknown op-code or malformed payload
+
+class Seq_Daemon{
+public:
+	// Listen on a socket and serve requests until a shutdown request arrives; returns false if the socket can't be opened
+	static bool Serve(const std::string & socketPath);
+
+private:
+	// Carry out one request and return its status
+	static unsigned char Handle(unsigned char op, unsigned char kind, unsigned channel, unsigned step,
+		const unsigned char * payload, unsigned length);
+
+	// Set by a shutdown request
+	static bool stopping;
+};
+
+#endif
@@ -0,0 +1,201 @@
+// Step_Cache.cpp : cache of encoded waveform and logic steps
+#include "stdafx.h"
+using namespace std;
+
+#include <stdio.h> // for sprintf, and rename and remove for replacing images
+#include <string.h> // for memcmp
+#include <chrono> // for when a file was hashed
+#include <sys/types.h> // for stat
+#include <sys/stat.h> // for the file size and modification time
+#ifdef _WIN32
+#include <direct.h> // for _mkdir
+#endif
+#include "Step_Cache.h"
+#include "properties.h"
+#include "Dac_Calibration.h"
+
+// Images and file stamps held in memory for the life of the program
+std::map<std::string, USBWVF_data> USB_Step_Cache::Images;
+std::map<std::string, USB_File_Stamp> USB_Step_Cache::FileStamps;
+unsigned long USB_Step_Cache::hits = 0;
+unsigned long USB_Step_Cache::misses = 0;
+
+// Header written at the start of every image on disk, followed by the length and hash of the data
+static const char STEP_CACHE_MAGIC[4] = { 'S', 'T', 'P', '2' };
+
+bool USB_Step_Cache::StatFile(const std::string & file, unsigned long long & size, long long & mtime)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(file.c_str(), &st) != 0) {
+		return false;
+	}
+	// only whole seconds here, the racy check in MakeKey covers the rest
+	mtime = (long long) st.st_mtime * 1000000000LL;
+#else
+	struct stat st;
+	if (stat(file.c_str(), &st) != 0) {
+		return false;
+	}
+#ifdef __APPLE__
+	mtime = (long long) st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+	mtime = (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+#endif
+	size = (unsigned long long) st.st_size;
+	return true;
+}
+
+bool USB_Step_Cache::MakeKey(const std::string & file, unsigned kind, unsigned channel, USB_Step_Key & key)
+{
+	if (!StatFile(file, key.size, key.mtime)) {
+		// file isn't there
+		return false;
+	}
+
+	key.file = file;
+	key.params = kind | (STEP_CACHE_VERSION << 8);
+	if (kind == STEP_KIND_DAC && FREERUN == TRUE) {
+		// the loop op-code is only added to DAC steps
+		key.params |= 0x10;
+	}
+	// the same file encodes differently for each calibration
+	key.calibration = (kind == STEP_KIND_DAC) ? USB_Dac_Calibration::Hash(channel) : 0;
+
+	// A file with the same size and time as before keeps its hash, if it was last changed well before it was hashed
+	// A file changed just before it was hashed can be changed again within the same tick of the file time
+	std::map<std::string, USB_File_Stamp>::iterator itf = FileStamps.find(file);
+	if (itf != FileStamps.end() && itf->second.size == key.size && itf->second.mtime == key.mtime
+		&& itf->second.hashed - itf->second.mtime > STEP_CACHE_RACY_NS) {
+		key.hash = itf->second.hash;
+		return true;
+	}
+
+	// Otherwise hash the content; this is much cheaper than parsing and encoding it
+	long long hashed = (long long) std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	ifstream fs(file.c_str(), ios::in | ios::binary);
+	if (!fs.is_open()) {
+		return false;
+	}
+	std::string content((istreambuf_iterator<char>(fs)), istreambuf_iterator<char>());
+	fs.close();
+	key.size = content.size();
+	key.hash = USB_Step_Pool::HashBytes(content.data(), content.size());
+
+	USB_File_Stamp stamp;
+	stamp.size = key.size;
+	stamp.mtime = key.mtime;
+	stamp.hash = key.hash;
+	stamp.hashed = hashed;
+	FileStamps[file] = stamp;
+	return true;
+}
+
+std::string USB_Step_Cache::ImageName(const USB_Step_Key & key)
+{
+	// The file name isn't part of the image name, so the same shape saved under different names is shared
+	char name[96];
+	sprintf(name, "%016llx_%llu_%x_%016llx.stp", key.hash, key.size, key.params, key.calibration);
+	return std::string(name);
+}
+
+bool USB_Step_Cache::Fetch(const USB_Step_Key & key, USBWVF_data & data)
+{
+	std::string name = ImageName(key);
+
+	// Check memory first
+	std::map<std::string, USBWVF_data>::iterator iti = Images.find(name);
+	if (iti != Images.end()) {
+		data = iti->second;
+		hits++;
+		return true;
+	}
+
+	// Then check the cache folder
+	ifstream fs((std::string(STEP_CACHE_DIR) + "/" + name).c_str(), ios::in | ios::binary);
+	if (fs.is_open()) {
+		char magic[4];
+		unsigned char lenBytes[4];
+		unsigned char hashBytes[8];
+		fs.read(magic, 4);
+		fs.read((char *) lenBytes, 4);
+		fs.read((char *) hashBytes, 8);
+		if (fs && memcmp(magic, STEP_CACHE_MAGIC, 4) == 0) {
+			// length and hash are stored little endian, like the data sent to the FPGA
+			unsigned long length = lenBytes[0] | (lenBytes[1] << 8) | (lenBytes[2] << 16) | ((unsigned long) lenBytes[3] << 24);
+			unsigned long long hash = 0;
+			for (unsigned j = 0; j < 8; j++) {
+				hash |= (unsigned long long) hashBytes[j] << (8 * j);
+			}
+			USBWVF_bytes bytes(length);
+			if (length > 0) {
+				fs.read((char *) &bytes[0], length);
+			}
+			// The image must hold exactly the data its header promises
+			if (fs && fs.peek() == EOF && USB_Step_Pool::HashBytes(bytes.empty() ? NULL : &bytes[0], bytes.size()) == hash) {
+				// Share the buffer with any identical step already in memory
+				USBWVF_data image(bytes);
+				image.intern();
+				Images[name] = image;
+				data = image;
+				hits++;
+				return true;
+			}
+		}
+		// A short or damaged image is treated as a miss and overwritten on the next Store
+	}
+
+	misses++;
+	return false;
+}
+
+void USB_Step_Cache::Store(const USB_Step_Key & key, const USBWVF_data & data)
+{
+	std::string name = ImageName(key);
+	USBWVF_data image = data;
+	image.intern();
+	Images[name] = image;
+
+	// Keep a copy on disk for later runs; failures here only cost a re-encode next time
+#ifdef _WIN32
+	_mkdir(STEP_CACHE_DIR);
+#else
+	mkdir(STEP_CACHE_DIR, 0755);
+#endif
+	// The image is written under a temporary name and renamed into place, so a run stopped part way through
+	// never leaves a short image under the real name
+	std::string path = std::string(STEP_CACHE_DIR) + "/" + name;
+	std::string temp = path + ".tmp";
+	ofstream fs(temp.c_str(), ios::out | ios::binary | ios::trunc);
+	if (!fs.is_open()) {
+		return;
+	}
+	unsigned long length = (unsigned long) data.size();
+	unsigned long long hash = USB_Step_Pool::HashBytes(length ? data.data() : NULL, length);
+	unsigned char header[12];
+	for (unsigned j = 0; j < 4; j++) {
+		header[j] = (unsigned char) (length >> (8 * j));
+	}
+	for (unsigned j = 0; j < 8; j++) {
+		header[4 + j] = (unsigned char) (hash >> (8 * j));
+	}
+	fs.write(STEP_CACHE_MAGIC, 4);
+	fs.write((const char *) header, 12);
+	if (length > 0) {
+		fs.write((const char *) data.data(), length);
+	}
+	fs.close();
+	if (!fs) {
+		remove(temp.c_str());
+		return;
+	}
+#ifdef _WIN32
+	// rename doesn't replace an existing file here
+	remove(path.c_str());
+#endif
+	if (rename(temp.c_str(), path.c_str()) != 0) {
+		remove(temp.c_str());
+	}
+}
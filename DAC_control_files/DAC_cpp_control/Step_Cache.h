@@ -0,0 +1,79 @@
+/*
+Header file for the cache of encoded waveform and logic steps
+Steps are stored in memory and on disk, keyed by the content of the source file and the encoding parameters
+*/
+
+#ifndef STEP_CACHE_H
+#define STEP_CACHE_H
+
+#include <map> // needed for the in-memory image and file stamp maps
+#include <string> // needed for file names and keys
+#include "USB_Device.h" // for the USBWVF_data type held in the cache
+
+// Kinds of step, the channel type changes how a file is encoded
+#define STEP_KIND_DAC 0
+#define STEP_KIND_LOGIC 1
+
+// Folder, relative to the working folder, that holds encoded step images between runs
+#define STEP_CACHE_DIR "step_cache"
+// Bump when the encoders change the bytes they produce, so stale images on disk are not reused
+#define STEP_CACHE_VERSION 4
+// A file changed this close to when it was hashed may change again without its size or time changing,
+// in nanoseconds; it is hashed again until it has been left alone for longer (covers 1 and 2 second file times)
+#define STEP_CACHE_RACY_NS 2000000000LL
+
+// Identifies one encoded step: which file it came from and how it was encoded
+struct USB_Step_Key {
+	std::string file; // file name as given by the user
+	unsigned long long size; // file size in bytes
+	long long mtime; // last modification time of the file, in nanoseconds
+	unsigned long long hash; // FNV-1a hash of the file content
+	unsigned params; // encoding parameters: step kind, FREERUN and cache version
+	unsigned long long calibration; // hash of the calibration of the channel, 0 for none or for logic steps
+};
+
+// Size, time and content hash of a file seen before, so unchanged files are not hashed again
+struct USB_File_Stamp {
+	unsigned long long size;
+	long long mtime;
+	unsigned long long hash;
+	long long hashed; // time the content was hashed, in nanoseconds
+};
+
+class USB_Step_Cache{
+public:
+	// Size and modification time of a file in nanoseconds, as finely as the file system keeps it
+	// Returns false if the file isn't there
+	static bool StatFile(const std::string & file, unsigned long long & size, long long & mtime);
+
+	// Fill out a key for a file to be encoded for a channel, returns false if the file can't be read
+	// The content is hashed again unless the size and time match and the file was already old when last hashed
+	static bool MakeKey(const std::string & file, unsigned kind, unsigned channel, USB_Step_Key & key);
+
+	// Share a cached image for the key into data, looking in memory then on disk; returns false on a miss
+	static bool Fetch(const USB_Step_Key & key, USBWVF_data & data);
+
+	// Keep an encoded image for the key in memory and on disk
+	static void Store(const USB_Step_Key & key, const USBWVF_data & data);
+
+	// Forget the remembered hash of a file, so it is read and hashed again the next time a key is made for it
+	static void Forget(const std::string & file) { FileStamps.erase(file); };
+
+	// Forget everything held in memory, images on disk are kept
+	static void Clear() { Images.clear(); FileStamps.clear(); };
+
+	// Counts of lookups served from the cache and lookups that needed encoding
+	static unsigned long hits;
+	static unsigned long misses;
+
+private:
+	// Name of the image for a key, used both in memory and as the file name on disk
+	static std::string ImageName(const USB_Step_Key & key);
+
+	// Encoded images by image name
+	static std::map<std::string, USBWVF_data> Images;
+	// File stamps by file name
+	static std::map<std::string, USB_File_Stamp> FileStamps;
+};
+
+#endif
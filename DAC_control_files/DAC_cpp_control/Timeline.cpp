@@ -0,0 +1,219 @@
+// Timeline.cpp : compiles an experiment timeline into DAC steps and the logic steps that trigger them
+#include "stdafx.h"
+using namespace std;
+
+#include <algorithm> // for sorting segments and logic changes
+#include "Timeline.h"
+
+// A logic line turning on or off
+struct USB_Logic_Change {
+	double time;
+	int bit;
+	int count; // +1 when the line turns on, -1 when it turns off
+};
+
+static bool SegmentOrder(const USB_Timeline_Segment & a, const USB_Timeline_Segment & b) { return a.start < b.start; }
+static bool ChangeOrder(const USB_Logic_Change & a, const USB_Logic_Change & b) { return a.time < b.time; }
+
+bool USB_Timeline::Load(const std::string & file, std::map<unsigned, USB_Timeline_Board> & boards)
+{
+	ifstream fs(file.c_str());
+	if (!fs.is_open()) {
+		std::cout << "Could not open timeline file " << file << std::endl;
+		return false;
+	}
+	boards.clear();
+	std::string line, kind, shape, symbol;
+	unsigned lineNum = 0;
+	while (getline(fs, line)) {
+		lineNum++;
+		std::stringstream sss(line);
+		if (!(sss >> kind) || kind[0] == '#') {
+			continue;
+		}
+		unsigned device, channel;
+		bool ok = false;
+		if (kind == "dac" && (sss >> device >> channel >> shape)) {
+			USB_Timeline_Segment seg;
+			if (shape == "ramp") {
+				ok = bool(sss >> seg.start >> seg.end >> seg.vStart >> seg.vEnd);
+			}
+			else if (shape == "hold") {
+				ok = bool(sss >> seg.start >> seg.end >> seg.vStart);
+				seg.vEnd = seg.vStart;
+			}
+			if (ok && seg.end <= seg.start) {
+				std::cout << file << " line " << lineNum << ": segment ends before it starts" << std::endl;
+				return false;
+			}
+			if (ok) {
+				boards[device].dac[channel].push_back(seg);
+			}
+		}
+		else if (kind == "logic" && (sss >> device >> symbol)) {
+			USB_Timeline_Pulse pulse;
+			pulse.bit = USB_Waveform_Manager::LogicBit(symbol);
+			if (symbol == "d0" || symbol == "d1") {
+				std::cout << file << " line " << lineNum << ": d0 and d1 trigger the DACs and are set by the compiler" << std::endl;
+				return false;
+			}
+			ok = pulse.bit > 0 && bool(sss >> pulse.on >> pulse.off) && pulse.off > pulse.on;
+			if (ok) {
+				boards[device].pulses.push_back(pulse);
+			}
+		}
+		if (!ok) {
+			std::cout << file << " line " << lineNum << ": not a dac ramp, dac hold or logic pulse" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Adds the line for one segment to a DAC step; times are from the start of the step
+// The encoder splits segments longer than a line can be
+static void AddSegment(const USB_Timeline_Segment & seg, double stepStart,
+	std::vector<double> & vTime, std::vector<double> & vVals, std::vector<double> & vdV)
+{
+	vTime.push_back(seg.end - stepStart);
+	vVals.push_back(seg.vStart);
+	vdV.push_back(seg.vEnd);
+}
+
+bool USB_Timeline::Compile(const std::map<unsigned, USB_Timeline_Board> & boards, std::vector<unsigned> & channels)
+{
+	channels.clear();
+	for (std::map<unsigned, USB_Timeline_Board>::const_iterator itb = boards.begin(); itb != boards.end(); ++itb) {
+		unsigned device = itb->first;
+		const USB_Timeline_Board & board = itb->second;
+		unsigned logchan = USB_Waveform_Manager::LogicChannel(device);
+		if (logchan == USB_NO_CHANNEL) {
+			std::cout << "Device " << device << " has no logic channel to run its timeline" << std::endl;
+			return false;
+		}
+
+		// Logic changes from the pulses in the file, and from the DAC triggers added below
+		std::vector<USB_Logic_Change> changes;
+		for (size_t i = 0; i < board.pulses.size(); i++) {
+			USB_Logic_Change on = { board.pulses[i].on, board.pulses[i].bit, 1 };
+			USB_Logic_Change off = { board.pulses[i].off, board.pulses[i].bit, -1 };
+			changes.push_back(on);
+			changes.push_back(off);
+		}
+
+		// Each DAC channel: segments that follow on from each other are one step, and a gap starts a new step
+		for (std::map<unsigned, std::vector<USB_Timeline_Segment> >::const_iterator itc = board.dac.begin(); itc != board.dac.end(); ++itc) {
+			unsigned channel = itc->first;
+			unsigned wvfchan = USB_Waveform_Manager::GlobalChannel(device, channel);
+			if (wvfchan == USB_NO_CHANNEL || wvfchan == logchan) {
+				std::cout << "Device " << device << " has no DAC channel " << channel << std::endl;
+				return false;
+			}
+			if (channel > 1) {
+				// only DAC0 and DAC1 have a trigger line in the logic vector
+				std::cout << "Channel " << channel << " of device " << device << " can't be triggered by the logic step" << std::endl;
+				return false;
+			}
+			int trigger = USB_Waveform_Manager::LogicBit(channel == 0 ? "d0" : "d1");
+
+			std::vector<USB_Timeline_Segment> segs = itc->second;
+			std::sort(segs.begin(), segs.end(), SegmentOrder);
+			USB_Waveform_Manager::WvfClear(int(wvfchan), -1);
+
+			std::vector<double> vTime, vVals, vdV;
+			unsigned step = 0;
+			double stepStart = 0;
+			for (size_t i = 0; i < segs.size(); i++) {
+				if (i > 0 && segs[i].start < segs[i - 1].end - TIMELINE_JOIN_TIME) {
+					std::cout << "Segments overlap at " << segs[i].start << " ms on channel " << channel << " of device " << device << std::endl;
+					return false;
+				}
+				if (i == 0 || segs[i].start > segs[i - 1].end + TIMELINE_JOIN_TIME) {
+					// A gap: end the step before and trigger a new one
+					if (i > 0) {
+						if (segs[i - 1].end - stepStart < TIMELINE_TRIGGER_TIME || segs[i].start - segs[i - 1].end < TIMELINE_TRIGGER_TIME) {
+							// the trigger pulses would run into each other and the DAC would see one
+							std::cout << "Step ending at " << segs[i - 1].end << " ms on channel " << channel << " of device " << device
+								<< " or the gap after it is shorter than the " << TIMELINE_TRIGGER_TIME << " ms trigger" << std::endl;
+							return false;
+						}
+						USB_Waveform_Manager::WvfFill(wvfchan, step++, vTime, vVals, vdV);
+						vTime.clear(); vVals.clear(); vdV.clear();
+					}
+					stepStart = segs[i].start;
+					USB_Logic_Change on = { stepStart, trigger, 1 };
+					USB_Logic_Change off = { stepStart + TIMELINE_TRIGGER_TIME, trigger, -1 };
+					changes.push_back(on);
+					changes.push_back(off);
+				}
+				AddSegment(segs[i], stepStart, vTime, vVals, vdV);
+			}
+			if (!segs.empty()) {
+				if (segs.back().end - stepStart < TIMELINE_TRIGGER_TIME) {
+					std::cout << "Step ending at " << segs.back().end << " ms on channel " << channel << " of device " << device
+						<< " is shorter than the " << TIMELINE_TRIGGER_TIME << " ms trigger" << std::endl;
+					return false;
+				}
+				USB_Waveform_Manager::WvfFill(wvfchan, step++, vTime, vVals, vdV);
+			}
+
+			size_t bytes = 0;
+			for (USBWVF_channel::iterator its = USB_Waveform_Manager::USBWvf[wvfchan].begin(); its != USB_Waveform_Manager::USBWvf[wvfchan].end(); ++its) {
+				bytes += (its->second).size();
+			}
+			std::cout << "Device " << device << " channel " << channel << ": " << step << " steps, " << bytes / 2 << " words" << std::endl;
+			channels.push_back(wvfchan);
+		}
+
+		// The logic step: one entry for each stretch between changes, with equal neighbours joined
+		// Changes are placed on the logic update nearest their time, and each entry is the difference of two of
+		// those, so rounding never builds up over the step; the encoder repeats entries too long for one
+		std::sort(changes.begin(), changes.end(), ChangeOrder);
+		int counts[8] = { 0 };
+		std::vector<double> vDuration, vLogic;
+		long long from = 0;
+		int logic_val = 0;
+		size_t i = 0;
+		while (i < changes.size()) {
+			long long at = USB_Waveform_Manager::LogicTicks(changes[i].time);
+			if (at > from) {
+				if (at - from < MIN_LOGIC_TICKS) {
+					// the encoder would lengthen it, and every change after it would come late
+					std::cout << "Logic changes at " << from * LOG_UPDATE << " and " << at * LOG_UPDATE << " ms on device " << device
+						<< " are closer than " << MIN_LOGIC_TIME << " ms" << std::endl;
+					return false;
+				}
+				if (!vLogic.empty() && vLogic.back() == logic_val) {
+					vDuration.back() += (at - from) * LOG_UPDATE;
+				}
+				else {
+					vDuration.push_back((at - from) * LOG_UPDATE);
+					vLogic.push_back(logic_val);
+				}
+				from = at;
+			}
+			// every change on the same update is applied before the next stretch
+			for (; i < changes.size() && USB_Waveform_Manager::LogicTicks(changes[i].time) == at; i++) {
+				for (unsigned b = 0; b < 8; b++) {
+					if (changes[i].bit == (1 << b)) {
+						counts[b] += changes[i].count;
+					}
+				}
+			}
+			logic_val = 0;
+			for (unsigned b = 0; b < 8; b++) {
+				if (counts[b] > 0) { logic_val |= 1 << b; }
+			}
+		}
+		// The outputs keep the last vector once the step ends, so it ends on the state after the last change
+		vDuration.push_back(MIN_LOGIC_TICKS * LOG_UPDATE);
+		vLogic.push_back(logic_val);
+
+		USB_Waveform_Manager::WvfClear(int(logchan), -1);
+		USB_Waveform_Manager::LogicFill(logchan, 0, vDuration, vLogic);
+		std::cout << "Device " << device << " logic: " << vLogic.size() << " entries, "
+			<< USB_Waveform_Manager::USBWvf[logchan][0].size() / 2 << " words" << std::endl;
+		channels.push_back(logchan);
+	}
+	return true;
+}
@@ -0,0 +1,60 @@
+/*
+Header file for the experiment timeline compiler
+One file describes the whole experiment: DAC ramps and holds on each channel and pulses on each logic line,
+all in milliseconds from the start of the run. The compiler splits each DAC channel into steps at the gaps
+between its segments, and builds the logic step of each board so that the d0 and d1 lines trigger each
+DAC step when it is due. Every channel of every board is encoded in one pass
+
+Timeline lines, # starts a comment:
+	dac device channel ramp t_start t_end v_start v_end
+	dac device channel hold t_start t_end voltage
+	logic device line t_on t_off		(line is i, l3, l2, l1 or l0)
+*/
+
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <vector> // needed for the segments and pulses
+#include <map> // needed for the boards and channels
+#include <string> // needed for file names
+#include "USB_Device.h" // for the waveform manager
+
+// Length of the d0 and d1 pulses that start a DAC step, in milliseconds
+// A DAC step and the gap after it must each last at least this long, or the DAC would see the same pulse
+// again when the step ends, or two pulses run together into one
+#define TIMELINE_TRIGGER_TIME 0.001
+// Segments of a channel closer than this are run as one step, in milliseconds
+#define TIMELINE_JOIN_TIME USB_DAC_UPDATE
+
+// A ramp or hold on a DAC channel
+struct USB_Timeline_Segment {
+	double start; // start and end time from the start of the run
+	double end;
+	double vStart; // voltage at the start and end
+	double vEnd;
+};
+
+// A logic line held on between two times
+struct USB_Timeline_Pulse {
+	double on;
+	double off;
+	int bit; // value of the line in the logic vector
+};
+
+// Everything happening on one board
+struct USB_Timeline_Board {
+	std::map<unsigned, std::vector<USB_Timeline_Segment> > dac; // segments by channel on the board
+	std::vector<USB_Timeline_Pulse> pulses;
+};
+
+class USB_Timeline{
+public:
+	// Read a timeline file into its boards, by device number
+	static bool Load(const std::string & file, std::map<unsigned, USB_Timeline_Board> & boards);
+
+	// Encode every DAC step and the logic step of every board into USBWVF, replacing what the channels held
+	// Fills out the channels that were encoded, for writing
+	static bool Compile(const std::map<unsigned, USB_Timeline_Board> & boards, std::vector<unsigned> & channels);
+};
+
+#endif
@@ -0,0 +1,1027 @@
+// USB_Device.cpp : class functions for the USB-connected FPGA waveform cards and the waveform manager
+#include "stdafx.h"
+using namespace std;
+
+// Definitions for communication with the DAC device over USB
+#include "USB_Device.h"
+#include "properties.h"
+// Recorder for the bytes written to each device
+#include "Wire_Capture.h"
+#include "Dac_Calibration.h"
+#include <stdlib.h> // for strtod
+#include <string.h> // for memset
+#include <thread> // for waiting before resuming an upload
+#include <chrono> // for the wait times
+#include <algorithm> // for std::max and std::min
+
+// The vector of class instances of USB-connected DAC devices
+std::vector<USB_WaveDev> USB_Waveform_Manager::USBWaveDevList;
+// Holds the channel map of data to be sent to each device
+USBWVF USB_Waveform_Manager::USBWvf;
+// Routing table from global channel to device and local channel, and the first global channel of each device
+std::vector<USB_Route> USB_Waveform_Manager::Routes;
+std::vector<unsigned> USB_Waveform_Manager::FirstChannel;
+// The step buffers last written to each channel
+std::map<unsigned, std::vector<USBWVF_data> > USB_Waveform_Manager::Uploaded;
+// Counts of resumed writes
+unsigned long USB_Waveform_Manager::retries = 0;
+unsigned long long USB_Waveform_Manager::resentBytes = 0;
+unsigned long USB_Waveform_Manager::failedUploads = 0;
+
+// Interned step buffers, and counts of how often sharing them saved a copy
+std::multimap<unsigned long long, std::weak_ptr<USBWVF_bytes> > USB_Step_Pool::Pool;
+unsigned long USB_Step_Pool::shared = 0;
+unsigned long long USB_Step_Pool::savedBytes = 0;
+const USBWVF_bytes USBWVF_data::EmptyBytes;
+
+// Definitions for the shared step buffers
+USBWVF_bytes & USBWVF_data::edit()
+{
+	if (!buf) {
+		buf.reset(new USBWVF_bytes());
+	}
+	else if (interned || buf.use_count() > 1) {
+		// Someone else may be reading these bytes, so this step gets its own copy to change
+		buf.reset(new USBWVF_bytes(*buf));
+	}
+	interned = false;
+	return *buf;
+}
+
+void USBWVF_data::intern()
+{
+	if (!buf || interned) {
+		return;
+	}
+	buf = USB_Step_Pool::Intern(buf);
+	interned = true;
+}
+
+unsigned long long USB_Step_Pool::HashBytes(const void * data, size_t size)
+{
+	const unsigned char * p = (const unsigned char *) data;
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+std::shared_ptr<USBWVF_bytes> USB_Step_Pool::Intern(const std::shared_ptr<USBWVF_bytes> & buf)
+{
+	unsigned long long h = HashBytes(buf->empty() ? NULL : &(*buf)[0], buf->size());
+	typedef std::multimap<unsigned long long, std::weak_ptr<USBWVF_bytes> >::iterator pool_iter;
+	std::pair<pool_iter, pool_iter> range = Pool.equal_range(h);
+	for (pool_iter itp = range.first; itp != range.second;) {
+		std::shared_ptr<USBWVF_bytes> found = (itp->second).lock();
+		if (!found) {
+			// every step using this buffer is gone
+			itp = Pool.erase(itp);
+			continue;
+		}
+		if (found == buf) {
+			return found;
+		}
+		if (*found == *buf) {
+			shared++;
+			savedBytes += buf->size();
+			return found;
+		}
+		++itp;
+	}
+	Pool.insert(std::make_pair(h, std::weak_ptr<USBWVF_bytes>(buf)));
+	return buf;
+}
+
+// Definitions for class functions for a USB-connected FPGA card
+USB_WaveDev::USB_WaveDev() : written(0) {}
+FT_STATUS USB_WaveDev::Open()
+{
+	// The device is opened by it's serial number, through a new transport of the kind selected
+	transport.reset(USB_Transport::Create());
+	FT_STATUS status = transport->Open(Serial);
+	if (status != FT_OK) {
+		transport.reset();
+	}
+	return status;
+}
+FT_STATUS USB_WaveDev::Write(BYTE* wavePoint, DWORD size)
+{
+	// Write can be used to write a waveform or to send a reset command, etc
+	//std::cout << "USB::WaveDev::Write() started" << std::endl;
+	written = 0;
+	FT_STATUS status = transport ? transport->Write(wavePoint, size, &written) : FT_STATUS(FT_INVALID_HANDLE);
+	if (USB_Wire_Capture::Active()) {
+		// only the bytes the device took, so a replay resends a partial write the way it went out
+		USB_Wire_Capture::Record(Serial, status, wavePoint, written);
+	}
+	return status;
+}
+FT_STATUS USB_WaveDev::Close()
+{
+	// Finished with the device, so closing it
+	if (!transport) {
+		return FT_INVALID_HANDLE;
+	}
+	FT_STATUS status = transport->Close();
+	transport.reset();
+	return status;
+}
+
+// Definitions for the class functions that are longer than one or two lines for the USB waveform manager
+// Sets up a USB waveform device list
+FT_STATUS USB_Waveform_Manager::InitSingleDACMaster(DWORD devIndex, const char * serialNum, unsigned dacNum) {
+	// Sets the serial number and number of DACs to a class instance
+	memset(USBWaveDevList[devIndex].Serial, 0, sizeof(USBWaveDevList[devIndex].Serial));
+	std::string(serialNum).copy(USBWaveDevList[devIndex].Serial, 8);
+	USBWaveDevList[devIndex].num_DACs = dacNum;
+
+	// NULL terminate the last two entries of the serial number, just in case
+	USBWaveDevList[devIndex].Serial[8] = USBWaveDevList[devIndex].Serial[9] = '\0';
+
+	// Opens the device for accessing
+	return USBWaveDevList.at(devIndex).Open();
+}
+
+// Parses a "serial# #ofDACs serial# #ofDACs ..." device list into board definitions
+bool USB_Waveform_Manager::ParseDeviceList(const std::string & deviceList, std::vector<USB_Board_Def> & boards) {
+	string serial; // Have a buffer string
+	stringstream ss(deviceList); // Insert the string into a stream
+	USB_Board_Def board;
+
+	boards.clear();
+	while (ss >> serial) {
+		board.serial = serial;
+		if (!(ss >> board.num_DACs)) {
+			std::cout << "Device list ends without a channel count for " << serial << std::endl;
+			return false;
+		}
+		// the logic channel is the 3rd channel on a board, when there is one
+		board.logic_chan = board.num_DACs > LOGIC ? LOGIC : -1;
+		boards.push_back(board);
+	}
+	return true;
+}
+
+// Reads a topology file, one board per line: "serial# #ofChannels [logic channel, or - for none]"
+// Blank lines and lines starting with # are skipped
+bool USB_Waveform_Manager::LoadTopology(const std::string & file, std::vector<USB_Board_Def> & boards) {
+	ifstream fs(file.c_str());
+	if (!fs.is_open()) {
+		return false;
+	}
+
+	std::string line;
+	unsigned lineNum = 0;
+	boards.clear();
+	while (getline(fs, line)) {
+		lineNum++;
+		stringstream ss(line);
+		USB_Board_Def board;
+		std::string logic;
+		if (!(ss >> board.serial) || board.serial[0] == '#') {
+			continue;
+		}
+		if (!(ss >> board.num_DACs)) {
+			std::cout << file << " line " << lineNum << ": expected a channel count after " << board.serial << std::endl;
+			boards.clear();
+			return false;
+		}
+		if (!(ss >> logic)) {
+			board.logic_chan = board.num_DACs > LOGIC ? LOGIC : -1;
+		}
+		else if (logic == "-") {
+			board.logic_chan = -1;
+		}
+		else {
+			stringstream sl(logic);
+			if (!(sl >> board.logic_chan)) {
+				std::cout << file << " line " << lineNum << ": bad logic channel " << logic << std::endl;
+				boards.clear();
+				return false;
+			}
+		}
+		boards.push_back(board);
+	}
+	return true;
+}
+
+// Checks a set of boards before any are opened
+bool USB_Waveform_Manager::ValidateTopology(const std::vector<USB_Board_Def> & boards) {
+	bool valid = true;
+	std::map<std::string, unsigned> seen;
+	for (unsigned i = 0; i < boards.size(); i++) {
+		const USB_Board_Def & board = boards[i];
+		if (board.serial.size() > 8) {
+			// serial numbers are 8 characters
+			std::cout << "Board " << i << ": serial number " << board.serial << " is longer than 8 characters" << std::endl;
+			valid = false;
+		}
+		if (seen.find(board.serial) != seen.end()) {
+			std::cout << "Board " << i << ": serial number " << board.serial << " is already used by board " << seen[board.serial] << std::endl;
+			valid = false;
+		}
+		seen[board.serial] = i;
+		if (board.num_DACs == 0 || board.num_DACs > USB_FPGA_CHANNELS) {
+			// the firmware only decodes channels 0 to USB_FPGA_CHANNELS - 1, anything higher would land on none of them
+			std::cout << "Board " << i << " (" << board.serial << "): channel count must be 1 to " << USB_FPGA_CHANNELS << std::endl;
+			valid = false;
+		}
+		if (board.logic_chan >= int(board.num_DACs)) {
+			std::cout << "Board " << i << " (" << board.serial << "): logic channel " << board.logic_chan << " is not on the board" << std::endl;
+			valid = false;
+		}
+		else if (board.logic_chan >= 0 && board.logic_chan != LOGIC) {
+			// the firmware drives the logic lines from channel LOGIC only
+			std::cout << "Board " << i << " (" << board.serial << "): logic channel must be " << LOGIC << std::endl;
+			valid = false;
+		}
+	}
+	return valid;
+}
+
+// Sizes the device list to a set of boards, opens each one and builds the routing table
+unsigned USB_Waveform_Manager::OpenBoards(const std::vector<USB_Board_Def> & boards) {
+	// This sets the serial numbers and number of DACs of the devices and opens them for accessing
+	unsigned numDevs = 0;
+	unsigned DACtotal = unsigned(boards.size());
+	// Size the vector of devices to match the number of attached devices
+	ListSize(DACtotal);
+	Routes.clear();
+	FirstChannel.clear();
+	// Nothing is known about the memory of freshly opened boards
+	Uploaded.clear();
+	for (unsigned i = 0; i < DACtotal; i++) {
+		const char * serialNum = boards[i].serial.c_str();
+		USBWaveDevList[i].logic_chan = boards[i].logic_chan;
+		if (InitSingleDACMaster(i, serialNum, boards[i].num_DACs) == FT_OK) {
+			// No errors detected
+			std::cout << "Connected to device " << serialNum << endl;
+			numDevs++;
+		}
+		else {
+			// failure
+			std::cout << "Did not find device " << serialNum << endl;
+		}
+
+		// Every channel of the board gets the next global channel numbers, even if the board didn't open
+		FirstChannel.push_back(unsigned(Routes.size()));
+		for (unsigned c = 0; c < boards[i].num_DACs; c++) {
+			USB_Route route;
+			route.devIndex = i;
+			route.local_chan = c;
+			Routes.push_back(route);
+		}
+	}
+	return numDevs;
+}
+
+// Parses a device list and opens every device in it, returns the number of devices that opened
+unsigned USB_Waveform_Manager::OpenDevices(const std::string & deviceList) {
+	std::vector<USB_Board_Def> boards;
+	if (!ParseDeviceList(deviceList, boards) || !ValidateTopology(boards)) {
+		return 0;
+	}
+	return OpenBoards(boards);
+}
+
+// Opens the boards listed in a topology file, or in USB_DEVICE_LIST if there is no such file
+unsigned USB_Waveform_Manager::OpenTopology(const std::string & file) {
+	std::vector<USB_Board_Def> boards;
+	ifstream fs(file.c_str());
+	if (!fs.is_open()) {
+		return OpenDevices(USB_DEVICE_LIST);
+	}
+	fs.close();
+	std::cout << "Reading board topology from " << file << std::endl;
+	if (!LoadTopology(file, boards) || !ValidateTopology(boards)) {
+		return 0;
+	}
+	return OpenBoards(boards);
+}
+
+// Global channel number of a channel on a device
+unsigned USB_Waveform_Manager::GlobalChannel(unsigned device, unsigned channel) {
+	if (FirstChannel.empty()) {
+		// Without a device list, data is prepared with the original 3 channels per device
+		return channel + 3 * device;
+	}
+	if (device >= FirstChannel.size() || channel >= USBWaveDevList[device].num_DACs) {
+		return USB_NO_CHANNEL;
+	}
+	return FirstChannel[device] + channel;
+}
+
+// Global channel number of the logic channel of a device
+unsigned USB_Waveform_Manager::LogicChannel(unsigned device) {
+	if (FirstChannel.empty()) {
+		return LOGIC + 3 * device;
+	}
+	if (device >= FirstChannel.size() || USBWaveDevList[device].logic_chan < 0) {
+		return USB_NO_CHANNEL;
+	}
+	return FirstChannel[device] + unsigned(USBWaveDevList[device].logic_chan);
+}
+
+// Maps a serial number to a device index found after scanning USB ports for all FT245RL chips
+int USB_Waveform_Manager::GetDeviceIndexFromSerialNumber(string * mySerialNo) {
+	// Holds the serial numbers of the devices found
+	std::vector<std::string> serials;
+
+	if (ListDevices(serials) != FT_OK) {return -123404;}
+
+	if (serials.size() > 0) {
+		// search for the requested device
+		for (unsigned i = 0; i < serials.size(); i++) {
+			if(mySerialNo->compare(serials[i]) == 0) {
+				return i;
+			}
+		}
+	}
+	else {
+		return -123406;
+	} //end of if(numDevs>0)
+
+	return 0;
+}
+
+// Fill out the data in a waveform as bytes derived from vectors sent from a data file
+
+/*	1) check to make sure the channel and step is there to store data
+	2) encode the vectors onto the end of the step with WvfEncode*/
+// DAC channels are always the 1st and 2nd channel on a board
+bool USB_Waveform_Manager::WvfFill(unsigned channel, unsigned step,
+	const std::vector<double> & vTimeVals, const std::vector<double> & vCurVals, const std::vector<double> & vdVVals)
+{
+	if (vTimeVals.size() < vCurVals.size() || vdVVals.size() < vCurVals.size()) {
+		// every line needs a time, a start and an end voltage
+		return false;
+	}
+
+	// Creates the channel and step if they aren't defined yet
+	USBWVF_data & wvfchanstep = USBWvf[channel][step];
+
+	// Voltages are corrected with the calibration of the board and channel the step is for
+	const USB_Dac_Cal * cal = USB_Dac_Calibration::Find(channel);
+
+	bool encoded;
+	if (vCurVals.empty()) {
+		encoded = WvfEncode(wvfchanstep, NULL, NULL, NULL, 0, cal);
+	}
+	else {
+		encoded = WvfEncode(wvfchanstep, &vTimeVals[0], &vCurVals[0], &vdVVals[0], vCurVals.size(), cal);
+	}
+	// Identical steps, on this channel or any other, share one buffer
+	wvfchanstep.intern();
+	return encoded;
+}
+
+// Encode waveform lines onto the end of a step, reading straight from the caller's arrays
+
+/*	1) convert the voltage and time values into pure numbers that are in the range for the DACs
+	2) convert to a bit stream
+	3) write to a vector, little endian in words (the FPGA's VHDL code expects a lower word followed by a higher word)*/
+bool USB_Waveform_Manager::WvfEncode(USBWVF_data & step,
+	const double * vTimeVals, const double * vCurVals, const double * vdVVals, size_t count, const USB_Dac_Cal * cal)
+{
+	// The step's own bytes, copied first if they are shared
+	USBWVF_bytes & wvfchanstep = step.edit();
+
+	// Times in the arrays are from the start of the step
+	USB_Wvf_Encode_State state(cal);
+
+	// Every line is 4 words, and up to 2 words of op-codes end the step
+	wvfchanstep.reserve(wvfchanstep.size() + 8 * count + 4);
+	WvfEncodeLines(wvfchanstep, vTimeVals, vCurVals, vdVVals, count, state);
+	WvfEncodeEnd(wvfchanstep, state);
+
+	return true;
+}
+
+// Encode one line of nSteps DAC updates from curVal to dVVal
+// A line longer than MAX_LINE_TICKS becomes as few lines as fit, sharing the whole line's slope so the ramp
+// carries on unbroken; each starts from the voltage the ramp has reached, and the updates are shared out exactly
+static void WvfEncodeLine(USBWVF_bytes & wvfchanstep, long long nSteps, double curVal, double dVVal)
+{
+	unsigned j = 0;
+	unsigned long long ui;
+	BYTE uc;
+
+	// linear coefficient is divided by the total time in number of steps, shifted up to 32 bits to include fractional part
+	// it is worked out signed, then kept as its two's complement for the FPGA
+	unsigned long long slope = (unsigned long long) (long long) (ceil((USB_BYTE_RANGE + 1)*((dVVal - curVal)*USB_BYTE_RANGE) / (nSteps*USB_MAX_VOLTAGE)));
+
+	long long pieces = (nSteps + MAX_LINE_TICKS - 1) / MAX_LINE_TICKS;
+	long long done = 0;
+	for (long long k = 0; k < pieces; k++) {
+		// the first lines take one update more until the remainder is used up
+		long long ticks = nSteps / pieces + (k < nSteps % pieces ? 1 : 0);
+
+		ui = (unsigned long long) ticks;
+		for (j = 0; j < 2; j++) {
+			// the data is broken into 2 words and put on the waveform step little endian
+			uc = BYTE(ui);
+			wvfchanstep.push_back(uc);
+			ui = ui >> 8;
+		}
+
+		// Convert 0V to 10V to a value for full range over a 16 bit number for the FPGA
+		double val = curVal + (dVVal - curVal) * double(done) / double(nSteps);
+		ui = (unsigned long long) (ceil((val * USB_BYTE_RANGE) / USB_MAX_VOLTAGE)); //unsigned long long is chosen to be certain we have enough data size, fixed, for any machine
+		for (j = 0; j < 2; j++) {
+			// the data is broken into 2 words and put on the waveform step little endian
+			uc = BYTE(ui);
+			wvfchanstep.push_back(uc);
+			ui = ui >> 8;
+		}
+
+		ui = slope;
+		for (j = 0; j < 4; j++) {
+			// the integer part is broken into 4 words and put on the waveform step little endian
+			uc = BYTE(ui);
+			wvfchanstep.push_back(uc);
+			ui = ui >> 8;
+		}
+		done += ticks;
+	}
+}
+
+// Encode waveform lines onto the end of a byte vector, without ending the step
+// The state carries the time and any held line from one call to the next, so a step can be encoded a part at a time
+
+/*	Every line ends on the DAC update nearest its end time from the start of the step, so the rounding of
+	one line is taken back by the next and the lines of a step add up to its length exactly
+	A line shorter than MIN_LINE_TICKS is held: if it and the line after it are near enough one straight line,
+	within MERGE_TOLERANCE, the two are encoded as one, otherwise it is lengthened to MIN_LINE_TICKS and the
+	lines after it are cut short to make up the difference, each starting from its voltage at the update it now
+	starts on; a line cut away entirely is left out, and the line after it starts from where the waveform is by then
+	Voltages are calibrated and clamped into range CALIBRATION_BLOCK lines at a time; a ramp is corrected
+	at its two ends, so a ramp across a bend in the nonlinearity table needs lines short enough to follow it */
+void USB_Waveform_Manager::WvfEncodeLines(USBWVF_bytes & wvfchanstep,
+	const double * vTimeVals, const double * vCurVals, const double * vdVVals, size_t count, USB_Wvf_Encode_State & state)
+{
+	// Times from a waveform file are in absolute time for when a waveform section ends; the PDQ wants time durations
+	long long endTick;
+	long long nSteps;
+	// Voltages are calibrated and clamped into range without touching the caller's arrays
+	double curBlock[CALIBRATION_BLOCK];
+	double dVBlock[CALIBRATION_BLOCK];
+	double curVal;
+	double dVVal;
+
+	for (size_t i = 0; i < count; i++) {
+
+		if (i % CALIBRATION_BLOCK == 0) {
+			size_t block = std::min(count - i, (size_t) CALIBRATION_BLOCK);
+			USB_Dac_Calibration::Apply(state.cal, vCurVals + i, curBlock, block);
+			USB_Dac_Calibration::Apply(state.cal, vdVVals + i, dVBlock, block);
+		}
+
+		// Time differences are divided by the DAC update time to get a number of cycles
+		endTick = DacTicks(vTimeVals[i]);
+		// The line as asked for starts where the one before it was asked to end
+		long long lineStart = state.lineEnd;
+		if (endTick <= lineStart) {
+			// nothing left of the line once times are rounded
+			continue;
+		}
+		state.lineEnd = endTick;
+		curVal = curBlock[i % CALIBRATION_BLOCK];
+		dVVal = dVBlock[i % CALIBRATION_BLOCK];
+		if (state.tick > lineStart) {
+			// Lines before it were lengthened past its start, so it starts from its voltage at the update they end on
+			if (endTick <= state.tick) {
+				// all of it was taken; the line after it starts from its own voltage there, so the output catches up
+				continue;
+			}
+			curVal += (dVVal - curVal) * double(state.tick - lineStart) / double(endTick - lineStart);
+		}
+		nSteps = endTick - state.tick;
+
+		if (state.pending) {
+			// How far the held line's end and this line's start are from a straight line through both
+			long long total = state.pendTicks + nSteps;
+			double straight = state.pendStart + (dVVal - state.pendStart) * double(state.pendTicks) / double(total);
+			double miss = std::max(fabs(state.pendEnd - straight), fabs(curVal - straight));
+			if (miss <= MERGE_TOLERANCE) {
+				state.pendTicks = total;
+				state.pendEnd = dVVal;
+				state.tick = endTick;
+				if (state.pendTicks >= MIN_LINE_TICKS) {
+					WvfEncodeLine(wvfchanstep, state.pendTicks, state.pendStart, state.pendEnd);
+					state.pending = false;
+				}
+				continue;
+			}
+			// Too far to merge; the held line takes its updates from the start of this one
+			long long from = state.tick;
+			WvfEncodeFlush(wvfchanstep, state);
+			if (endTick <= state.tick) {
+				// all of this line was taken, and carries over into the next as above
+				continue;
+			}
+			curVal += (dVVal - curVal) * double(state.tick - from) / double(endTick - from);
+			nSteps = endTick - state.tick;
+		}
+
+		if (nSteps < MIN_LINE_TICKS) {
+			state.pending = true;
+			state.pendTicks = nSteps;
+			state.pendStart = curVal;
+			state.pendEnd = dVVal;
+		}
+		else {
+			WvfEncodeLine(wvfchanstep, nSteps, curVal, dVVal);
+		}
+		state.tick = endTick;
+	}
+}
+
+// Encode a held line on its own, lengthened to MIN_LINE_TICKS; the step then runs on past its end time by the difference
+void USB_Waveform_Manager::WvfEncodeFlush(USBWVF_bytes & wvfchanstep, USB_Wvf_Encode_State & state)
+{
+	if (!state.pending) {
+		return;
+	}
+	WvfEncodeLine(wvfchanstep, MIN_LINE_TICKS, state.pendStart, state.pendEnd);
+	state.tick += MIN_LINE_TICKS - state.pendTicks;
+	state.pending = false;
+}
+
+// Encode the op-codes that end a waveform step onto the end of a byte vector, after any line still held
+void USB_Waveform_Manager::WvfEncodeEnd(USBWVF_bytes & wvfchanstep, USB_Wvf_Encode_State & state)
+{
+	WvfEncodeFlush(wvfchanstep, state);
+
+	unsigned j = 0;
+	unsigned long long ui;
+	BYTE uc;
+
+	// If in FREERUN, signify end of the step to FPGA with the op-code to loop back to the start of the waveform
+	if (FREERUN == TRUE)
+	{
+		ui = (unsigned long long) (USB_BYTE_RANGE - 2);
+		for (j = 0; j < 2; j++) {
+			// the data is broken into 2 words and put on the waveform step little endian
+			uc = BYTE(ui);
+			wvfchanstep.push_back(uc);
+			ui = ui >> 8;
+		}
+	}
+
+	// Signify end of the step to FPGA with the op-code to wait for the trigger instead of the next time value
+	ui = (unsigned long long) (USB_BYTE_RANGE - 1);
+	for (j = 0; j < 2; j++) {
+		// the data is broken into 2 words and put on the waveform step little endian
+		uc = BYTE(ui);
+		wvfchanstep.push_back(uc);
+		ui = ui >> 8;
+	}
+}
+
+// Fill out the logic data as bytes derived from vectors sent from a data file
+
+/*	1) check to make sure the channel and step is there to store data
+	2) encode the vectors onto the end of the step with LogicEncode*/
+// Logic channels are always the 3rd on a board
+bool USB_Waveform_Manager::LogicFill(unsigned channel, unsigned step,
+	const std::vector<double> & vTimeVals, const std::vector<double> & vLogicVals)
+{
+	if (vTimeVals.size() < vLogicVals.size()) {
+		// every logic vector needs a duration
+		return false;
+	}
+
+	// Creates the channel and step if they aren't defined yet
+	USBWVF_data & wvfchanstep = USBWvf[channel][step];
+
+	bool encoded;
+	if (vLogicVals.empty()) {
+		encoded = LogicEncode(wvfchanstep, NULL, NULL, 0);
+	}
+	else {
+		encoded = LogicEncode(wvfchanstep, &vTimeVals[0], &vLogicVals[0], vLogicVals.size());
+	}
+	// Identical steps, on this channel or any other, share one buffer
+	wvfchanstep.intern();
+	return encoded;
+}
+
+// Value of a logic line symbol, as the bit it sets in the logic vector
+int USB_Waveform_Manager::LogicBit(const std::string & symbol) {
+	if (symbol == "i") { return 1 << 6; }
+	if (symbol == "d1") { return 1 << 5; }
+	if (symbol == "d0") { return 1 << 4; }
+	if (symbol == "l3") { return 1 << 3; }
+	if (symbol == "l2") { return 1 << 2; }
+	if (symbol == "l1") { return 1 << 1; }
+	if (symbol == "l0") { return 1 << 0; }
+	return -1;
+}
+
+// Finds the next word in a line, leaving p just past it; returns false at the end of the line
+static bool NextWord(const char * & p, std::string & word)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r') { p++; }
+	const char * start = p;
+	while (*p && *p != ' ' && *p != '\t' && *p != '\r') { p++; }
+	word.assign(start, p);
+	return p != start;
+}
+
+// Reads the numbers of a line with strtod, which is much faster than a stringstream for big files
+int USB_Waveform_Manager::ParseLine(const std::string & line, bool logic, double & time, double & val, double & dV) {
+	const char * p = line.c_str();
+	char * next;
+	time = strtod(p, &next);
+	if (next == p || time == -1) {
+		return 0;
+	}
+	p = next;
+	val = dV = 0;
+	if (logic) {
+		std::string word;
+		int logic_val = 0;
+		while (NextWord(p, word)) {
+			int bit = LogicBit(word);
+			if (bit < 0) {
+				return -1;
+			}
+			logic_val += bit;
+		}
+		val = logic_val;
+	}
+	else {
+		val = strtod(p, &next);
+		p = next;
+		dV = strtod(p, &next);
+	}
+	return 1;
+}
+
+// Encode logic vectors onto the end of a step, reading straight from the caller's arrays
+
+/*	1) convert the logic and time values into pure numbers
+	2) convert to a bit stream
+	3) write to a vector, little endian in words (the FPGA's VHDL code expects a lower word followed by a higher word)*/
+bool USB_Waveform_Manager::LogicEncode(USBWVF_data & step,
+	const double * vTimeVals, const double * vLogicVals, size_t count)
+{
+	// The step's own bytes, copied first if they are shared
+	USBWVF_bytes & wvfchanstep = step.edit();
+
+	// Every logic vector is 2 words, and 1 word of op-code ends the step
+	wvfchanstep.reserve(wvfchanstep.size() + 4 * count + 2);
+	USB_Logic_Encode_State state;
+	LogicEncodeLines(wvfchanstep, vTimeVals, vLogicVals, count, state);
+	LogicEncodeEnd(wvfchanstep);
+
+	return true;
+}
+
+// Encode logic vectors onto the end of a byte vector, without ending the step
+// The state carries the time from one call to the next, so a step can be encoded a part at a time
+void USB_Waveform_Manager::LogicEncodeLines(USBWVF_bytes & wvfchanstep,
+	const double * vTimeVals, const double * vLogicVals, size_t count, USB_Logic_Encode_State & state)
+{
+	// Indeces and temporary variables for writing to USBWVF data
+	size_t i = 0;
+	unsigned j = 0;
+	unsigned long long ui; // data for byte list
+	BYTE uc;
+
+	// Times from a logic file are durations of each logic vector
+	long long ticks;
+
+	for (i = 0; i < count; i++) {
+
+		ticks = LogicVectorTicks(vTimeVals[i], state);
+
+		// A vector held longer than one entry can count is repeated, sharing the cycles out exactly
+		long long pieces = (ticks + MAX_LOGIC_TICKS - 1) / MAX_LOGIC_TICKS;
+		for (long long k = 0; k < pieces; k++) {
+			// Push logic vector first
+			ui = (unsigned long long) (vLogicVals[i]); //unsigned long long is chosen to be certain we have enough data size, fixed, for any machine
+			uc = BYTE(ui);
+			wvfchanstep.push_back(uc);
+
+			ui = (unsigned long long) (ticks / pieces + (k < ticks % pieces ? 1 : 0));
+			for (j = 0; j < 3; j++) {
+				// the data is broken into 3 words and put on the waveform step little endian
+				uc = BYTE(ui);
+				wvfchanstep.push_back(uc);
+				ui = ui >> 8;
+			}
+		}
+	}
+}
+
+// Every vector ends on the logic update nearest the time the durations before it add up to, so the rounding of
+// one vector is taken back by the next; a vector is never left out, so one shorter than MIN_LOGIC_TICKS is
+// lengthened and the vectors after it are cut short, down to MIN_LOGIC_TICKS, to make up the difference
+long long USB_Waveform_Manager::LogicVectorTicks(double duration, USB_Logic_Encode_State & state)
+{
+	state.time += duration;
+	long long ticks = LogicTicks(state.time) - state.tick;
+	if (ticks < MIN_LOGIC_TICKS) { ticks = MIN_LOGIC_TICKS; }
+	state.tick += ticks;
+	return ticks;
+}
+
+// Encode the op-code that ends a logic step onto the end of a byte vector
+void USB_Waveform_Manager::LogicEncodeEnd(USBWVF_bytes & wvfchanstep)
+{
+	unsigned j = 0;
+	unsigned long long ui;
+	BYTE uc;
+
+	// Signify end of the step to FPGA with the op-code to wait for the next trigger instead of the next time value
+	ui = (unsigned long long) (USB_BYTE_RANGE - 1);
+	for (j = 0; j < 2; j++) {
+		// the data is broken into 2 words and put on the waveform step little endian
+		uc = BYTE(ui);
+		wvfchanstep.push_back(uc);
+		ui = ui >> 8;
+	}
+}
+
+// Writes all the waveform steps in a channel to the FPGA
+
+/*
+1) send data channel
+2) send reg_length
+3) send burst length
+4) write waveform
+*/
+
+bool USB_Waveform_Manager::Write(unsigned channel) {
+	if(!(USBWvf[channel].empty())) {
+
+		// Indeces for writing to USBWVF data
+		unsigned j;
+		unsigned local_chan;
+		unsigned devIndex = 0;	// The first USB device
+		unsigned long retriesBefore = retries;
+
+		// Format the channel to follow the device list across DACs
+		if (!Route(channel, devIndex, local_chan)) {
+			// No device holds this channel
+			return false;
+		}
+
+		// Steps that share the buffers last written to this channel are already on the board
+		std::vector<USBWVF_data> steps;
+		for (USBWVF_channel::iterator its = USBWvf[channel].begin(); its != USBWvf[channel].end(); ++its) {
+			if (!(its->second).empty()) {
+				steps.push_back(its->second);
+			}
+		}
+		std::map<unsigned, std::vector<USBWVF_data> >::iterator itu = Uploaded.find(channel);
+		if (itu != Uploaded.end() && (itu->second).size() == steps.size()) {
+			bool onBoard = true;
+			for (j = 0; j < steps.size() && onBoard; j++) {
+				onBoard = steps[j].same((itu->second)[j]);
+			}
+			if (onBoard) {
+				std::cout << "Channel data is already on the board, nothing to send" << std::endl;
+				return true;
+			}
+		}
+		// Until this write finishes, what is on the board isn't known
+		Uploaded.erase(channel);
+
+		// The steps of the channel are laid out one after the other from the start of memory
+		USBWVF_bytes waveform_data;
+		for (j = 0; j < steps.size(); j++) {
+			waveform_data.insert(waveform_data.end(), steps[j].begin(), steps[j].end());
+		}
+
+		// For the channel specified, the data in the channel is sent to the FPGA, followed by the "end of memory" op-code
+		std::cout << "Sending the data in the channel to the FPGA (USbWaveDevList[].Write)" << std::endl;
+		if (USBWaveDevList.size()){
+			if (!SendBurst(devIndex, local_chan, 0, waveform_data.empty() ? NULL : &waveform_data[0], (DWORD) waveform_data.size(), true)) {
+				// failure
+				return false;
+			}
+			if (retries != retriesBefore) {
+				std::cout << "Channel written after " << retries - retriesBefore << " retries" << std::endl;
+			}
+			// Remember which buffers the board now holds
+			Uploaded[channel] = steps;
+		}
+
+	}
+	std::cout << "Returning from USB_Waveform_Manager::WvfWrite with 'true'" << std::endl;
+	return true;
+}
+
+// Selects a channel and sends the command to trigger a waveform
+bool USB_Waveform_Manager::Run(unsigned channel) {
+
+	// Indeces for writing to USBWVF data
+	unsigned local_chan;
+	unsigned devIndex = 0;	// The first USB device
+	unsigned long long ui; BYTE uc; // Used to convert numbers into little endian hex to send into initWave
+
+	BYTE runWave[3]; // Holds the initialization code for the waveform
+	// initWave is hard-coded to just the right length
+	BYTE * pInit; // Used for walking through the initWave array
+	pInit = runWave; // point to the first element of initWave
+
+	// Format the channel to follow the device list across DACs
+	if (!Route(channel, devIndex, local_chan)) {
+		// No device holds this channel
+		return false;
+	}
+
+	// Sending the channel number
+	*pInit = 0x04;
+	pInit++;
+	// process channel
+	ui = (unsigned long long) (local_chan);
+	uc = BYTE(ui);
+	*pInit = uc;
+	pInit++;
+
+	// Sending the run command
+	*pInit = 0x05;
+
+	if (USBWaveDevList.size()){
+		if (USB_Waveform_Manager::USBWaveDevList[devIndex].Write(&runWave[0], (DWORD) sizeof(runWave)) == FT_OK) {
+			// No errors detected
+		}
+		else {
+			// failure
+			return false;
+		}
+	}
+	std::cout << "Returning from USB_Waveform_Manager::WvfRun with 'true'" << std::endl;
+	return true;
+}
+
+// Writes part of a channel's memory, starting at a word address
+
+// The data goes out in bursts through SendBurst
+
+bool USB_Waveform_Manager::WriteRange(unsigned channel, unsigned address, const BYTE * data, DWORD size, bool writeEnd) {
+	unsigned local_chan;
+	unsigned devIndex;
+
+	if (!Route(channel, devIndex, local_chan)) {
+		// No device holds this channel
+		return false;
+	}
+	if (!USBWaveDevList.size()) {
+		// Nothing to send to
+		return true;
+	}
+	// The channel's memory no longer matches the steps last written with Write
+	Uploaded.erase(channel);
+
+	return SendBurst(devIndex, local_chan, address, data, size, writeEnd);
+}
+
+// Sends data in bursts, resuming after failed writes
+
+/*
+1) send data channel, memory address and burst length for the next part of the data
+2) write that part, and the end of memory op-code after the last part if asked for
+3) if the device didn't take it all, wait, send filler to finish whatever the FPGA was in the middle of,
+	and go back to 1) from the last whole word the device took
+*/
+
+bool USB_Waveform_Manager::SendBurst(unsigned devIndex, unsigned local_chan, unsigned address, const BYTE * data, DWORD size, bool writeEnd) {
+	USB_WaveDev & dev = USBWaveDevList[devIndex];
+	DWORD done = 0; // bytes of data the device has taken
+	unsigned attempts = 0;
+	bool finished = false;
+	std::vector<BYTE> packet;
+	packet.reserve(UPLOAD_CHUNK_BYTES + 12);
+
+	while (!finished) {
+		DWORD chunk = size - done;
+		if (chunk > UPLOAD_CHUNK_BYTES) { chunk = UPLOAD_CHUNK_BYTES; }
+		bool last = (done + chunk == size);
+		unsigned wordAddr = address + unsigned(done / 2);
+
+		// Channel, address and burst length are each a command followed by little endian words
+		packet.clear();
+		packet.push_back(0x04);
+		packet.push_back(BYTE(local_chan));
+		packet.push_back(0x03);
+		packet.push_back(BYTE(wordAddr));
+		packet.push_back(BYTE(wordAddr >> 8));
+		DWORD header = DWORD(packet.size());
+		if (chunk > 0) {
+			packet.push_back(0x00);
+			packet.push_back(BYTE(chunk / 2));
+			packet.push_back(BYTE((chunk / 2) >> 8));
+			packet.push_back(0x02);
+			header = DWORD(packet.size());
+			packet.insert(packet.end(), data + done, data + done + chunk);
+		}
+		if (last && writeEnd) {
+			// The place after the data becomes the "end of memory" op-code
+			packet.push_back(0x01);
+			packet.push_back(0xFF);
+			packet.push_back(0xFF);
+		}
+
+		FT_STATUS status = dev.Write(&packet[0], (DWORD) packet.size());
+		if (status == FT_OK && dev.Written() == packet.size()) {
+			done += chunk;
+			finished = last;
+			continue;
+		}
+
+		// Keep the whole words of data the device took; the rest of this part is sent again
+		DWORD taken = dev.Written() > header ? dev.Written() - header : 0;
+		if (taken > chunk) { taken = chunk; }
+		taken &= ~DWORD(1);
+		done += taken;
+		resentBytes += chunk - taken;
+
+		// The FPGA may be part way through the burst or a command: each 0xFF byte is either more data, written
+		// where the data is about to be sent again, or a command it ignores, so enough of them leave it waiting for a command
+		std::vector<BYTE> filler(chunk - taken + 4, 0xFF);
+		bool synced = false;
+		while (!synced) {
+			if (++attempts > UPLOAD_RETRIES) {
+				std::cout << "Giving up on the upload to " << dev.Serial << " after " << UPLOAD_RETRIES << " retries" << std::endl;
+				failedUploads++;
+				return false;
+			}
+			retries++;
+			std::cout << "Write to " << dev.Serial << " failed with status " << status << " at byte " << done
+				<< " of " << size << ", retrying" << std::endl;
+			std::this_thread::sleep_for(std::chrono::milliseconds(UPLOAD_BACKOFF_MS << (attempts - 1)));
+			status = dev.Write(&filler[0], (DWORD) filler.size());
+			synced = (status == FT_OK && dev.Written() == filler.size());
+		}
+	}
+	return true;
+}
+
+// Shares the encoded data of one step with another step
+bool USB_Waveform_Manager::CopyStep(unsigned srcChannel, unsigned srcStep, unsigned dstChannel, unsigned dstStep) {
+	USBWVF::iterator itc = USBWvf.find(srcChannel);
+	if (itc == USBWvf.end()) {
+		return false;
+	}
+	USBWVF_channel::iterator its = (itc->second).find(srcStep);
+	if (its == (itc->second).end()) {
+		return false;
+	}
+	// Only the handle is copied; both steps share the bytes until one of them is edited
+	USBWVF_data source = its->second;
+	source.intern();
+	USBWvf[dstChannel][dstStep] = source;
+	return true;
+}
+
+// Finds the device holding a channel and the channel number on that device, from the routing table
+bool USB_Waveform_Manager::Route(unsigned channel, unsigned & devIndex, unsigned & local_chan) {
+	if (channel < Routes.size()) {
+		devIndex = Routes[channel].devIndex;
+		local_chan = Routes[channel].local_chan;
+		return true;
+	}
+	// With no devices listed, data is still prepared but never sent
+	devIndex = 0;
+	local_chan = channel;
+	return USBWaveDevList.empty();
+}
+
+// Clear out the data in a channel or step, or clear it all
+void USB_Waveform_Manager::WvfClear(int channel, int step) {
+	// Check that the channel has been defined in the waveform list
+	USBWVF::iterator itc = USBWvf.find(channel);
+	if (channel == -1) {
+			// clear all channels
+			USBWvf.clear();
+	}
+	else if (channel < -1 || step < -1) {
+		// Bad channel or step choice
+	}
+	else if (itc == USBWvf.end()) {
+		// Channel isn't defined
+	}
+	else {
+		if (step == -1) {
+			// remove the channel data
+			USBWvf.erase(itc);
+		}
+		else {
+			// Check that the step has been defined in the waveform list
+			USBWVF_channel::iterator its = USBWvf[channel].find(step);
+			if (its == USBWvf[channel].end()) {
+				// step isn't defined
+			}
+			else{
+				// remove the specific step from the waveform
+				USBWvf[channel].erase(its);
+			}
+		}
+	}
+}
@@ -2,13 +2,16 @@
 Header file for defining a class for the USB-controlled FPGA waveform cards
 */
 
+#ifndef USB_DEVICE_H
+#define USB_DEVICE_H
+
 #include <vector> //needed for the vector of devices
 #include <map> //needed for the waveform channel map
 #include <bitset> // For displaying the binary version of a logic sequence
 #include <string> // needed for parsing the device initalization list in fpgart.cpp from a defined list
 #include <math.h> // for rounding for converting derivatives
-#include <wtypes.h> //needed for certain variable types in FTD2XX.H
-#include "FTD2XX.H" // Header file for USB controls and types
+#include <memory> // for the shared step buffers
+#include "USB_Transport.h" // for the transports to the devices, and the USB types
 
 // Waveform information
 #define USB_BYTE_RANGE 65535 // max number for positive values: unsigned 16-bit
@@ -16,6 +19,13 @@ Header file for defining a class for the USB-controlled FPGA waveform cards
 #define USB_DAC_UPDATE 0.0005 // all times should be in milliseconds
 #define MIN_LINE_TIME 0.002 // in milliseconds, set by the time it takes to read in the starting voltage and duration (4 clock cycles), VHDL-side handles too short of duration as well
 #define MAX_LINE_TIME 32.765 // 32.765 milliseconds per waveform line; higher time values up to (2^16-1) are reserved to be "op-codes" in memory
+// Line lengths in DAC updates; lines are split to fit and shorter ones are merged or lengthened
+#define MIN_LINE_TICKS 4 // MIN_LINE_TIME / USB_DAC_UPDATE
+#define MAX_LINE_TICKS 65530 // MAX_LINE_TIME / USB_DAC_UPDATE
+// Words of memory behind each channel of the FPGA, all its 14-bit word addresses reach
+#define USB_MEMORY_WORDS 16384
+// A line shorter than MIN_LINE_TICKS is merged with the next when no voltage moves further than this from the merged line
+#define MERGE_TOLERANCE 0.01
 // Voltage ranges
 #define MIN_VOLTAGE 0.0
 #define MAX_VOLTAGE 10.0
@@ -24,33 +34,135 @@ Header file for defining a class for the USB-controlled FPGA waveform cards
 #define LOG_UPDATE 0.0001 // all times should be in milliseconds
 #define MIN_LOGIC_TIME 0.0002 // set by the time to read in the next logic vector and duration (2 clock cycles)
 #define MAX_LOGIC_TIME 1677.72 // 1.67772 seconds, in milliseconds, per logic update step with overhead for op-codes
+#define MIN_LOGIC_TICKS 2 // MIN_LOGIC_TIME / LOG_UPDATE
+#define MAX_LOGIC_TICKS 16777200 // MAX_LOGIC_TIME / LOG_UPDATE, longer vectors are repeated
+
+// Uploads are sent in bursts of at most this many bytes, so a failed write only costs resending part of a burst
+#define UPLOAD_CHUNK_BYTES 4096
+// Attempts to resume an upload after failed writes, and the wait before the first, doubling each time, in milliseconds
+#define UPLOAD_RETRIES 5
+#define UPLOAD_BACKOFF_MS 10
 
 // Definition for functions to upload data
 bool Logicstep(std::string waveformfile, unsigned devicenum, unsigned step);
 bool Waveform(std::string waveformfile, unsigned devicenum, unsigned channel, unsigned step);
 bool Run(unsigned devicenum, unsigned channel);
 
+// Channel number used for a device or channel that isn't in the topology
+#define USB_NO_CHANNEL 0xFFFFFFFF
+
+// One board of the topology, from the topology file or USB_DEVICE_LIST
+struct USB_Board_Def {
+	std::string serial; // serial number of the board
+	unsigned num_DACs; // number of channels on the board
+	int logic_chan; // channel on the board that drives the logic lines, -1 for none
+};
+
+// Where a global channel number is sent: the device index and the channel number on that device
+struct USB_Route {
+	unsigned devIndex;
+	unsigned local_chan;
+};
+
 // Some typedef's for the USB data vectors
-typedef	std::vector<BYTE> USBWVF_data;
+typedef	std::vector<BYTE> USBWVF_bytes;
+
+// The encoded bytes of one step. Copies share a single buffer, and buffers with the same content are interned
+// so identical steps on any channel or board are held once; edit() gives a private copy when the buffer is shared
+class USBWVF_data{
+public:
+	USBWVF_data() : interned(false) {}
+	explicit USBWVF_data(const USBWVF_bytes & bytes) : buf(new USBWVF_bytes(bytes)), interned(false) {}
+
+	// Read access to the bytes
+	size_t size() const { return buf ? buf->size() : 0; };
+	bool empty() const { return size() == 0; };
+	const BYTE & operator[](size_t i) const { return (*buf)[i]; };
+	const BYTE * data() const { return empty() ? NULL : &(*buf)[0]; };
+	const USBWVF_bytes & bytes() const { return buf ? *buf : EmptyBytes; };
+	USBWVF_bytes::const_iterator begin() const { return bytes().begin(); };
+	USBWVF_bytes::const_iterator end() const { return bytes().end(); };
+
+	// Write access, copying the bytes first if any other step shares them
+	USBWVF_bytes & edit();
+
+	// Share the buffer of an identical interned step, or become the interned copy of these bytes
+	void intern();
+
+	// True when both steps hold the very same buffer, without comparing bytes
+	bool same(const USBWVF_data & other) const { return buf == other.buf; };
+	bool operator==(const USBWVF_data & other) const { return same(other) || bytes() == other.bytes(); };
+	bool operator!=(const USBWVF_data & other) const { return !(*this == other); };
+
+private:
+	std::shared_ptr<USBWVF_bytes> buf;
+	bool interned; // interned buffers are never written, since other steps may share them
+	static const USBWVF_bytes EmptyBytes;
+};
+
+// Interning table for step buffers, by content hash
+class USB_Step_Pool{
+public:
+	// 64-bit FNV-1a hash of a block of bytes
+	static unsigned long long HashBytes(const void * data, size_t size);
+
+	// Find the interned buffer with the same bytes, or add this one; returns the buffer to share
+	static std::shared_ptr<USBWVF_bytes> Intern(const std::shared_ptr<USBWVF_bytes> & buf);
+
+	// Number of steps that were found already interned, and the bytes that sharing saved
+	static unsigned long shared;
+	static unsigned long long savedBytes;
+
+private:
+	// Buffers are held weakly, so a step nobody uses any more is freed
+	static std::multimap<unsigned long long, std::weak_ptr<USBWVF_bytes> > Pool;
+};
+
 typedef std::map<unsigned, USBWVF_data> USBWVF_channel;
 typedef std::map<unsigned, USBWVF_channel> USBWVF;
 
+// Calibration of a channel, defined in Dac_Calibration.h
+struct USB_Dac_Cal;
+
+// Where the encoding of a waveform step has got to, so a step can be encoded a part at a time
+// Times are counted in whole DAC updates from the start of the step, so rounding never adds up along a step
+struct USB_Wvf_Encode_State {
+	USB_Wvf_Encode_State(const USB_Dac_Cal * calibration = NULL)
+		: tick(0), lineEnd(0), pending(false), pendTicks(0), pendStart(0), pendEnd(0), cal(calibration) {}
+	long long tick; // update the lines taken so far end on, the held line included
+	long long lineEnd; // update the last line was asked to end on; tick is past it while a lengthened line is being made up
+	bool pending; // a line shorter than MIN_LINE_TICKS is held, to be merged with the line after it
+	long long pendTicks; // length of the held line
+	double pendStart; // voltages at the start and end of the held line
+	double pendEnd;
+	const USB_Dac_Cal * cal; // calibration of the channel the step is for, NULL for the ideal transfer function
+};
+
+// Where encoding a logic step has got to, carried from one part of a step to the next
+struct USB_Logic_Encode_State {
+	USB_Logic_Encode_State() : time(0), tick(0) {}
+	double time; // durations of the vectors taken so far, added up
+	long long tick; // update the vectors taken so far end on; past time while a lengthened vector is made up
+};
+
 // This is the definition for the Class used for USB control of the USB-connected FPGA devices
 class USB_WaveDev{
   public:
 	// default constructor
 	USB_WaveDev();
 
-	FT_STATUS Open(); //Opens the device for accessing, sets ftHandle
+	FT_STATUS Open(); //Opens the device for accessing through the transport selected
 	FT_STATUS Write(BYTE* wavePoint, DWORD size); //Writes a waveform to the device as a string of bytes
+	DWORD Written() const { return written; }; //Bytes the last Write handed to the device
 	FT_STATUS Close(); //Closes the device on shutdown
 
 	//serial numbers are 8 characters followed by TWO nulls to give length 10
 	char Serial[10]; //serial number of the device is stored here
 	unsigned num_DACs; //the number of DACs on this USB device
+	int logic_chan; //the channel on this USB device driving the logic lines, -1 for none
 
   private:
-	FT_HANDLE ftHandle; //the handle for the device
+	std::shared_ptr<USB_Transport> transport; //carries the bytes to the device, set when it is opened
 	DWORD written; //the write command uses this for how much data was sent
 };
 
@@ -58,11 +170,8 @@ class USB_Waveform_Manager{
 public:
 	// Section of functions for accessing USB FT245RL communication commands
 
-	// Ask the USB API to generate a list of FTDI devices
-	static FT_STATUS CreateDeviceInfoList(DWORD * numDevs) {return FT_CreateDeviceInfoList(numDevs); };
-
-	// Ask the USB API to retrieve the list of FTDI devices and their information (generated by CreatDeviceInfoList)
-	static FT_STATUS GetDeviceInfoList(FT_DEVICE_LIST_INFO_NODE * devInfo, DWORD * numDevs) {return FT_GetDeviceInfoList(devInfo, numDevs); };
+	// Ask the transport in use for the serial numbers of the FTDI devices it can see
+	static FT_STATUS ListDevices(std::vector<std::string> & serials) {return USB_Transport::ListDevices(serials); };
 	
 	// get the index of FTDI device given a serial number (eg 'TESTDEV0')
 	static int GetDeviceIndexFromSerialNumber(string * mySerialNo);
@@ -73,6 +182,27 @@ public:
 	// Fills out a vector with an instance of a DAC device and opens it
 	static FT_STATUS InitSingleDACMaster(DWORD devIndex, const char * serialNum, unsigned dacNum);
 
+	// Parse a "serial# #ofDACs serial# #ofDACs ..." list, size the device list to it and open each device
+	// Returns the number of devices that opened
+	static unsigned OpenDevices(const std::string & deviceList);
+
+	// Open the boards in a topology file, falling back to USB_DEVICE_LIST when the file isn't there
+	// Returns the number of devices that opened, 0 if the topology is invalid
+	static unsigned OpenTopology(const std::string & file);
+
+	// Read board definitions from a device list or a topology file, and check them before opening
+	static bool ParseDeviceList(const std::string & deviceList, std::vector<USB_Board_Def> & boards);
+	static bool LoadTopology(const std::string & file, std::vector<USB_Board_Def> & boards);
+	static bool ValidateTopology(const std::vector<USB_Board_Def> & boards);
+
+	// Open a set of boards and build the routing table for their channels
+	static unsigned OpenBoards(const std::vector<USB_Board_Def> & boards);
+
+	// Global channel number for a channel on a device, or for the logic channel of a device
+	// USB_NO_CHANNEL if the device or channel isn't in the topology
+	static unsigned GlobalChannel(unsigned device, unsigned channel);
+	static unsigned LogicChannel(unsigned device);
+
 	// Close a device
 	static FT_STATUS CloseDevice(DWORD devIndex) {return USBWaveDevList.at(devIndex).Close(); };
 
@@ -85,19 +215,83 @@ public:
 	static std::vector<USB_WaveDev> USBWaveDevList;
 	// Defines the waveform data map between a channel number and data to be sent there as a BYTE vector
 	static USBWVF USBWvf;
+	// Routing table indexed by global channel, built when the boards are opened
+	static std::vector<USB_Route> Routes;
+	// Global channel number of the first channel of each device
+	static std::vector<unsigned> FirstChannel;
 
 //private:
 	// Fill out the data in a waveform as bytes derived from vectors sent from a waveform file
 	static bool WvfFill(unsigned channel, unsigned step,
-		std::vector<double> vTimeVals, std::vector<double> vCurVals, std::vector<double> vdVVals);
+		const std::vector<double> & vTimeVals, const std::vector<double> & vCurVals, const std::vector<double> & vdVVals);
 
 	// Fill out the data in a logic vector as bytes derived from vectors sent from a logic definition file
 	static bool LogicFill(unsigned channel, unsigned step,
-		std::vector<double> vTimeVals, std::vector<double> vLogicVals);
+		const std::vector<double> & vTimeVals, const std::vector<double> & vLogicVals);
+
+	// Encode count waveform lines onto the end of a step straight from arrays, without copying them first
+	// Voltages are corrected with the calibration given, for the channel the step is for
+	static bool WvfEncode(USBWVF_data & step,
+		const double * vTimeVals, const double * vCurVals, const double * vdVVals, size_t count, const USB_Dac_Cal * cal);
+
+	// Encode count logic vectors onto the end of a step straight from arrays, without copying them first
+	static bool LogicEncode(USBWVF_data & step,
+		const double * vTimeVals, const double * vLogicVals, size_t count);
+
+	// Encode lines onto the end of a byte vector without ending the step, and encode the end of a step
+	// Used to encode a step a part at a time; the state carries the time, any held line and the calibration between parts
+	// Lines longer than MAX_LINE_TICKS are split into as few lines as fit, on one slope
+	static void WvfEncodeLines(USBWVF_bytes & wvfchanstep,
+		const double * vTimeVals, const double * vCurVals, const double * vdVVals, size_t count, USB_Wvf_Encode_State & state);
+	// Write out a held line, lengthened to MIN_LINE_TICKS since nothing follows it to merge with
+	static void WvfEncodeFlush(USBWVF_bytes & wvfchanstep, USB_Wvf_Encode_State & state);
+	// Flush, then the op-codes that end the step
+	static void WvfEncodeEnd(USBWVF_bytes & wvfchanstep, USB_Wvf_Encode_State & state);
+	// Time from the start of a step in whole DAC updates, rounded to the nearest
+	static long long DacTicks(double time) { return (long long) floor(time / USB_DAC_UPDATE + 0.5); };
+	// The same in whole logic updates
+	static long long LogicTicks(double time) { return (long long) floor(time / LOG_UPDATE + 0.5); };
+	// Logic vectors end on the update nearest their end time from the start of the step, like waveform lines
+	static void LogicEncodeLines(USBWVF_bytes & wvfchanstep,
+		const double * vTimeVals, const double * vLogicVals, size_t count, USB_Logic_Encode_State & state);
+	// Updates the next logic vector of a step lasts, at least MIN_LOGIC_TICKS, moving the state on past it
+	static long long LogicVectorTicks(double duration, USB_Logic_Encode_State & state);
+	static void LogicEncodeEnd(USBWVF_bytes & wvfchanstep);
+
+	// Value of a logic line symbol from a logic file ("i", "d1", "d0", "l3" to "l0"), -1 if it isn't one
+	static int LogicBit(const std::string & symbol);
+
+	// Read one line of a waveform file ("time start_voltage end_voltage") or of a logic file ("duration symbols...")
+	// Returns 1 for a line, 0 for a blank line or a time of -1, and -1 for an unknown logic symbol
+	// Safe to call from any thread, unlike Waveform and Logicstep
+	static int ParseLine(const std::string & line, bool logic, double & time, double & val, double & dV);
 
 	// Write a channel of data to a device
 	static bool Write(unsigned channel);
 
 	// Run the waveform on the device
 	static bool Run(unsigned channel);
-};
\ No newline at end of file
+
+	// Share the encoded data of one step with another step, on any channel, without encoding it again
+	static bool CopyStep(unsigned srcChannel, unsigned srcStep, unsigned dstChannel, unsigned dstStep);
+
+	// The step buffers last written to each channel, so writing the very same steps again is skipped
+	static std::map<unsigned, std::vector<USBWVF_data> > Uploaded;
+
+	// Write part of a channel's memory starting at a word address, used to update single steps
+	static bool WriteRange(unsigned channel, unsigned address, const BYTE * data, DWORD size, bool writeEnd);
+
+	// Send data to a device's channel from a word address in bursts of UPLOAD_CHUNK_BYTES, with the end of memory op-code if asked for
+	// After a failed write the FPGA is brought back to waiting for a command and only the data it hasn't taken is sent again
+	static bool SendBurst(unsigned devIndex, unsigned local_chan, unsigned address, const BYTE * data, DWORD size, bool writeEnd);
+
+	// Writes that failed and were resumed, bytes sent again because of them, and uploads given up after UPLOAD_RETRIES
+	static unsigned long retries;
+	static unsigned long long resentBytes;
+	static unsigned long failedUploads;
+
+	// Find which device, and which channel on it, a channel number refers to
+	static bool Route(unsigned channel, unsigned & devIndex, unsigned & local_chan);
+};
+
+#endif
@@ -0,0 +1,403 @@
+// USB_Transport.cpp : the D2XX, libftdi and loopback transports to the FPGA cards
+#include "stdafx.h"
+using namespace std;
+
+#include <string.h> // for the serial numbers from libftdi
+#include <memory> // for the transfer completion flags
+#include "USB_Transport.h"
+#include "USB_Device.h" // for the size of the memory the emulated boards have
+
+std::string USB_Transport::selected;
+
+// True when a transport of that name was built in
+static bool Built(const std::string & name)
+{
+#ifdef USB_HAVE_D2XX
+	if (name == USB_TRANSPORT_D2XX) { return true; }
+#endif
+#ifdef USB_HAVE_LIBFTDI
+	if (name == USB_TRANSPORT_FTDI) { return true; }
+#endif
+	return name == USB_TRANSPORT_LOOPBACK;
+}
+
+bool USB_Transport::Select(const std::string & name)
+{
+	if (!Built(name)) {
+		std::cout << "The " << name << " transport isn't built in, staying with " << Selected() << std::endl;
+		return false;
+	}
+	selected = name;
+	return true;
+}
+
+std::string USB_Transport::Selected()
+{
+	if (selected != "") {
+		return selected;
+	}
+#if defined(USB_HAVE_D2XX)
+	return USB_TRANSPORT_D2XX;
+#elif defined(USB_HAVE_LIBFTDI)
+	return USB_TRANSPORT_FTDI;
+#else
+	return USB_TRANSPORT_LOOPBACK;
+#endif
+}
+
+USB_Transport * USB_Transport::Create()
+{
+	std::string name = Selected();
+#ifdef USB_HAVE_D2XX
+	if (name == USB_TRANSPORT_D2XX) { return new USB_D2XX_Transport(); }
+#endif
+#ifdef USB_HAVE_LIBFTDI
+	if (name == USB_TRANSPORT_FTDI) { return new USB_Ftdi_Transport(); }
+#endif
+	return new USB_Loopback_Transport();
+}
+
+FT_STATUS USB_Transport::ListDevices(std::vector<std::string> & serials)
+{
+	serials.clear();
+	std::string name = Selected();
+#ifdef USB_HAVE_D2XX
+	if (name == USB_TRANSPORT_D2XX) { return USB_D2XX_Transport::ListDevices(serials); }
+#endif
+#ifdef USB_HAVE_LIBFTDI
+	if (name == USB_TRANSPORT_FTDI) { return USB_Ftdi_Transport::ListDevices(serials); }
+#endif
+	// Emulated boards are made when they are opened, there are none to find
+	return FT_OK;
+}
+
+// -------------------------------
+
+#ifdef USB_HAVE_D2XX
+FT_STATUS USB_D2XX_Transport::Open(const char * serial)
+{
+	// The device is opened by it's serial number and referenced by it's handle
+	return FT_OpenEx((PVOID) serial, FT_OPEN_BY_SERIAL_NUMBER, &ftHandle);
+}
+
+FT_STATUS USB_D2XX_Transport::Write(const BYTE * data, DWORD size, DWORD * written)
+{
+	return FT_Write(ftHandle, (LPVOID) data, size, written);
+}
+
+FT_STATUS USB_D2XX_Transport::Close()
+{
+	// Finished with the device, so closing it
+	return FT_Close(ftHandle);
+}
+
+FT_STATUS USB_D2XX_Transport::ListDevices(std::vector<std::string> & serials)
+{
+	// Ask the USB API to generate a list of FTDI devices, then to retrieve it
+	DWORD numDevs;
+	FT_STATUS status = FT_CreateDeviceInfoList(&numDevs);
+	if (status != FT_OK || numDevs == 0) {
+		return status;
+	}
+	std::vector<FT_DEVICE_LIST_INFO_NODE> devInfo(numDevs);
+	status = FT_GetDeviceInfoList(&devInfo[0], &numDevs);
+	if (status != FT_OK) {
+		return status;
+	}
+	for (DWORD i = 0; i < numDevs; i++) {
+		serials.push_back(std::string(devInfo[i].SerialNumber));
+	}
+	return FT_OK;
+}
+#endif
+
+// -------------------------------
+
+#ifdef USB_HAVE_LIBFTDI
+FT_STATUS USB_Ftdi_Transport::Open(const char * serial)
+{
+	Close();
+	ftdi = ftdi_new();
+	if (!ftdi) {
+		return FT_INSUFFICIENT_RESOURCES;
+	}
+	if (ftdi_usb_open_desc(ftdi, USB_FTDI_VENDOR, USB_FTDI_PRODUCT, NULL, serial) < 0) {
+		std::cout << "libftdi could not open " << serial << ": " << ftdi_get_error_string(ftdi) << std::endl;
+		ftdi_free(ftdi);
+		ftdi = NULL;
+		return FT_DEVICE_NOT_OPENED;
+	}
+	// The asynchronous FIFO the FPGA is wired to is the chip's reset mode, which libftdi may not have left it in
+	if (ftdi_set_bitmode(ftdi, 0xFF, BITMODE_RESET) < 0) {
+		std::cout << "libftdi could not set up " << serial << ": " << ftdi_get_error_string(ftdi) << std::endl;
+		Close();
+		return FT_OTHER_ERROR;
+	}
+	return FT_OK;
+}
+
+void LIBUSB_CALL USB_Ftdi_Transport::TransferDone(struct libusb_transfer * transfer)
+{
+	*((int *) transfer->user_data) = 1;
+}
+
+// The data is cut into transfers that are queued USB_FTDI_IN_FLIGHT at a time, so the bus stays busy while
+// each finished transfer is collected; the transfers are collected in order, which is the order the device takes them
+FT_STATUS USB_Ftdi_Transport::Write(const BYTE * data, DWORD size, DWORD * written)
+{
+	*written = 0;
+	if (!ftdi) {
+		return FT_INVALID_HANDLE;
+	}
+
+	size_t count = (size + USB_FTDI_TRANSFER_BYTES - 1) / USB_FTDI_TRANSFER_BYTES;
+	std::vector<struct libusb_transfer *> transfers(count, (struct libusb_transfer *) NULL);
+	// Flags set as each transfer completes; left allocated if the write has to give up on transfers libusb still holds
+	std::unique_ptr<int[]> completed(new int[count]());
+	size_t submitted = 0;
+	size_t collected = 0;
+	bool failed = false;
+	bool gap = false; // a transfer came up short, so the bytes after it aren't counted as taken
+	bool lost = false; // bytes after a short transfer reached the device anyway
+	unsigned eventErrors = 0; // failed attempts to handle events
+
+	while (collected < submitted || (!failed && submitted < count)) {
+		// Keep the queue full
+		while (!failed && submitted < count && submitted - collected < USB_FTDI_IN_FLIGHT) {
+			DWORD offset = DWORD(submitted * USB_FTDI_TRANSFER_BYTES);
+			DWORD length = size - offset < USB_FTDI_TRANSFER_BYTES ? size - offset : USB_FTDI_TRANSFER_BYTES;
+			struct libusb_transfer * transfer = libusb_alloc_transfer(0);
+			if (!transfer) {
+				failed = true;
+				break;
+			}
+			libusb_fill_bulk_transfer(transfer, ftdi->usb_dev, (unsigned char) ftdi->in_ep, (unsigned char *) data + offset,
+				int(length), TransferDone, &completed[submitted], USB_FTDI_TIMEOUT_MS);
+			if (libusb_submit_transfer(transfer) != 0) {
+				libusb_free_transfer(transfer);
+				failed = true;
+				break;
+			}
+			transfers[submitted++] = transfer;
+		}
+		if (collected == submitted) {
+			break;
+		}
+
+		// Wait for the oldest transfer
+		int result = 0;
+		while (!completed[collected] && eventErrors <= USB_FTDI_EVENT_RETRIES) {
+			result = libusb_handle_events_completed(ftdi->usb_ctx, &completed[collected]);
+			if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED && eventErrors++ == 0) {
+				// Events can't be handled, so cancel what is queued; the cancellations still complete each transfer
+				for (size_t i = collected; i < submitted; i++) {
+					libusb_cancel_transfer(transfers[i]);
+				}
+				failed = true;
+			}
+		}
+		if (!completed[collected]) {
+			// Not even the cancellations come back, so give up on the transfers left; libusb may still hold them,
+			// so they and their flags are left allocated rather than freed under it
+			std::cout << "libftdi: could not handle USB events: " << libusb_error_name(result) << std::endl;
+			completed.release();
+			return FT_IO_ERROR;
+		}
+		struct libusb_transfer * transfer = transfers[collected];
+		if (!gap) {
+			// Still part of the run of bytes the device took from the start
+			*written += DWORD(transfer->actual_length);
+			gap = (transfer->actual_length < transfer->length || transfer->status != LIBUSB_TRANSFER_COMPLETED);
+		}
+		else if (transfer->actual_length > 0) {
+			lost = true;
+		}
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED && !failed) {
+			// Stop queueing, and take back the transfers behind this one before they reach the device
+			for (size_t i = collected + 1; i < submitted; i++) {
+				libusb_cancel_transfer(transfers[i]);
+			}
+			failed = true;
+		}
+		libusb_free_transfer(transfer);
+		transfers[collected++] = NULL;
+	}
+
+	if (lost) {
+		// Bytes after a gap can't be told apart from the rest of a burst by the FPGA
+		std::cout << "libftdi: a transfer queued after a failed one reached the device" << std::endl;
+	}
+	if (failed || *written != size) {
+		return FT_IO_ERROR;
+	}
+	return FT_OK;
+}
+
+FT_STATUS USB_Ftdi_Transport::Close()
+{
+	if (!ftdi) {
+		return FT_INVALID_HANDLE;
+	}
+	int result = ftdi_usb_close(ftdi);
+	ftdi_free(ftdi);
+	ftdi = NULL;
+	return result < 0 ? FT_IO_ERROR : FT_OK;
+}
+
+FT_STATUS USB_Ftdi_Transport::ListDevices(std::vector<std::string> & serials)
+{
+	struct ftdi_context * ftdi = ftdi_new();
+	if (!ftdi) {
+		return FT_INSUFFICIENT_RESOURCES;
+	}
+	struct ftdi_device_list * devlist = NULL;
+	if (ftdi_usb_find_all(ftdi, &devlist, USB_FTDI_VENDOR, USB_FTDI_PRODUCT) < 0) {
+		ftdi_free(ftdi);
+		return FT_OTHER_ERROR;
+	}
+	for (struct ftdi_device_list * d = devlist; d != NULL; d = d->next) {
+		char serial[16];
+		memset(serial, 0, sizeof(serial));
+		if (ftdi_usb_get_strings(ftdi, d->dev, NULL, 0, NULL, 0, serial, sizeof(serial) - 1) == 0) {
+			serials.push_back(std::string(serial));
+		}
+	}
+	ftdi_list_free(&devlist);
+	ftdi_free(ftdi);
+	return FT_OK;
+}
+#endif
+
+// -------------------------------
+
+std::map<std::string, USB_Loopback_Transport::Board> USB_Loopback_Transport::Boards;
+std::mutex USB_Loopback_Transport::guard;
+unsigned USB_Loopback_Transport::failEvery = 0;
+DWORD USB_Loopback_Transport::failAfter = 0;
+unsigned USB_Loopback_Transport::failCount = 0;
+
+FT_STATUS USB_Loopback_Transport::Open(const char * serial)
+{
+	std::lock_guard<std::mutex> lock(guard);
+	std::map<std::string, Board>::iterator itb = Boards.find(serial);
+	if (itb == Boards.end()) {
+		// A fresh board: memory that reads as "end of memory", waiting for a command
+		Board fresh;
+		for (unsigned c = 0; c < USB_LOOPBACK_CHANNELS; c++) {
+			fresh.memory[c].assign(USB_MEMORY_WORDS, 0xFFFF);
+			fresh.runs[c] = 0;
+		}
+		fresh.channel = fresh.address = fresh.burst = fresh.arg = fresh.argBytes = 0;
+		fresh.dataLeft = 0;
+		fresh.cmd = -1;
+		fresh.low = 0;
+		fresh.bytes = 0;
+		itb = Boards.insert(std::make_pair(std::string(serial), fresh)).first;
+	}
+	board = &(itb->second);
+	return FT_OK;
+}
+
+// Follows FT245_communication.vhd: a command byte then its little endian arguments, or the data of a burst
+FT_STATUS USB_Loopback_Transport::Write(const BYTE * data, DWORD size, DWORD * written)
+{
+	*written = 0;
+	if (!board) {
+		return FT_INVALID_HANDLE;
+	}
+	std::lock_guard<std::mutex> lock(guard);
+	Board & b = *board;
+	// A failing write takes only the bytes before the failure, like a device that timed out part way
+	bool fail = failEvery > 0 && ++failCount % failEvery == 0;
+	DWORD taken = (fail && failAfter < size) ? failAfter : size;
+	for (DWORD k = 0; k < taken; k++) {
+		BYTE byte = data[k];
+		if (b.dataLeft > 0) {
+			// burst data goes to memory a word at a time
+			if (b.dataLeft-- % 2 == 0) {
+				b.low = byte;
+			}
+			else {
+				if (b.channel < USB_LOOPBACK_CHANNELS) {
+					b.memory[b.channel][b.address] = (unsigned short) (b.low | (unsigned(byte) << 8));
+				}
+				b.address = (b.address + 1) % USB_MEMORY_WORDS;
+				if (b.dataLeft == 0) {
+					// the FPGA counts the burst down to 0, so another burst needs a new count
+					b.burst = 0;
+				}
+			}
+			continue;
+		}
+		if (b.cmd >= 0) {
+			b.arg |= unsigned(byte) << (8 * ((b.cmd == 0x04 ? 1 : 2) - b.argBytes));
+			if (--b.argBytes > 0) {
+				continue;
+			}
+			switch (b.cmd)
+			{
+			case 0x00: b.burst = b.arg; break;
+			case 0x01:
+				// a single word is a burst of one, which leaves the count at 0 like any other burst
+				b.burst = 0;
+				if (b.channel < USB_LOOPBACK_CHANNELS) {
+					b.memory[b.channel][b.address] = (unsigned short) b.arg;
+				}
+				b.address = (b.address + 1) % USB_MEMORY_WORDS;
+				break;
+			case 0x03: b.address = b.arg % USB_MEMORY_WORDS; break;
+			case 0x04: b.channel = b.arg; break;
+			}
+			b.cmd = -1;
+			continue;
+		}
+		switch (byte)
+		{
+		case 0x00: case 0x01: case 0x03:
+			b.cmd = byte; b.argBytes = 2; b.arg = 0;
+			break;
+		case 0x04:
+			b.cmd = byte; b.argBytes = 1; b.arg = 0;
+			break;
+		case 0x02:
+			b.dataLeft = 2UL * b.burst;
+			break;
+		case 0x05:
+			if (b.channel < USB_LOOPBACK_CHANNELS) {
+				b.runs[b.channel]++;
+			}
+			break;
+		default:
+			// the FPGA ignores anything else
+			break;
+		}
+	}
+	b.bytes += taken;
+	*written = taken;
+	return fail ? FT_IO_ERROR : FT_OK;
+}
+
+bool USB_Loopback_Transport::Inspect(const std::string & serial, Board & state)
+{
+	std::lock_guard<std::mutex> lock(guard);
+	std::map<std::string, Board>::iterator itb = Boards.find(serial);
+	if (itb == Boards.end()) {
+		return false;
+	}
+	state = itb->second;
+	return true;
+}
+
+void USB_Loopback_Transport::ClearBoards()
+{
+	std::lock_guard<std::mutex> lock(guard);
+	Boards.clear();
+}
+
+void USB_Loopback_Transport::FailEvery(unsigned writes, DWORD after)
+{
+	std::lock_guard<std::mutex> lock(guard);
+	failEvery = writes;
+	failAfter = after;
+	failCount = 0;
+}
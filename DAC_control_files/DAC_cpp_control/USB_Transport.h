@@ -0,0 +1,201 @@
+/*
+Header file for the transports that carry bytes to the USB-connected FPGA cards
+USB_WaveDev writes through one of these, so the same sequencer runs on the FTDI D2XX driver, on libftdi/libusb
+where there is no D2XX driver, or against an in-process emulator of the FPGA with no hardware at all
+
+The D2XX transport is always built on Windows, and elsewhere when USB_HAVE_D2XX is defined (the Linux D2XX package)
+The libftdi transport is built when USB_HAVE_LIBFTDI is defined, the CMake build does so when pkg-config finds libftdi1
+The loopback transport is always built
+*/
+
+#ifndef USB_TRANSPORT_H
+#define USB_TRANSPORT_H
+
+#include <vector> // needed for the device list and emulated memory
+#include <string> // needed for serial numbers and transport names
+#include <map> // needed for the emulated boards by serial
+#include <mutex> // guards the emulated boards
+
+#ifdef _WIN32
+#include <wtypes.h> //needed for certain variable types in FTD2XX.H
+#include "FTD2XX.H" // Header file for USB controls and types
+#ifndef USB_HAVE_D2XX
+#define USB_HAVE_D2XX
+#endif
+#elif defined(USB_HAVE_D2XX)
+#include <WinTypes.h> // variable types from the Linux D2XX package
+#include <ftd2xx.h> // Header file for USB controls and types, from the Linux D2XX package
+#else
+// The Windows types and D2XX status codes the sequencer uses, for builds without the D2XX headers
+typedef unsigned char BYTE;
+typedef unsigned int DWORD;
+typedef unsigned int ULONG;
+typedef int BOOL;
+typedef void * PVOID;
+typedef PVOID FT_HANDLE;
+typedef ULONG FT_STATUS;
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+enum {
+	FT_OK,
+	FT_INVALID_HANDLE,
+	FT_DEVICE_NOT_FOUND,
+	FT_DEVICE_NOT_OPENED,
+	FT_IO_ERROR,
+	FT_INSUFFICIENT_RESOURCES,
+	FT_INVALID_PARAMETER,
+	FT_INVALID_BAUD_RATE,
+	FT_DEVICE_NOT_OPENED_FOR_ERASE,
+	FT_DEVICE_NOT_OPENED_FOR_WRITE,
+	FT_FAILED_TO_WRITE_DEVICE,
+	FT_EEPROM_READ_FAILED,
+	FT_EEPROM_WRITE_FAILED,
+	FT_EEPROM_ERASE_FAILED,
+	FT_EEPROM_NOT_PRESENT,
+	FT_EEPROM_NOT_PROGRAMMED,
+	FT_INVALID_ARGS,
+	FT_NOT_SUPPORTED,
+	FT_OTHER_ERROR,
+	FT_DEVICE_LIST_NOT_READY,
+};
+#endif
+
+#ifdef USB_HAVE_LIBFTDI
+#include <ftdi.h> // for opening and setting up the FT245RL without D2XX
+#include <libusb.h> // for the asynchronous bulk transfers
+#endif
+
+// Names of the transports, for USB_Transport::Select
+#define USB_TRANSPORT_D2XX "d2xx"
+#define USB_TRANSPORT_FTDI "ftdi"
+#define USB_TRANSPORT_LOOPBACK "loopback"
+
+// USB IDs of the FT245RL on the cards, for libftdi
+#define USB_FTDI_VENDOR 0x0403
+#define USB_FTDI_PRODUCT 0x6001
+// libftdi writes are split into transfers of this many bytes, with up to USB_FTDI_IN_FLIGHT of them queued at once
+#define USB_FTDI_TRANSFER_BYTES 16384
+#define USB_FTDI_IN_FLIGHT 4
+// Time a libftdi transfer may take before the write fails, in milliseconds
+#define USB_FTDI_TIMEOUT_MS 5000
+// Failed attempts to handle USB events, after cancelling the queued transfers, before a write gives up on them
+#define USB_FTDI_EVENT_RETRIES 3
+
+// Channels the FPGA firmware decodes from the channel select byte: two DACs and the logic lines
+#define USB_FPGA_CHANNELS 3
+
+// Channels per emulated board; each has the FPGA's USB_MEMORY_WORDS of memory behind it
+#define USB_LOOPBACK_CHANNELS USB_FPGA_CHANNELS
+
+// Carries bytes to one device; every write returns a D2XX status whatever the transport
+class USB_Transport{
+public:
+	virtual ~USB_Transport() {}
+
+	// Open the device with this serial number
+	virtual FT_STATUS Open(const char * serial) = 0;
+	// Write bytes to the device, setting written to how many of the first bytes it took
+	virtual FT_STATUS Write(const BYTE * data, DWORD size, DWORD * written) = 0;
+	// Close the device
+	virtual FT_STATUS Close() = 0;
+
+	// Pick the transport used for devices opened from now on by name, returns false if it isn't built in
+	static bool Select(const std::string & name);
+	// Name of the transport in use: the one selected, or the first built in of d2xx, ftdi and loopback
+	static std::string Selected();
+	// A new, unopened transport of the kind in use
+	static USB_Transport * Create();
+	// Serial numbers of the devices the transport in use can see
+	static FT_STATUS ListDevices(std::vector<std::string> & serials);
+
+private:
+	static std::string selected;
+};
+
+#ifdef USB_HAVE_D2XX
+// The FTDI D2XX driver
+class USB_D2XX_Transport : public USB_Transport{
+public:
+	USB_D2XX_Transport() : ftHandle(NULL) {}
+
+	FT_STATUS Open(const char * serial);
+	FT_STATUS Write(const BYTE * data, DWORD size, DWORD * written);
+	FT_STATUS Close();
+
+	static FT_STATUS ListDevices(std::vector<std::string> & serials);
+
+private:
+	FT_HANDLE ftHandle; //the handle for the device
+};
+#endif
+
+#ifdef USB_HAVE_LIBFTDI
+// libftdi to find and set up the device, and libusb bulk transfers, queued several at a time, to write to it
+// The FT245RL only has the asynchronous FIFO mode, so the chip is left in it; it is the transfers that are asynchronous
+class USB_Ftdi_Transport : public USB_Transport{
+public:
+	USB_Ftdi_Transport() : ftdi(NULL) {}
+	~USB_Ftdi_Transport() { Close(); }
+
+	FT_STATUS Open(const char * serial);
+	FT_STATUS Write(const BYTE * data, DWORD size, DWORD * written);
+	FT_STATUS Close();
+
+	static FT_STATUS ListDevices(std::vector<std::string> & serials);
+
+private:
+	struct ftdi_context * ftdi;
+
+	// Called by libusb when a transfer finishes
+	static void LIBUSB_CALL TransferDone(struct libusb_transfer * transfer);
+};
+#endif
+
+// An in-process FPGA: the bytes written are decoded as FT245_communication.vhd does into the memory of each channel
+// Any serial number opens, and boards with the same serial share their memory until ClearBoards
+class USB_Loopback_Transport : public USB_Transport{
+public:
+	USB_Loopback_Transport() : board(NULL) {}
+
+	FT_STATUS Open(const char * serial);
+	FT_STATUS Write(const BYTE * data, DWORD size, DWORD * written);
+	FT_STATUS Close() { board = NULL; return FT_OK; };
+
+	// State of an emulated board: its memory, and where the command stream is between writes
+	struct Board {
+		std::vector<unsigned short> memory[USB_LOOPBACK_CHANNELS];
+		unsigned channel; // channel selected
+		unsigned address; // next word address, auto-incremented
+		unsigned burst; // burst length in words, back to 0 once a burst or single write has used it
+		unsigned long dataLeft; // burst data bytes still to come
+		int cmd; // command waiting for its arguments, -1 for none
+		unsigned argBytes; // argument bytes still to come
+		unsigned arg;
+		BYTE low; // first byte of a data word
+		unsigned long runs[USB_LOOPBACK_CHANNELS]; // run commands seen on each channel
+		unsigned long long bytes; // bytes written to the board
+	};
+
+	// Copy of the state of the board with this serial, returns false if no such board was opened
+	static bool Inspect(const std::string & serial, Board & state);
+	// Forget all emulated boards, only while none of them is open
+	static void ClearBoards();
+	// Make every nth write to an emulated board stop after some bytes and fail, to test resuming uploads; 0 for none
+	static void FailEvery(unsigned writes, DWORD after);
+
+private:
+	Board * board;
+
+	static std::map<std::string, Board> Boards;
+	static std::mutex guard;
+	// Writes between failures, bytes a failing write takes, and writes since the last failure
+	static unsigned failEvery;
+	static DWORD failAfter;
+	static unsigned failCount;
+};
+
+#endif
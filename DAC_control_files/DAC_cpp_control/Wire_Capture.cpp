@@ -0,0 +1,256 @@
+// Wire_Capture.cpp : capture, replay and dump of the bytes sent to the USB devices
+#include "stdafx.h"
+using namespace std;
+
+#include <thread> // for pacing a replay
+#include <map> // for the devices and command streams by serial
+#include <stdio.h> // for printf
+#include <string.h> // for memcpy
+#include "Wire_Capture.h"
+
+bool USB_Wire_Capture::active = false;
+std::ofstream USB_Wire_Capture::out;
+std::mutex USB_Wire_Capture::guard;
+std::chrono::steady_clock::time_point USB_Wire_Capture::start;
+
+// Header at the start of every capture file
+static const char WIRE_CAPTURE_MAGIC[4] = { 'W', 'C', 'A', 'P' };
+
+// Writes and reads little endian words
+static void PutWord(unsigned char * p, unsigned long long value, unsigned bytes)
+{
+	for (unsigned j = 0; j < bytes; j++) {
+		p[j] = (unsigned char) (value >> (8 * j));
+	}
+}
+static unsigned long long ReadWord(const unsigned char * p, unsigned bytes)
+{
+	unsigned long long value = 0;
+	for (unsigned j = 0; j < bytes; j++) {
+		value |= (unsigned long long) p[j] << (8 * j);
+	}
+	return value;
+}
+
+bool USB_Wire_Capture::Start(const std::string & file)
+{
+	std::lock_guard<std::mutex> lock(guard);
+	if (out.is_open()) {
+		out.close();
+	}
+	out.open(file.c_str(), ios::out | ios::binary | ios::trunc);
+	if (!out.is_open()) {
+		std::cout << "Could not create capture file " << file << std::endl;
+		active = false;
+		return false;
+	}
+	unsigned char header[8];
+	memcpy(header, WIRE_CAPTURE_MAGIC, 4);
+	PutWord(header + 4, WIRE_CAPTURE_VERSION, 4);
+	out.write((const char *) header, sizeof(header));
+	start = std::chrono::steady_clock::now();
+	active = true;
+	std::cout << "Capturing device writes to " << file << std::endl;
+	return true;
+}
+
+void USB_Wire_Capture::Stop()
+{
+	std::lock_guard<std::mutex> lock(guard);
+	active = false;
+	if (out.is_open()) {
+		out.close();
+	}
+}
+
+void USB_Wire_Capture::Record(const char * serial, FT_STATUS status, const BYTE * data, DWORD size)
+{
+	std::lock_guard<std::mutex> lock(guard);
+	if (!active) {
+		return;
+	}
+	unsigned char header[WIRE_RECORD_HEADER];
+	PutWord(header, (unsigned long long) std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count(), 8);
+	// serials are 8 characters; shorter ones are padded with nulls
+	memset(header + 8, 0, 8);
+	for (unsigned j = 0; j < 8 && serial[j]; j++) {
+		header[8 + j] = (unsigned char) serial[j];
+	}
+	PutWord(header + 16, (unsigned long long) status, 4);
+	PutWord(header + 20, size, 4);
+	out.write((const char *) header, sizeof(header));
+	if (size > 0) {
+		out.write((const char *) data, size);
+	}
+}
+
+bool USB_Wire_Capture::Load(const std::string & file, std::vector<USB_Wire_Record> & records)
+{
+	ifstream fs(file.c_str(), ios::in | ios::binary);
+	if (!fs.is_open()) {
+		std::cout << "Could not open capture file " << file << std::endl;
+		return false;
+	}
+	unsigned char header[WIRE_RECORD_HEADER];
+	if (!fs.read((char *) header, 8) || memcmp(header, WIRE_CAPTURE_MAGIC, 4) != 0
+		|| ReadWord(header + 4, 4) != WIRE_CAPTURE_VERSION) {
+		std::cout << file << " is not a capture file this version can read" << std::endl;
+		return false;
+	}
+
+	records.clear();
+	while (fs.read((char *) header, sizeof(header))) {
+		USB_Wire_Record record;
+		record.time_us = ReadWord(header, 8);
+		record.serial.assign((const char *) header + 8, strnlen((const char *) header + 8, 8));
+		record.status = (FT_STATUS) ReadWord(header + 16, 4);
+		record.bytes.resize((size_t) ReadWord(header + 20, 4));
+		if (!record.bytes.empty() && !fs.read((char *) &record.bytes[0], record.bytes.size())) {
+			// a capture cut off while writing keeps the records before the last one
+			std::cout << "Capture file ends part way through a record" << std::endl;
+			break;
+		}
+		records.push_back(record);
+	}
+	return true;
+}
+
+bool USB_Wire_Capture::Replay(const std::string & file, bool maxSpeed)
+{
+	std::vector<USB_Wire_Record> records;
+	if (!Load(file, records)) {
+		return false;
+	}
+
+	// Devices by serial
+	std::map<std::string, unsigned> devices;
+	for (unsigned i = 0; i < USB_Waveform_Manager::USBWaveDevList.size(); i++) {
+		devices[std::string(USB_Waveform_Manager::USBWaveDevList[i].Serial)] = i;
+	}
+
+	unsigned long sent = 0, skipped = 0, failed = 0, changed = 0;
+	unsigned long long bytes = 0;
+	std::chrono::steady_clock::time_point replayStart = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < records.size(); i++) {
+		USB_Wire_Record & record = records[i];
+		std::map<std::string, unsigned>::iterator itd = devices.find(record.serial);
+		if (itd == devices.end()) {
+			// no open device has this serial
+			skipped++;
+			continue;
+		}
+		if (!maxSpeed) {
+			std::this_thread::sleep_until(replayStart + std::chrono::microseconds(record.time_us));
+		}
+		FT_STATUS status = USB_Waveform_Manager::USBWaveDevList[itd->second].Write(
+			record.bytes.empty() ? NULL : &record.bytes[0], (DWORD) record.bytes.size());
+		sent++;
+		bytes += record.bytes.size();
+		if (status != FT_OK) { failed++; }
+		if (status != record.status) { changed++; }
+	}
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - replayStart).count();
+
+	std::cout << "Replayed " << sent << " writes, " << bytes << " bytes in " << ms << " ms";
+	if (ms > 0) {
+		std::cout << " (" << bytes / (ms * 1000.0) << " MB/s)";
+	}
+	if (!records.empty()) {
+		std::cout << ", captured over " << records.back().time_us / 1000.0 << " ms";
+	}
+	std::cout << std::endl;
+	if (skipped) {
+		std::cout << skipped << " writes skipped, their device isn't open" << std::endl;
+	}
+	if (changed) {
+		std::cout << changed << " writes returned a different status than when captured" << std::endl;
+	}
+	return failed == 0;
+}
+
+// Where the command stream to one device is, between writes
+struct USB_Wire_Decode {
+	int cmd; // command waiting for its arguments, -1 for none
+	unsigned argBytes; // argument bytes still to come
+	unsigned arg;
+	unsigned burst; // burst length in words, as last set
+	unsigned long dataLeft; // burst data bytes still to come
+};
+
+bool USB_Wire_Capture::Dump(const std::string & file)
+{
+	std::vector<USB_Wire_Record> records;
+	if (!Load(file, records)) {
+		return false;
+	}
+
+	// Bursts and arguments may be split across writes, so the command stream is followed per device
+	std::map<std::string, USB_Wire_Decode> streams;
+	for (size_t i = 0; i < records.size(); i++) {
+		USB_Wire_Record & record = records[i];
+		if (streams.find(record.serial) == streams.end()) {
+			USB_Wire_Decode fresh = { -1, 0, 0, 0, 0 };
+			streams[record.serial] = fresh;
+		}
+		USB_Wire_Decode & d = streams[record.serial];
+
+		printf("%12.3f ms %-8s status %lu, %lu bytes:", record.time_us / 1000.0, record.serial.c_str(),
+			(unsigned long) record.status, (unsigned long) record.bytes.size());
+		size_t k = 0;
+		while (k < record.bytes.size()) {
+			if (d.dataLeft > 0) {
+				// burst data goes straight to memory
+				size_t n = record.bytes.size() - k;
+				if (n > d.dataLeft) { n = d.dataLeft; }
+				printf(" data %lu", (unsigned long) n);
+				d.dataLeft -= (unsigned long) n;
+				k += n;
+				if (d.dataLeft == 0) {
+					// the FPGA counts the burst down to 0, so another burst needs a new count
+					d.burst = 0;
+				}
+				continue;
+			}
+			BYTE b = record.bytes[k++];
+			if (d.cmd >= 0) {
+				// arguments are little endian
+				d.arg |= unsigned(b) << (8 * ((d.cmd == 0x04 ? 1 : 2) - d.argBytes));
+				if (--d.argBytes > 0) {
+					continue;
+				}
+				switch (d.cmd)
+				{
+				case 0x00: d.burst = d.arg; printf(" length %u", d.arg); break;
+				case 0x01: d.burst = 0; printf(" word %04X", d.arg); break; // a single word leaves the count at 0 too
+				case 0x03: printf(" addr %u", d.arg); break;
+				case 0x04: printf(" chan %u", d.arg); break;
+				}
+				d.cmd = -1;
+				continue;
+			}
+			switch (b)
+			{
+			case 0x00: case 0x01: case 0x03:
+				d.cmd = b; d.argBytes = 2; d.arg = 0;
+				break;
+			case 0x04:
+				d.cmd = b; d.argBytes = 1; d.arg = 0;
+				break;
+			case 0x02:
+				printf(" burst");
+				d.dataLeft = 2UL * d.burst;
+				break;
+			case 0x05:
+				printf(" run");
+				break;
+			default:
+				// the FPGA ignores anything else
+				printf(" skip %02X", b);
+			}
+		}
+		printf("\n");
+	}
+	std::cout << records.size() << " writes in " << file << std::endl;
+	return true;
+}
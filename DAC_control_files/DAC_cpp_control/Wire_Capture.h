@@ -0,0 +1,61 @@
+/*
+Header file for capturing the bytes sent to the USB devices, and replaying or dumping a capture
+Every call to USB_WaveDev::Write is recorded while a capture is open, so an upload can be sent again
+byte for byte when timing a change to the transport, or dumped as FPGA commands to compare two versions
+
+A capture file is a 8 byte header followed by one record per write, all little endian:
+	header: 'W' 'C' 'A' 'P', 4 bytes version
+	record: 8 bytes time in microseconds from the start of the capture, 8 bytes device serial,
+		4 bytes FT_STATUS of the write, 4 bytes length, then the bytes written
+*/
+
+#ifndef WIRE_CAPTURE_H
+#define WIRE_CAPTURE_H
+
+#include <vector> // needed for the records of a capture
+#include <string> // needed for file names and serials
+#include <fstream> // the capture file
+#include <mutex> // writes may come from more than one thread
+#include <chrono> // for time stamps
+#include "USB_Device.h" // for the FT_STATUS and BYTE types
+
+#define WIRE_CAPTURE_VERSION 1
+#define WIRE_RECORD_HEADER 24
+
+// One write to a device
+struct USB_Wire_Record {
+	unsigned long long time_us; // time from the start of the capture
+	std::string serial; // serial number of the device written to
+	FT_STATUS status; // result of the write when it was captured
+	USBWVF_bytes bytes; // the bytes written
+};
+
+class USB_Wire_Capture{
+public:
+	// Start recording every write to a capture file, replacing the file; returns false if it can't be created
+	static bool Start(const std::string & file);
+	// Stop recording and close the capture file
+	static void Stop();
+	// True while a capture is open
+	static bool Active() { return active; };
+
+	// Record one write; called by USB_WaveDev::Write
+	static void Record(const char * serial, FT_STATUS status, const BYTE * data, DWORD size);
+
+	// Read all the records of a capture file
+	static bool Load(const std::string & file, std::vector<USB_Wire_Record> & records);
+
+	// Send a capture to the open devices with the same serials, at the captured pace or as fast as possible
+	static bool Replay(const std::string & file, bool maxSpeed);
+
+	// Print a capture as the FPGA commands it holds
+	static bool Dump(const std::string & file);
+
+private:
+	static bool active;
+	static std::ofstream out;
+	static std::mutex guard;
+	static std::chrono::steady_clock::time_point start;
+};
+
+#endif
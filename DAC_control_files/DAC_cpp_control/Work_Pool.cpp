@@ -0,0 +1,116 @@
+// Work_Pool.cpp : pool of worker threads with work stealing
+#include "stdafx.h"
+using namespace std;
+
+#include "Work_Pool.h"
+
+Work_Pool::Work_Pool(unsigned threads) : queued(0), pending(0), steals(0), nextQueue(0), stopping(false)
+{
+	if (threads == 0) {
+		threads = std::thread::hardware_concurrency();
+	}
+	if (threads == 0) {
+		// the number of cores isn't known
+		threads = 1;
+	}
+	for (unsigned i = 0; i < threads; i++) {
+		queues.push_back(std::unique_ptr<Worker_Queue>(new Worker_Queue()));
+	}
+	for (unsigned i = 0; i < threads; i++) {
+		workers.push_back(std::thread(&Work_Pool::WorkerLoop, this, i));
+	}
+}
+
+Work_Pool::~Work_Pool()
+{
+	Wait();
+	{
+		std::lock_guard<std::mutex> lock(idleGuard);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (unsigned i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+int Work_Pool::CurrentWorker() const
+{
+	std::thread::id self = std::this_thread::get_id();
+	for (unsigned i = 0; i < workers.size(); i++) {
+		if (workers[i].get_id() == self) {
+			return int(i);
+		}
+	}
+	return -1;
+}
+
+void Work_Pool::Submit(std::function<void()> job)
+{
+	int worker = CurrentWorker();
+	unsigned index = worker >= 0 ? unsigned(worker) : (nextQueue++ % unsigned(queues.size()));
+	pending++;
+	{
+		std::lock_guard<std::mutex> lock(queues[index]->guard);
+		queues[index]->jobs.push_back(std::move(job));
+	}
+	queued++;
+	// Taking the idle lock before waking means a worker can't miss the job between checking and sleeping
+	std::lock_guard<std::mutex> lock(idleGuard);
+	wake.notify_one();
+}
+
+bool Work_Pool::TakeJob(unsigned index, std::function<void()> & job)
+{
+	// Own queue first, newest job first, since its data is most likely still in the cache
+	{
+		Worker_Queue & own = *queues[index];
+		std::lock_guard<std::mutex> lock(own.guard);
+		if (!own.jobs.empty()) {
+			job = std::move(own.jobs.back());
+			own.jobs.pop_back();
+			queued--;
+			return true;
+		}
+	}
+	// Then the other queues, oldest job first, which tends to be the biggest piece of work left
+	for (unsigned k = 1; k < queues.size(); k++) {
+		Worker_Queue & other = *queues[(index + k) % queues.size()];
+		std::lock_guard<std::mutex> lock(other.guard);
+		if (!other.jobs.empty()) {
+			job = std::move(other.jobs.front());
+			other.jobs.pop_front();
+			queued--;
+			steals++;
+			return true;
+		}
+	}
+	return false;
+}
+
+void Work_Pool::WorkerLoop(unsigned index)
+{
+	std::function<void()> job;
+	while (true) {
+		if (TakeJob(index, job)) {
+			job();
+			job = nullptr;
+			if (--pending == 0) {
+				std::lock_guard<std::mutex> lock(idleGuard);
+				done.notify_all();
+			}
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(idleGuard);
+		wake.wait(lock, [this] { return stopping || queued > 0; });
+		if (stopping && queued == 0) {
+			return;
+		}
+	}
+}
+
+void Work_Pool::Wait()
+{
+	std::unique_lock<std::mutex> lock(idleGuard);
+	done.wait(lock, [this] { return pending == 0; });
+}
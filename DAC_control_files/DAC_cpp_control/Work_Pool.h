@@ -0,0 +1,61 @@
+/*
+Header file for a pool of worker threads with work stealing
+Every worker has its own queue of jobs; a job submitted from a worker goes on that worker's queue,
+and a worker with nothing left to do takes the oldest job from another worker's queue
+*/
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <vector> // needed for the workers and their queues
+#include <deque> // holds the jobs of one worker
+#include <memory> // for the queues, which can't be moved
+#include <functional> // a job is any function with no arguments
+#include <thread> // the workers
+#include <mutex> // guards each queue
+#include <condition_variable> // for idle workers and for waiting on the jobs to finish
+#include <atomic> // for the job counts
+
+class Work_Pool{
+public:
+	// Start a number of workers, one per core when 0
+	explicit Work_Pool(unsigned threads = 0);
+	// Finishes the jobs already submitted, then stops the workers
+	~Work_Pool();
+
+	// Add a job; from inside a job it goes on the running worker's own queue, otherwise the queues take turns
+	void Submit(std::function<void()> job);
+
+	// Wait until every job submitted, including jobs submitted by other jobs, has run; not for use from inside a job
+	void Wait();
+
+	unsigned Threads() const { return unsigned(workers.size()); };
+
+	// Jobs taken from another worker's queue since the pool started
+	unsigned long Steals() const { return steals; };
+
+private:
+	struct Worker_Queue {
+		std::mutex guard;
+		std::deque<std::function<void()> > jobs;
+	};
+
+	void WorkerLoop(unsigned index);
+	// Take the newest job from a worker's own queue, or the oldest job from any other queue
+	bool TakeJob(unsigned index, std::function<void()> & job);
+	// Index of the worker running on this thread, -1 for any other thread
+	int CurrentWorker() const;
+
+	std::vector<std::unique_ptr<Worker_Queue> > queues;
+	std::vector<std::thread> workers;
+	std::atomic<unsigned long> queued; // jobs waiting in the queues
+	std::atomic<unsigned long> pending; // jobs submitted and not yet finished
+	std::atomic<unsigned long> steals;
+	std::atomic<unsigned> nextQueue; // queue for the next job submitted from outside the pool
+	bool stopping;
+	std::mutex idleGuard;
+	std::condition_variable wake; // a job was submitted, or the pool is stopping
+	std::condition_variable done; // pending reached zero
+};
+
+#endif
@@ -0,0 +1,372 @@
+// Wvf_Algebra.cpp : lazy composition of waveforms, evaluated and encoded on demand
+#include "stdafx.h"
+using namespace std;
+
+#include <string.h> // for memcpy
+#include "Wvf_Algebra.h"
+#include "Dac_Calibration.h"
+
+std::map<unsigned long long, std::shared_ptr<const USB_Wvf_Segments> > USB_Wvf_Algebra::Evaluated;
+std::map<std::pair<unsigned long long, unsigned long long>, USB_Wvf_Lines> USB_Wvf_Algebra::Encoded;
+unsigned long USB_Wvf_Algebra::evaluations = 0;
+unsigned long USB_Wvf_Algebra::encodings = 0;
+unsigned long USB_Wvf_Algebra::memoHits = 0;
+
+// Bits of a double, for hashing
+static unsigned long long DoubleBits(double value)
+{
+	unsigned long long bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+USB_Wvf_Expr USB_Wvf_Algebra::Finish(USB_Wvf_Node * node)
+{
+	std::vector<unsigned long long> words;
+	words.push_back((unsigned long long) node->kind);
+	words.push_back(DoubleBits(node->a));
+	words.push_back(DoubleBits(node->b));
+	words.push_back(node->count);
+
+	node->duration = 0;
+	for (size_t i = 0; i < node->parts.size(); i++) {
+		words.push_back(node->parts[i]->hash);
+		node->duration += node->parts[i]->duration;
+	}
+	switch (node->kind)
+	{
+	case WVF_SEGMENTS:
+		for (size_t i = 0; i < node->segments->size(); i++) {
+			node->duration += (*node->segments)[i].duration;
+		}
+		words.push_back(node->segments->empty() ? 0 :
+			USB_Step_Pool::HashBytes(&(*node->segments)[0], node->segments->size() * sizeof(USB_Wvf_Segment)));
+		break;
+	case WVF_STRETCH:
+		node->duration *= node->a;
+		break;
+	case WVF_REPEAT:
+		node->duration *= node->count;
+		break;
+	case WVF_SLICE:
+	{
+		double tStart = node->a > 0 ? node->a : 0;
+		double tEnd = node->b < node->duration ? node->b : node->duration;
+		node->duration = tEnd > tStart ? tEnd - tStart : 0;
+		break;
+	}
+	default:
+		break;
+	}
+
+	node->hash = USB_Step_Pool::HashBytes(&words[0], words.size() * sizeof(unsigned long long));
+	return USB_Wvf_Expr(node);
+}
+
+// A node of a kind over some parts, with its parameters
+static USB_Wvf_Node * NewNode(USB_Wvf_Kind kind, double a, double b, unsigned count)
+{
+	USB_Wvf_Node * node = new USB_Wvf_Node();
+	node->kind = kind;
+	node->a = a;
+	node->b = b;
+	node->count = count;
+	node->duration = 0;
+	node->hash = 0;
+	return node;
+}
+
+USB_Wvf_Expr USB_Wvf_Algebra::Segments(const USB_Wvf_Segments & segments)
+{
+	USB_Wvf_Node * node = NewNode(WVF_SEGMENTS, 0, 0, 0);
+	node->segments.reset(new USB_Wvf_Segments(segments));
+	return Finish(node);
+}
+
+USB_Wvf_Expr USB_Wvf_Algebra::File(const std::string & file)
+{
+	ifstream fs(file.c_str());
+	if (!fs.is_open()) {
+		std::cout << "Could not open waveform file " << file << std::endl;
+		return USB_Wvf_Expr();
+	}
+	// Times in the file are from the start of the step, segments hold durations
+	USB_Wvf_Segments segments;
+	std::string line;
+	double lastTime = 0;
+	double time, val, dV;
+	while (getline(fs, line)) {
+		if (USB_Waveform_Manager::ParseLine(line, false, time, val, dV) > 0) {
+			USB_Wvf_Segment seg = { time - lastTime, val, dV };
+			segments.push_back(seg);
+			lastTime = time;
+		}
+	}
+	return Segments(segments);
+}
+
+USB_Wvf_Expr USB_Wvf_Algebra::Concat(const std::vector<USB_Wvf_Expr> & parts)
+{
+	USB_Wvf_Node * node = NewNode(WVF_CONCAT, 0, 0, 0);
+	for (size_t i = 0; i < parts.size(); i++) {
+		if (!parts[i]) {
+			delete node;
+			return USB_Wvf_Expr();
+		}
+		node->parts.push_back(parts[i]);
+	}
+	return Finish(node);
+}
+
+USB_Wvf_Expr USB_Wvf_Algebra::Concat(const USB_Wvf_Expr & first, const USB_Wvf_Expr & second)
+{
+	std::vector<USB_Wvf_Expr> parts;
+	parts.push_back(first);
+	parts.push_back(second);
+	return Concat(parts);
+}
+
+// An operation on a single part
+static USB_Wvf_Node * UnaryNode(USB_Wvf_Kind kind, const USB_Wvf_Expr & wvf, double a, double b, unsigned count)
+{
+	if (!wvf) {
+		return NULL;
+	}
+	USB_Wvf_Node * node = NewNode(kind, a, b, count);
+	node->parts.push_back(wvf);
+	return node;
+}
+
+USB_Wvf_Expr USB_Wvf_Algebra::Offset(const USB_Wvf_Expr & wvf, double volts)
+{
+	USB_Wvf_Node * node = UnaryNode(WVF_OFFSET, wvf, volts, 0, 0);
+	return node ? Finish(node) : USB_Wvf_Expr();
+}
+
+USB_Wvf_Expr USB_Wvf_Algebra::Scale(const USB_Wvf_Expr & wvf, double factor)
+{
+	USB_Wvf_Node * node = UnaryNode(WVF_SCALE, wvf, factor, 0, 0);
+	return node ? Finish(node) : USB_Wvf_Expr();
+}
+
+USB_Wvf_Expr USB_Wvf_Algebra::Stretch(const USB_Wvf_Expr & wvf, double factor)
+{
+	if (factor <= 0) {
+		std::cout << "A waveform can only be stretched by a positive factor" << std::endl;
+		return USB_Wvf_Expr();
+	}
+	USB_Wvf_Node * node = UnaryNode(WVF_STRETCH, wvf, factor, 0, 0);
+	return node ? Finish(node) : USB_Wvf_Expr();
+}
+
+USB_Wvf_Expr USB_Wvf_Algebra::Repeat(const USB_Wvf_Expr & wvf, unsigned times)
+{
+	USB_Wvf_Node * node = UnaryNode(WVF_REPEAT, wvf, 0, 0, times);
+	return node ? Finish(node) : USB_Wvf_Expr();
+}
+
+USB_Wvf_Expr USB_Wvf_Algebra::Slice(const USB_Wvf_Expr & wvf, double tStart, double tEnd)
+{
+	USB_Wvf_Node * node = UnaryNode(WVF_SLICE, wvf, tStart, tEnd, 0);
+	return node ? Finish(node) : USB_Wvf_Expr();
+}
+
+// Built from slices, so variants that splice different waveforms into the same place share the slices
+USB_Wvf_Expr USB_Wvf_Algebra::Splice(const USB_Wvf_Expr & wvf, double tStart, double tEnd, const USB_Wvf_Expr & insert)
+{
+	if (!wvf || !insert) {
+		return USB_Wvf_Expr();
+	}
+	std::vector<USB_Wvf_Expr> parts;
+	parts.push_back(Slice(wvf, 0, tStart));
+	parts.push_back(insert);
+	parts.push_back(Slice(wvf, tEnd, wvf->duration));
+	return Concat(parts);
+}
+
+std::shared_ptr<const USB_Wvf_Segments> USB_Wvf_Algebra::Evaluate(const USB_Wvf_Expr & wvf)
+{
+	if (!wvf) {
+		return std::shared_ptr<const USB_Wvf_Segments>();
+	}
+	if (wvf->kind == WVF_SEGMENTS) {
+		return wvf->segments;
+	}
+	std::map<unsigned long long, std::shared_ptr<const USB_Wvf_Segments> >::iterator itm = Evaluated.find(wvf->hash);
+	if (itm != Evaluated.end()) {
+		memoHits++;
+		return itm->second;
+	}
+
+	std::shared_ptr<USB_Wvf_Segments> out(new USB_Wvf_Segments());
+	std::shared_ptr<const USB_Wvf_Segments> part;
+	size_t i;
+	switch (wvf->kind)
+	{
+	case WVF_CONCAT:
+		for (i = 0; i < wvf->parts.size(); i++) {
+			part = Evaluate(wvf->parts[i]);
+			out->insert(out->end(), part->begin(), part->end());
+		}
+		break;
+	case WVF_OFFSET:
+		*out = *Evaluate(wvf->parts[0]);
+		for (i = 0; i < out->size(); i++) {
+			(*out)[i].vStart += wvf->a;
+			(*out)[i].vEnd += wvf->a;
+		}
+		break;
+	case WVF_SCALE:
+		*out = *Evaluate(wvf->parts[0]);
+		for (i = 0; i < out->size(); i++) {
+			(*out)[i].vStart *= wvf->a;
+			(*out)[i].vEnd *= wvf->a;
+		}
+		break;
+	case WVF_STRETCH:
+		*out = *Evaluate(wvf->parts[0]);
+		for (i = 0; i < out->size(); i++) {
+			(*out)[i].duration *= wvf->a;
+		}
+		break;
+	case WVF_REPEAT:
+		part = Evaluate(wvf->parts[0]);
+		out->reserve(part->size() * wvf->count);
+		for (unsigned k = 0; k < wvf->count; k++) {
+			out->insert(out->end(), part->begin(), part->end());
+		}
+		break;
+	case WVF_SLICE:
+	{
+		// Segments crossing either end of the slice are cut, with the voltage where they are cut
+		part = Evaluate(wvf->parts[0]);
+		double t = 0;
+		for (i = 0; i < part->size(); i++) {
+			const USB_Wvf_Segment & seg = (*part)[i];
+			double segEnd = t + seg.duration;
+			double lo = t > wvf->a ? t : wvf->a;
+			double hi = segEnd < wvf->b ? segEnd : wvf->b;
+			if (hi > lo && seg.duration > 0) {
+				double f0 = (lo - t) / seg.duration;
+				double f1 = (hi - t) / seg.duration;
+				USB_Wvf_Segment cut = { hi - lo, seg.vStart + f0 * (seg.vEnd - seg.vStart), seg.vStart + f1 * (seg.vEnd - seg.vStart) };
+				out->push_back(cut);
+			}
+			t = segEnd;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	evaluations++;
+	if (Evaluated.size() >= WVF_MEMO_ENTRIES) {
+		Evaluated.clear();
+	}
+	Evaluated[wvf->hash] = out;
+	return out;
+}
+
+// Encodes segments as waveform lines, with times from the start of the segments; the encoder splits long segments
+// and merges short ones, and a line still held at the end is written out
+// Returns true when the lines end on a whole DAC update with nothing held or lengthened, so the same segments
+// encoded after them in one pass would start fresh, exactly where these end
+static bool EncodeSegments(const USB_Wvf_Segments & segments, const USB_Dac_Cal * cal, USBWVF_bytes & out)
+{
+	out.reserve(out.size() + 8 * segments.size());
+	USB_Wvf_Encode_State state(cal);
+	double time = 0;
+	for (size_t i = 0; i < segments.size(); i++) {
+		const USB_Wvf_Segment & seg = segments[i];
+		if (seg.duration <= 0) {
+			continue;
+		}
+		time += seg.duration;
+		USB_Waveform_Manager::WvfEncodeLines(out, &time, &seg.vStart, &seg.vEnd, 1, state);
+	}
+	long long endTick = USB_Waveform_Manager::DacTicks(time);
+	bool whole = !state.pending && state.tick == endTick && fabs(time / USB_DAC_UPDATE - double(endTick)) < 1e-6;
+	USB_Waveform_Manager::WvfEncodeFlush(out, state);
+	return whole;
+}
+
+std::shared_ptr<const USBWVF_bytes> USB_Wvf_Algebra::Lines(const USB_Wvf_Expr & wvf, const USB_Dac_Cal * cal)
+{
+	return Encode(wvf, cal).bytes;
+}
+
+USB_Wvf_Lines USB_Wvf_Algebra::Encode(const USB_Wvf_Expr & wvf, const USB_Dac_Cal * cal)
+{
+	USB_Wvf_Lines lines;
+	lines.whole = false;
+	if (!wvf) {
+		return lines;
+	}
+	std::pair<unsigned long long, unsigned long long> key(wvf->hash, cal ? cal->hash : 0);
+	std::map<std::pair<unsigned long long, unsigned long long>, USB_Wvf_Lines>::iterator itm = Encoded.find(key);
+	if (itm != Encoded.end()) {
+		memoHits++;
+		return itm->second;
+	}
+
+	std::shared_ptr<USBWVF_bytes> out(new USBWVF_bytes());
+	bool joined = false;
+	if (wvf->kind == WVF_CONCAT) {
+		// Each part is encoded, or remembered, on its own, and joined if every boundary lets it be
+		std::vector<USB_Wvf_Lines> parts(wvf->parts.size());
+		joined = true;
+		lines.whole = true;
+		for (size_t i = 0; i < parts.size(); i++) {
+			parts[i] = Encode(wvf->parts[i], cal);
+			joined = joined && (parts[i].whole || i + 1 == parts.size());
+			lines.whole = lines.whole && parts[i].whole;
+		}
+		for (size_t i = 0; joined && i < parts.size(); i++) {
+			out->insert(out->end(), parts[i].bytes->begin(), parts[i].bytes->end());
+		}
+	}
+	else if (wvf->kind == WVF_REPEAT) {
+		USB_Wvf_Lines part = Encode(wvf->parts[0], cal);
+		joined = part.whole || wvf->count <= 1;
+		lines.whole = part.whole || wvf->count == 0;
+		if (joined) {
+			out->reserve(part.bytes->size() * wvf->count);
+			for (unsigned k = 0; k < wvf->count; k++) {
+				out->insert(out->end(), part.bytes->begin(), part.bytes->end());
+			}
+		}
+	}
+	if (!joined) {
+		// Encoded in place: one pass over all the segments, with one state carrying the time and any held line
+		out->clear();
+		lines.whole = EncodeSegments(*Evaluate(wvf), cal, *out);
+		encodings++;
+	}
+	lines.bytes = out;
+
+	if (Encoded.size() >= WVF_MEMO_ENTRIES) {
+		Encoded.clear();
+	}
+	Encoded[key] = lines;
+	return lines;
+}
+
+bool USB_Wvf_Algebra::Load(const USB_Wvf_Expr & wvf, unsigned channel, unsigned step)
+{
+	std::shared_ptr<const USBWVF_bytes> lines = Lines(wvf, USB_Dac_Calibration::Find(channel));
+	if (!lines) {
+		return false;
+	}
+	USBWVF_bytes bytes;
+	bytes.reserve(lines->size() + 4);
+	bytes.assign(lines->begin(), lines->end());
+	USB_Wvf_Encode_State state;
+	USB_Waveform_Manager::WvfEncodeEnd(bytes, state);
+
+	// Variants that come out the same share one buffer, and aren't sent again if it is already on the board
+	USBWVF_data data(bytes);
+	data.intern();
+	USB_Waveform_Manager::USBWvf[channel][step] = data;
+	return true;
+}
@@ -0,0 +1,116 @@
+/*
+Header file for composing waveforms out of other waveforms
+A waveform expression is a graph of operations (concatenate, offset, scale, stretch, repeat, slice and splice)
+over lists of linear segments. Nothing is worked out when an expression is built: it is evaluated into segments
+and encoded only when it is loaded into a step. Every expression has a hash of its structure, and the segments
+and encoded lines of each expression are remembered by that hash, so in a scan over hundreds of variants only
+the parts that differ between variants are evaluated and encoded
+
+Lines are encoded on whole DAC updates from the start of the step, and a short line is merged with the next one or
+lengthened, so the lines of a part depend on where the part starts and on what was held before it. A concatenation
+or a repeat is encoded by joining the remembered lines of its parts only when every part before the last ends on a
+whole DAC update with nothing held, where encoding it in place would give the same lines; otherwise, and for the
+other operations, it is encoded from its segments in one pass
+*/
+
+#ifndef WVF_ALGEBRA_H
+#define WVF_ALGEBRA_H
+
+#include <vector> // needed for segment lists and the parts of an expression
+#include <map> // needed for the memos
+#include <string> // needed for file names
+#include <memory> // expressions and their results are shared
+#include "USB_Device.h" // for the waveform manager
+
+// Memos are emptied when they hold more expressions than this
+#define WVF_MEMO_ENTRIES 4096
+
+// A linear segment of a waveform: its duration in milliseconds, and the voltage at its start and end
+struct USB_Wvf_Segment {
+	double duration;
+	double vStart;
+	double vEnd;
+};
+
+typedef std::vector<USB_Wvf_Segment> USB_Wvf_Segments;
+
+// Kinds of expression node
+enum USB_Wvf_Kind {
+	WVF_SEGMENTS, // a list of segments
+	WVF_CONCAT, // the parts one after the other
+	WVF_OFFSET, // voltages plus a
+	WVF_SCALE, // voltages times a
+	WVF_STRETCH, // durations times a
+	WVF_REPEAT, // the part count times over
+	WVF_SLICE // the part between times a and b, cutting segments where needed
+};
+
+// One node of an expression; nodes are never changed once built, so they can be shared between expressions
+struct USB_Wvf_Node {
+	USB_Wvf_Kind kind;
+	std::vector<std::shared_ptr<const USB_Wvf_Node> > parts;
+	std::shared_ptr<const USB_Wvf_Segments> segments; // for WVF_SEGMENTS
+	double a; // parameters of the operation
+	double b;
+	unsigned count;
+	double duration; // total duration, known without evaluating
+	unsigned long long hash; // hash of the structure, equal for expressions built the same way
+};
+
+typedef std::shared_ptr<const USB_Wvf_Node> USB_Wvf_Expr;
+
+// Encoded lines of an expression, and whether they end on a whole DAC update with no line held,
+// so that lines encoded after them can be joined on
+struct USB_Wvf_Lines {
+	std::shared_ptr<const USBWVF_bytes> bytes;
+	bool whole;
+};
+
+class USB_Wvf_Algebra{
+public:
+	// Expressions from segments, or from a waveform file ("time_from_start start_voltage end_voltage" lines)
+	// File returns an empty expression if the file can't be read
+	static USB_Wvf_Expr Segments(const USB_Wvf_Segments & segments);
+	static USB_Wvf_Expr File(const std::string & file);
+
+	// Operations; none of them evaluates anything
+	static USB_Wvf_Expr Concat(const std::vector<USB_Wvf_Expr> & parts);
+	static USB_Wvf_Expr Concat(const USB_Wvf_Expr & first, const USB_Wvf_Expr & second);
+	static USB_Wvf_Expr Offset(const USB_Wvf_Expr & wvf, double volts);
+	static USB_Wvf_Expr Scale(const USB_Wvf_Expr & wvf, double factor);
+	static USB_Wvf_Expr Stretch(const USB_Wvf_Expr & wvf, double factor);
+	static USB_Wvf_Expr Repeat(const USB_Wvf_Expr & wvf, unsigned times);
+	// The part of a waveform between two times from its start
+	static USB_Wvf_Expr Slice(const USB_Wvf_Expr & wvf, double tStart, double tEnd);
+	// A waveform with the part between two times replaced by another waveform
+	static USB_Wvf_Expr Splice(const USB_Wvf_Expr & wvf, double tStart, double tEnd, const USB_Wvf_Expr & insert);
+
+	// Segments of an expression, evaluated when first asked for
+	static std::shared_ptr<const USB_Wvf_Segments> Evaluate(const USB_Wvf_Expr & wvf);
+	// Encoded lines of an expression, without the op-codes that end a step, encoded when first asked for
+	// Lines are remembered for each calibration they are encoded with, NULL for none
+	static std::shared_ptr<const USBWVF_bytes> Lines(const USB_Wvf_Expr & wvf, const USB_Dac_Cal * cal);
+
+	// Encode an expression into a step of USBWvf, replacing what the step held, with the channel's calibration
+	static bool Load(const USB_Wvf_Expr & wvf, unsigned channel, unsigned step);
+
+	// Forget the remembered segments and lines
+	static void ClearMemo() { Evaluated.clear(); Encoded.clear(); };
+
+	// Expressions evaluated and encoded, and results taken from the memos instead
+	static unsigned long evaluations;
+	static unsigned long encodings;
+	static unsigned long memoHits;
+
+private:
+	// Finish a node: work out its duration and hash from its parts and parameters
+	static USB_Wvf_Expr Finish(USB_Wvf_Node * node);
+	// Encoded lines of an expression, with whether lines after them can be joined on
+	static USB_Wvf_Lines Encode(const USB_Wvf_Expr & wvf, const USB_Dac_Cal * cal);
+
+	static std::map<unsigned long long, std::shared_ptr<const USB_Wvf_Segments> > Evaluated;
+	// encoded lines by expression hash and calibration hash
+	static std::map<std::pair<unsigned long long, unsigned long long>, USB_Wvf_Lines> Encoded;
+};
+
+#endif
@@ -0,0 +1,224 @@
+// Wvf_Pipeline.cpp : streaming upload of waveform and logic files through parse, encode and transmit stages
+#include "stdafx.h"
+using namespace std;
+
+#include <chrono> // for timing each stage
+#include <thread> // the parse and encode stages run beside the transmit stage
+#include "Wvf_Pipeline.h"
+#include "Step_Cache.h" // for the step kinds
+#include "Dac_Calibration.h" // for the calibration of the channel
+
+double USB_Wvf_Pipeline::parseMs = 0;
+double USB_Wvf_Pipeline::encodeMs = 0;
+double USB_Wvf_Pipeline::transmitMs = 0;
+std::atomic<bool> USB_Wvf_Pipeline::failed(false);
+
+// Milliseconds since a time point
+static double MsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool USB_Wvf_Pipeline::Upload(const std::vector<std::string> & files, unsigned channel, unsigned kind)
+{
+	if (files.empty()) {
+		return true;
+	}
+	unsigned devIndex, local_chan;
+	if (!USB_Waveform_Manager::Route(channel, devIndex, local_chan)) {
+		std::cout << "No device holds channel " << channel << std::endl;
+		return false;
+	}
+
+	failed = false;
+	parseMs = encodeMs = transmitMs = 0;
+	Bounded_Queue<USB_Parsed_Chunk> parsed(PIPELINE_QUEUE_DEPTH);
+	Bounded_Queue<USB_Encoded_Chunk> encoded(PIPELINE_QUEUE_DEPTH);
+	std::vector<USBWVF_bytes> steps;
+
+	// Parsing and encoding run on their own threads while this thread sends what they produce
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::thread parser(Parse, std::cref(files), kind, std::ref(parsed));
+	std::thread encoder(Encode, kind, USB_Dac_Calibration::Find(channel), std::ref(parsed), std::ref(encoded));
+	bool sent = Transmit(channel, encoded, steps);
+	// If sending stopped early, the other stages are waiting on full queues
+	encoded.Close();
+	parsed.Close();
+	encoder.join();
+	parser.join();
+	double totalMs = MsSince(start);
+
+	std::cout << "Streamed " << steps.size() << " steps in " << totalMs << " ms (parse " << parseMs
+		<< " ms, encode " << encodeMs << " ms, transmit " << transmitMs << " ms)" << std::endl;
+	if (!sent) {
+		return false;
+	}
+
+	// Keep the steps as if they had been loaded one by one and written with Write
+	USB_Waveform_Manager::WvfClear(int(channel), -1);
+	std::vector<USBWVF_data> uploaded;
+	for (unsigned i = 0; i < steps.size(); i++) {
+		USBWVF_data data(steps[i]);
+		data.intern();
+		USB_Waveform_Manager::USBWvf[channel][i] = data;
+		uploaded.push_back(data);
+	}
+	if (USB_Waveform_Manager::USBWaveDevList.size()) {
+		USB_Waveform_Manager::Uploaded[channel] = uploaded;
+	}
+	return true;
+}
+
+// Reads each file in turn, handing on PIPELINE_CHUNK_LINES lines at a time
+// Lines are read as in Waveform and Logicstep: a time of -1 is skipped, and logic lines are a duration then line symbols
+void USB_Wvf_Pipeline::Parse(const std::vector<std::string> & files, unsigned kind,
+	Bounded_Queue<USB_Parsed_Chunk> & parsed)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double waitMs = 0;
+	std::string line;
+
+	for (unsigned step = 0; step < files.size() && !failed; step++) {
+		ifstream wfstream(files[step]);
+		if (!wfstream.is_open()) {
+			std::cout << "Could not open " << files[step] << std::endl;
+			failed = true;
+			break;
+		}
+
+		USB_Parsed_Chunk chunk;
+		chunk.step = step;
+		chunk.stepEnd = false;
+		chunk.last = false;
+		bool reading = true;
+		while (reading && !failed) {
+			reading = bool(getline(wfstream, line));
+			if (reading) {
+				double t, val, dV;
+				int parsedLine = USB_Waveform_Manager::ParseLine(line, kind == STEP_KIND_LOGIC, t, val, dV);
+				if (parsedLine < 0) {
+					std::cout << "Error: unidentified logic signals found in " << files[step] << std::endl;
+					failed = true;
+					break;
+				}
+				if (parsedLine == 0) {
+					// blank line, or the marker to skip to the next step
+					continue;
+				}
+				chunk.vTime.push_back(t);
+				chunk.vVals.push_back(val);
+				if (kind != STEP_KIND_LOGIC) {
+					chunk.vdV.push_back(dV);
+				}
+				if (chunk.vTime.size() < PIPELINE_CHUNK_LINES) {
+					continue;
+				}
+			}
+			else {
+				// The rest of the file goes with the end of the step
+				chunk.stepEnd = true;
+				chunk.last = (step + 1 == files.size());
+			}
+			if (failed) {
+				break;
+			}
+
+			std::chrono::steady_clock::time_point wait = std::chrono::steady_clock::now();
+			if (!parsed.Push(std::move(chunk))) {
+				// a later stage stopped
+				failed = true;
+			}
+			waitMs += MsSince(wait);
+			chunk = USB_Parsed_Chunk();
+			chunk.step = step;
+			chunk.stepEnd = false;
+			chunk.last = false;
+		}
+	}
+	parsed.Close();
+	parseMs = MsSince(start) - waitMs;
+}
+
+// Encodes each chunk as it arrives; times and held lines carry over from one chunk of a step to the next
+void USB_Wvf_Pipeline::Encode(unsigned kind, const USB_Dac_Cal * cal,
+	Bounded_Queue<USB_Parsed_Chunk> & parsed, Bounded_Queue<USB_Encoded_Chunk> & encoded)
+{
+	USB_Wvf_Encode_State state(cal);
+	USB_Logic_Encode_State logicState;
+	USB_Parsed_Chunk in;
+
+	while (parsed.Pop(in)) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		USB_Encoded_Chunk out;
+		out.step = in.step;
+		out.stepEnd = in.stepEnd;
+		out.last = in.last;
+		size_t count = in.vTime.size();
+		if (kind == STEP_KIND_LOGIC) {
+			out.bytes.reserve(4 * count + 2);
+			if (count) {
+				USB_Waveform_Manager::LogicEncodeLines(out.bytes, &in.vTime[0], &in.vVals[0], count, logicState);
+			}
+			if (in.stepEnd) {
+				USB_Waveform_Manager::LogicEncodeEnd(out.bytes);
+				logicState = USB_Logic_Encode_State();
+			}
+		}
+		else {
+			out.bytes.reserve(8 * count + 4);
+			if (count) {
+				USB_Waveform_Manager::WvfEncodeLines(out.bytes, &in.vTime[0], &in.vVals[0], &in.vdV[0], count, state);
+			}
+			if (in.stepEnd) {
+				USB_Waveform_Manager::WvfEncodeEnd(out.bytes, state);
+				// times in the next file start from zero again
+				state = USB_Wvf_Encode_State(cal);
+			}
+		}
+		encodeMs += MsSince(start);
+
+		if (!encoded.Push(std::move(out))) {
+			// sending stopped, so stop reading too
+			failed = true;
+			parsed.Close();
+			break;
+		}
+	}
+	encoded.Close();
+}
+
+// Sends each encoded chunk as its own burst at the next free address, ending the last one with the end of memory op-code
+bool USB_Wvf_Pipeline::Transmit(unsigned channel,
+	Bounded_Queue<USB_Encoded_Chunk> & encoded, std::vector<USBWVF_bytes> & steps)
+{
+	unsigned address = 0; // word address of the next chunk
+	bool ended = false;
+	USB_Encoded_Chunk chunk;
+
+	while (encoded.Pop(chunk)) {
+		if (failed) {
+			// an earlier stage failed; the board is left without an end of memory op-code
+			break;
+		}
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (chunk.bytes.size() || chunk.last) {
+			if (!USB_Waveform_Manager::WriteRange(channel, address,
+				chunk.bytes.empty() ? NULL : &chunk.bytes[0], (DWORD) chunk.bytes.size(), chunk.last)) {
+				std::cout << "Failed to send step " << chunk.step << " at word " << address << std::endl;
+				failed = true;
+				encoded.Close();
+				break;
+			}
+			address += unsigned(chunk.bytes.size() / 2);
+		}
+		ended = chunk.last;
+		transmitMs += MsSince(start);
+
+		// Keep the bytes of each step for the waveform map
+		if (steps.size() <= chunk.step) {
+			steps.resize(chunk.step + 1);
+		}
+		steps[chunk.step].insert(steps[chunk.step].end(), chunk.bytes.begin(), chunk.bytes.end());
+	}
+	return ended && !failed;
+}
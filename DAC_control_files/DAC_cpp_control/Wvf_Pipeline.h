@@ -0,0 +1,63 @@
+/*
+Header file for the streaming upload of waveform and logic files
+Files are parsed, encoded and sent to the board in chunks by three stages joined by bounded queues,
+so the first bytes reach the board while the rest of the files are still being read
+*/
+
+#ifndef WVF_PIPELINE_H
+#define WVF_PIPELINE_H
+
+#include <vector> // needed for the file list and chunk data
+#include <string> // needed for file names
+#include <atomic> // for the failure flag shared by the stages
+#include "USB_Device.h" // for the USBWVF types and the waveform manager
+#include "Bounded_Queue.h" // joins the stages
+
+// Lines parsed into one chunk, and chunks each queue holds before the stage feeding it waits
+#define PIPELINE_CHUNK_LINES 512
+#define PIPELINE_QUEUE_DEPTH 8
+
+// Lines read from part of a file
+struct USB_Parsed_Chunk {
+	unsigned step; // step the lines belong to, the position of the file in the list
+	bool stepEnd; // the last chunk of the file
+	bool last; // the last chunk of the last file
+	std::vector<double> vTime; // end times, or durations for logic files
+	std::vector<double> vVals; // start voltages, or logic vectors for logic files
+	std::vector<double> vdV; // end voltages, unused for logic files
+};
+
+// Encoded bytes of the same part of a file
+struct USB_Encoded_Chunk {
+	unsigned step;
+	bool stepEnd;
+	bool last;
+	USBWVF_bytes bytes;
+};
+
+class USB_Wvf_Pipeline{
+public:
+	// Stream a list of files, one per step from step 0, into a channel and onto its board
+	// kind is STEP_KIND_DAC or STEP_KIND_LOGIC; the steps are also kept in USBWvf as if loaded one by one
+	static bool Upload(const std::vector<std::string> & files, unsigned channel, unsigned kind);
+
+	// Time each stage spent working, not waiting on a queue, in the last upload, in milliseconds
+	static double parseMs;
+	static double encodeMs;
+	static double transmitMs;
+
+private:
+	// The three stages; each runs until its input is used up or the pipeline fails
+	// A stage that fails closes its queues, which stops the stages on either side
+	static void Parse(const std::vector<std::string> & files, unsigned kind,
+		Bounded_Queue<USB_Parsed_Chunk> & parsed);
+	static void Encode(unsigned kind, const USB_Dac_Cal * cal,
+		Bounded_Queue<USB_Parsed_Chunk> & parsed, Bounded_Queue<USB_Encoded_Chunk> & encoded);
+	static bool Transmit(unsigned channel,
+		Bounded_Queue<USB_Encoded_Chunk> & encoded, std::vector<USBWVF_bytes> & steps);
+
+	// Set by any stage that fails
+	static std::atomic<bool> failed;
+};
+
+#endif
@@ -0,0 +1,302 @@
+// Wvf_Watch.cpp : hot-reload of waveform and logic files onto the boards
+#include "stdafx.h"
+using namespace std;
+
+#include <chrono> // for timing each update
+#include <thread> // for sleeping between polls
+#include <set> // for collecting the files changed in one burst of events
+#include <algorithm> // for finding the channels written
+#if defined(__linux__)
+#include <sys/inotify.h> // for change notifications
+#include <poll.h> // for waiting on notifications and the console together
+#include <unistd.h> // for read
+#elif defined(_WIN32)
+#include <conio.h> // for _kbhit
+#endif
+#include "Wvf_Watch.h"
+#include "Step_Cache.h" // for the step kinds, file times and the remembered file hashes
+#include "Dac_Calibration.h" // for the calibration of the channel a file is encoded for
+
+// Time allowed for an editor to finish saving before a changed file is read
+#define WATCH_SETTLE_MS 20
+// Time between checks of the files on platforms without change notifications
+#define WATCH_POLL_MS 100
+
+std::vector<USB_Watch_Binding> USB_Wvf_Watch::Pending;
+std::vector<USB_Watch_Binding> USB_Wvf_Watch::Bindings;
+USBWVF USB_Wvf_Watch::Board;
+
+void USB_Wvf_Watch::Bind(const std::string & file, unsigned device, unsigned channel, unsigned step, unsigned kind)
+{
+	USB_Watch_Binding b;
+	b.file = file;
+	// Split off the folder so notifications for the folder can be matched to the file
+	size_t slash = file.find_last_of("/\\");
+	if (slash == std::string::npos) {
+		b.dir = ".";
+		b.base = file;
+	}
+	else {
+		b.dir = file.substr(0, slash);
+		b.base = file.substr(slash + 1);
+	}
+	b.device = device;
+	b.channel = channel;
+	// logic steps always go to the logic channel of the device
+	b.wvfchan = (kind == STEP_KIND_LOGIC) ? USB_Waveform_Manager::LogicChannel(device) : USB_Waveform_Manager::GlobalChannel(device, channel);
+	b.step = step;
+	b.kind = kind;
+	b.size = 0;
+	b.mtime = 0;
+	USB_Step_Cache::StatFile(file, b.size, b.mtime);
+	Pending.push_back(b);
+}
+
+void USB_Wvf_Watch::Snapshot(unsigned wvfchan)
+{
+	Snapshot(std::vector<unsigned>(1, wvfchan));
+}
+
+void USB_Wvf_Watch::Snapshot(const std::vector<unsigned> & wvfchans)
+{
+	// The whole channels were rewritten, so files bound to them before are no longer on the board
+	for (std::vector<USB_Watch_Binding>::iterator it = Bindings.begin(); it != Bindings.end();) {
+		if (std::find(wvfchans.begin(), wvfchans.end(), it->wvfchan) != wvfchans.end()) {
+			it = Bindings.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	// Files loaded for channels that weren't written never reached a board, so only these channels' are kept
+	for (unsigned i = 0; i < Pending.size(); i++) {
+		if (std::find(wvfchans.begin(), wvfchans.end(), Pending[i].wvfchan) != wvfchans.end()) {
+			Bindings.push_back(Pending[i]);
+		}
+	}
+	Pending.clear();
+
+	for (unsigned i = 0; i < wvfchans.size(); i++) {
+		Board[wvfchans[i]] = USB_Waveform_Manager::USBWvf[wvfchans[i]];
+	}
+}
+
+// Parse a bound file into vectors of its own and encode it, through the step cache like a load from the menu;
+// a file that fails to parse leaves nothing behind for the next reload
+bool USB_Wvf_Watch::Encode(const USB_Watch_Binding & binding, USBWVF_data & fresh)
+{
+	USB_Step_Key key;
+	bool keyed = USB_Step_Cache::MakeKey(binding.file, binding.kind, binding.wvfchan, key);
+	if (keyed && USB_Step_Cache::Fetch(key, fresh)) {
+		return true;
+	}
+
+	ifstream fs(binding.file.c_str());
+	if (!fs.is_open()) {
+		return false;
+	}
+	bool logic = (binding.kind == STEP_KIND_LOGIC);
+	std::vector<double> vTime, vVals, vdV;
+	std::string line;
+	double t, val, dV;
+	while (getline(fs, line)) {
+		int parsed = USB_Waveform_Manager::ParseLine(line, logic, t, val, dV);
+		if (parsed < 0) {
+			std::cout << "Error: unidentified logic signals found in " << binding.file << std::endl;
+			return false;
+		}
+		if (parsed > 0) {
+			vTime.push_back(t);
+			vVals.push_back(val);
+			vdV.push_back(dV);
+		}
+	}
+
+	size_t count = vTime.size();
+	if (logic) {
+		USB_Waveform_Manager::LogicEncode(fresh, count ? &vTime[0] : NULL, count ? &vVals[0] : NULL, count);
+	}
+	else {
+		USB_Waveform_Manager::WvfEncode(fresh, count ? &vTime[0] : NULL, count ? &vVals[0] : NULL, count ? &vdV[0] : NULL,
+			count, USB_Dac_Calibration::Find(binding.wvfchan));
+	}
+	fresh.intern();
+	if (keyed) {
+		USB_Step_Cache::Store(key, fresh);
+	}
+	return true;
+}
+
+bool USB_Wvf_Watch::Reload(USB_Watch_Binding & binding)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// A file that was removed or renamed away leaves the board as it is
+	if (!USB_Step_Cache::StatFile(binding.file, binding.size, binding.mtime)) {
+		std::cout << binding.file << " is missing, the board is unchanged" << std::endl;
+		return false;
+	}
+	// The file was changed, whatever its size and time say, so its content is hashed again for the cache key
+	USB_Step_Cache::Forget(binding.file);
+
+	// Re-encode just this step, into a step of its own so the data loaded for the next write is left alone
+	USBWVF_data fresh;
+	if (!Encode(binding, fresh)) {
+		std::cout << "Could not reload " << binding.file << ", the board is unchanged" << std::endl;
+		return false;
+	}
+
+	// Steps are stored back to back, so the step starts after all the words of the earlier steps
+	USBWVF_channel & onboard = Board[binding.wvfchan];
+	unsigned address = 0;
+	for (USBWVF_channel::iterator its = onboard.begin(); its != onboard.end() && its->first < binding.step; ++its) {
+		address += unsigned((its->second).size() / 2);
+	}
+	USBWVF_data & old = onboard[binding.step];
+
+	if (fresh == old) {
+		std::cout << binding.file << " is unchanged on channel " << binding.wvfchan << std::endl;
+		return true;
+	}
+
+	bool sent;
+	DWORD sentBytes;
+	if (fresh.size() == old.size()) {
+		// Same length: only the words between the first and last difference are sent
+		size_t first = 0;
+		size_t last = fresh.size() - 1;
+		while (fresh[first] == old[first]) { first++; }
+		while (fresh[last] == old[last]) { last--; }
+		first = first & ~size_t(1);
+		last = last | size_t(1);
+		sentBytes = DWORD(last - first + 1);
+		sent = USB_Waveform_Manager::WriteRange(binding.wvfchan, address + unsigned(first / 2), &fresh[first], sentBytes, false);
+	}
+	else {
+		// New length: this step and every later step move, so they are sent again with a new end of memory
+		USBWVF_bytes tail(fresh.begin(), fresh.end());
+		USBWVF_channel::iterator its = onboard.find(binding.step);
+		for (++its; its != onboard.end(); ++its) {
+			tail.insert(tail.end(), (its->second).begin(), (its->second).end());
+		}
+		sentBytes = DWORD(tail.size());
+		sent = USB_Waveform_Manager::WriteRange(binding.wvfchan, address, tail.size() ? &tail[0] : NULL, sentBytes, true);
+	}
+	if (!sent) {
+		std::cout << "Failed to send " << binding.file << " to the board" << std::endl;
+		return false;
+	}
+	old = fresh;
+
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Updated " << binding.file << " on channel " << binding.wvfchan << " step " << binding.step
+		<< ": " << sentBytes << " bytes, " << ms << " ms to re-encode and send";
+#ifndef _WIN32
+	// From the file's time, so the wait for the notification and WATCH_SETTLE_MS count too; StatFile has only whole seconds on Windows
+	long long now = (long long) std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	std::cout << ", " << (now - binding.mtime) / 1e6 << " ms from save to board";
+#endif
+	std::cout << std::endl;
+	return true;
+}
+
+void USB_Wvf_Watch::Run()
+{
+	if (Bindings.empty()) {
+		std::cout << "No loaded files to watch; load and write a waveform or logic step first" << std::endl;
+		return;
+	}
+	std::cout << "Watching " << Bindings.size() << " files, press <Enter> to stop" << std::endl;
+	for (unsigned i = 0; i < Bindings.size(); i++) {
+		std::cout << "  " << Bindings[i].file << " -> channel " << Bindings[i].wvfchan << " step " << Bindings[i].step << std::endl;
+	}
+
+#if defined(__linux__)
+	// Folders are watched rather than files, since editors often save by replacing the file
+	int fd = inotify_init1(IN_NONBLOCK);
+	if (fd < 0) {
+		std::cout << "Could not start file notifications" << std::endl;
+		return;
+	}
+	std::map<int, std::string> dirs;
+	for (unsigned i = 0; i < Bindings.size(); i++) {
+		int wd = inotify_add_watch(fd, Bindings[i].dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd >= 0) {
+			dirs[wd] = Bindings[i].dir;
+		}
+	}
+	// Drop what is left of the line that chose this menu entry
+	std::cin.ignore(10000, '\n');
+
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool watching = true;
+	while (watching) {
+		struct pollfd fds[2];
+		fds[0].fd = fd; fds[0].events = POLLIN; fds[0].revents = 0;
+		fds[1].fd = 0; fds[1].events = POLLIN; fds[1].revents = 0;
+		if (poll(fds, 2, -1) < 0) {
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			std::string line;
+			std::getline(std::cin, line);
+			watching = false;
+			continue;
+		}
+		if (!(fds[0].revents & POLLIN)) {
+			continue;
+		}
+
+		// Collect the changed files, letting a burst of events from one save settle first
+		std::set<unsigned> changed;
+		bool first = true;
+		for (;;) {
+			ssize_t len = read(fd, events, sizeof(events));
+			if (len <= 0) {
+				if (first) { break; }
+				std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_SETTLE_MS));
+				len = read(fd, events, sizeof(events));
+				if (len <= 0) { break; }
+			}
+			first = false;
+			for (char * p = events; p < events + len;) {
+				struct inotify_event * ev = (struct inotify_event *) p;
+				if (ev->len > 0) {
+					std::string name(ev->name);
+					for (unsigned i = 0; i < Bindings.size(); i++) {
+						if (Bindings[i].base == name && Bindings[i].dir == dirs[ev->wd]) {
+							changed.insert(i);
+						}
+					}
+				}
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+		for (std::set<unsigned>::iterator itc = changed.begin(); itc != changed.end(); ++itc) {
+			Reload(Bindings[*itc]);
+		}
+	}
+	close(fd);
+#elif defined(_WIN32)
+	// Without notifications the files are checked for a new size or time
+	while (!_kbhit()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_POLL_MS));
+		for (unsigned i = 0; i < Bindings.size(); i++) {
+			unsigned long long size;
+			long long mtime;
+			if (USB_Step_Cache::StatFile(Bindings[i].file, size, mtime) && (size != Bindings[i].size || mtime != Bindings[i].mtime)) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_SETTLE_MS));
+				Bindings[i].size = size;
+				Bindings[i].mtime = mtime;
+				Reload(Bindings[i]);
+			}
+		}
+	}
+	// Drop the key that stopped the watch
+	_getch();
+#else
+	std::cout << "Watch mode is not supported on this platform" << std::endl;
+#endif
+	std::cout << "Stopped watching" << std::endl;
+}
@@ -0,0 +1,56 @@
+/*
+Header file for the hot-reload watch mode
+Files loaded into a channel are watched, and a changed file is re-encoded and pushed to its board on its own
+*/
+
+#ifndef WVF_WATCH_H
+#define WVF_WATCH_H
+
+#include <vector> // needed for the list of watched files
+#include <string> // needed for file names
+#include "USB_Device.h" // for the USBWVF types and the waveform manager
+
+// A file loaded into one step of a channel
+struct USB_Watch_Binding {
+	std::string file; // file name as given by the user
+	std::string dir; // folder holding the file, "." for the working folder
+	std::string base; // file name without the folder
+	unsigned device; // device and channel as chosen in the menu
+	unsigned channel;
+	unsigned wvfchan; // channel number in the waveform map
+	unsigned step;
+	unsigned kind; // STEP_KIND_DAC or STEP_KIND_LOGIC
+	unsigned long long size; // last seen size and time, for platforms that poll
+	long long mtime;
+};
+
+class USB_Wvf_Watch{
+public:
+	// Remember that a file was loaded into a step; it is watched once its channel is written
+	static void Bind(const std::string & file, unsigned device, unsigned channel, unsigned step, unsigned kind);
+
+	// Record the data just written to a channel as what is on the board, and watch the files it came from
+	static void Snapshot(unsigned wvfchan);
+	// The same for several channels written together; files loaded for any other channel are dropped
+	static void Snapshot(const std::vector<unsigned> & wvfchans);
+
+	// Watch the files until <Enter> is pressed, pushing each change to its board
+	static void Run();
+
+	// Re-encode one changed file and send only the words that changed; called by Run, and by the tests
+	static bool Reload(USB_Watch_Binding & binding);
+
+	// Files whose data is on a board
+	static std::vector<USB_Watch_Binding> Bindings;
+
+private:
+	// Encode a bound file into a step of its own, returns false if it can't be read or parsed
+	static bool Encode(const USB_Watch_Binding & binding, USBWVF_data & fresh);
+
+	// Files loaded since the last write
+	static std::vector<USB_Watch_Binding> Pending;
+	// The data last written to each channel, by channel and step
+	static USBWVF Board;
+};
+
+#endif
@@ -4,6 +4,14 @@
 // "Serial# #Chans Serial# #Chans ..."
 #define USB_DEVICE_LIST "DACBRD00 3 DACBRD01 3 DACBRD02 3 DACBRD03 3"
 
+// Topology file read at start-up in place of USB_DEVICE_LIST when it is present
+// One board per line: "Serial# #Chans [logic channel, or - for none]"
+#define TOPOLOGY_FILE "boards.cfg"
+
+// Calibration of the DAC channels read at start-up when it is present, see Dac_Calibration.h
+// One channel per line: "Serial# channel gain offset [nonlinearity corrections...]"
+#define CALIBRATION_FILE "calibration.txt"
+
 // Devices
 #define	DEV0	0
 #define DEV1	1
@@ -0,0 +1,84 @@
+/*
+Header file for the checks used by the tests
+Each test is a program that opens emulated boards on the loopback transport, checks what it expects,
+and returns non-zero if any check failed, for ctest
+*/
+
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <iostream> // for reporting failed checks
+#include <string> // needed for the board serials
+#include "USB_Device.h" // for the waveform manager
+#include "USB_Transport.h" // for the loopback boards
+
+// Failed checks so far in this test
+static unsigned testFailures = 0;
+
+// Report a check that doesn't hold, and carry on with the rest of the test
+#define TEST_CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+			testFailures++; \
+		} \
+	} while (0)
+
+// Open fresh emulated boards from a "serial# #ofDACs ..." list, returns the number opened
+inline unsigned TestOpenBoards(const std::string & deviceList)
+{
+	USB_Transport::Select(USB_TRANSPORT_LOOPBACK);
+	USB_Loopback_Transport::ClearBoards();
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	USB_Waveform_Manager::Uploaded.clear();
+	return USB_Waveform_Manager::OpenDevices(deviceList);
+}
+
+// Words of a channel of an emulated board, from a word address
+inline std::vector<unsigned short> TestBoardWords(const std::string & serial, unsigned channel, unsigned address, unsigned count)
+{
+	USB_Loopback_Transport::Board board;
+	std::vector<unsigned short> words;
+	if (USB_Loopback_Transport::Inspect(serial, board) && channel < USB_LOOPBACK_CHANNELS) {
+		for (unsigned i = 0; i < count && address + i < board.memory[channel].size(); i++) {
+			words.push_back(board.memory[channel][address + i]);
+		}
+	}
+	return words;
+}
+
+// Little endian words of encoded bytes, as they land in the FPGA's memory
+inline std::vector<unsigned short> TestWords(const USBWVF_bytes & bytes)
+{
+	std::vector<unsigned short> words;
+	for (size_t i = 0; i + 1 < bytes.size(); i += 2) {
+		words.push_back((unsigned short) (bytes[i] | (bytes[i + 1] << 8)));
+	}
+	return words;
+}
+
+// Words a channel's steps should leave in its memory once written: the steps back to back, then the end of memory op-code
+inline std::vector<unsigned short> TestChannelWords(unsigned wvfchan)
+{
+	std::vector<unsigned short> words;
+	USBWVF_channel & steps = USB_Waveform_Manager::USBWvf[wvfchan];
+	for (USBWVF_channel::iterator its = steps.begin(); its != steps.end(); ++its) {
+		std::vector<unsigned short> step = TestWords((its->second).bytes());
+		words.insert(words.end(), step.begin(), step.end());
+	}
+	words.push_back(0xFFFF);
+	return words;
+}
+
+// Result for ctest
+inline int TestResult(const char * name)
+{
+	if (testFailures) {
+		std::cout << name << ": " << testFailures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << name << ": passed" << std::endl;
+	return 0;
+}
+
+#endif
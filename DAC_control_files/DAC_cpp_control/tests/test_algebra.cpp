@@ -0,0 +1,51 @@
+// test_algebra.cpp : composed waveforms encode to the same lines as their segments encoded in place
+#include "stdafx.h"
+using namespace std;
+
+#include "Test_Check.h"
+#include "Wvf_Algebra.h"
+
+// Total updates of the DAC step at the start of a channel's memory, up to the op-code that ends it
+static long long DacTotal(unsigned channel)
+{
+	std::vector<unsigned short> words = TestBoardWords("TESTDEV0", channel, 0, USB_MEMORY_WORDS);
+	long long total = 0;
+	for (size_t i = 0; i + 3 < words.size() && words[i] < USB_BYTE_RANGE - 2; i += 4) {
+		total += words[i];
+	}
+	return total;
+}
+
+int main()
+{
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+
+	// Repeating a part that doesn't end on a whole update is encoded in place, so the repeats don't drift
+	USB_Wvf_Segments part(1);
+	part[0].duration = 1.0003;
+	part[0].vStart = 1.0;
+	part[0].vEnd = 2.0;
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	TEST_CHECK(USB_Wvf_Algebra::Load(USB_Wvf_Algebra::Repeat(USB_Wvf_Algebra::Segments(part), 1000), 1, 0));
+	TEST_CHECK(USB_Waveform_Manager::Write(1));
+	TEST_CHECK(DacTotal(1) == USB_Waveform_Manager::DacTicks(1000.3));
+
+	// Parts that do end on whole updates are joined, and come out the same as encoding in place
+	part[0].duration = 1.0;
+	USB_Wvf_Expr whole = USB_Wvf_Algebra::Concat(USB_Wvf_Algebra::Repeat(USB_Wvf_Algebra::Segments(part), 100),
+		USB_Wvf_Algebra::Segments(part));
+	std::shared_ptr<const USBWVF_bytes> joined = USB_Wvf_Algebra::Lines(whole, NULL);
+	std::shared_ptr<const USB_Wvf_Segments> segments = USB_Wvf_Algebra::Evaluate(whole);
+	USB_Wvf_Encode_State state;
+	USBWVF_bytes inPlace;
+	double t = 0;
+	for (size_t i = 0; i < segments->size(); i++) {
+		t += (*segments)[i].duration;
+		USB_Waveform_Manager::WvfEncodeLines(inPlace, &t, &(*segments)[i].vStart, &(*segments)[i].vEnd, 1, state);
+	}
+	USB_Waveform_Manager::WvfEncodeFlush(inPlace, state);
+	TEST_CHECK(joined && *joined == inPlace);
+
+
+	return TestResult("test_algebra");
+}
@@ -0,0 +1,85 @@
+// test_allocator.cpp : the channel's memory is shared between sampled waveforms within its budget
+#include "stdafx.h"
+using namespace std;
+
+#include "Test_Check.h"
+#include "Allocator.h"
+
+// Samples of a waveform over 100 ms, 1 sample every 0.05 ms
+static void Samples(USB_Alloc_Wave & wave, double (*shape)(double))
+{
+	for (unsigned i = 0; i <= 2000; i++) {
+		wave.vTime.push_back(i * 0.05);
+		wave.vVolt.push_back(shape(i * 0.05));
+	}
+	wave.entry = NULL;
+	wave.segments = 0;
+	USB_Allocator::ErrorCurve(wave.vTime, wave.vVolt, 1000, wave.curve);
+}
+
+static double Slow(double t) { return 5 + 2 * sin(t * 0.05); }
+static double Chirp(double t) { return 5 + 4 * sin(t * t * 0.002); }
+static double Steps(double t) { return (int(t / 7) % 2) ? 8 : 2; }
+
+// Words the picked segments take, and the worst and total of their errors
+static unsigned Used(const std::vector<USB_Alloc_Wave *> & waves, double & worst, double & total)
+{
+	unsigned used = 0;
+	worst = total = 0;
+	for (size_t w = 0; w < waves.size(); w++) {
+		const USB_Error_Curve & curve = waves[w]->curve;
+		TEST_CHECK(waves[w]->segments >= curve.kMin && waves[w]->segments <= curve.error.size());
+		used += USB_Allocator::StepWords(curve, waves[w]->segments);
+		worst = std::max(worst, curve.error[waves[w]->segments - 1]);
+		total += curve.error[waves[w]->segments - 1];
+	}
+	return used;
+}
+
+int main()
+{
+	USB_Alloc_Wave slow, chirp, steps;
+	Samples(slow, Slow);
+	Samples(chirp, Chirp);
+	Samples(steps, Steps);
+	std::vector<USB_Alloc_Wave *> waves;
+	waves.push_back(&slow);
+	waves.push_back(&chirp);
+	waves.push_back(&steps);
+
+	// The error curves never rise, and more segments never take fewer words
+	for (size_t w = 0; w < waves.size(); w++) {
+		const USB_Error_Curve & curve = waves[w]->curve;
+		TEST_CHECK(curve.kMin >= 1 && curve.kMin <= curve.error.size());
+		for (size_t k = curve.kMin; k < curve.error.size(); k++) {
+			TEST_CHECK(curve.error[k] <= curve.error[k - 1]);
+			TEST_CHECK(USB_Allocator::StepWords(curve, unsigned(k + 1)) >= USB_Allocator::StepWords(curve, unsigned(k)));
+		}
+	}
+
+	// Both ways stay within every budget, and the worst case way never has a larger worst error
+	unsigned budgets[4] = { 300, 700, 1500, 4000 };
+	for (unsigned b = 0; b < 4; b++) {
+		double totalWorst, totalSum, worstWorst, worstSum;
+		TEST_CHECK(USB_Allocator::AllocateTotal(waves, budgets[b]));
+		TEST_CHECK(Used(waves, totalWorst, totalSum) <= budgets[b]);
+		TEST_CHECK(USB_Allocator::AllocateWorst(waves, budgets[b]));
+		TEST_CHECK(Used(waves, worstWorst, worstSum) <= budgets[b]);
+		TEST_CHECK(worstWorst <= totalWorst);
+		if (b == 0) {
+			// with little memory the chirp is starved by the least total error, and the worst case way does better
+			TEST_CHECK(worstWorst < totalWorst);
+		}
+	}
+
+	// A budget too small for the fewest segments of every waveform fits neither way
+	unsigned fewest = 0;
+	for (size_t w = 0; w < waves.size(); w++) {
+		fewest += USB_Allocator::StepWords(waves[w]->curve, waves[w]->curve.kMin);
+	}
+	TEST_CHECK(!USB_Allocator::AllocateTotal(waves, fewest - 1));
+	TEST_CHECK(!USB_Allocator::AllocateWorst(waves, fewest - 1));
+	TEST_CHECK(USB_Allocator::AllocateTotal(waves, fewest));
+
+	return TestResult("test_allocator");
+}
@@ -0,0 +1,128 @@
+// test_calibration.cpp : the batch correction matches the plain loop, fitting recovers a channel, and bad tables are refused
+#include "stdafx.h"
+using namespace std;
+
+#include <stdio.h> // for removing the test files
+#include <string.h> // for memcmp
+#include "Test_Check.h"
+#include "Dac_Calibration.h"
+
+#define TEST_CALIBRATION "test_calibration.cal"
+#define TEST_MEASUREMENTS "test_calibration.txt"
+
+static void WriteFile(const char * file, const std::string & text)
+{
+	ofstream fs(file, ios::out | ios::trunc);
+	fs << text;
+}
+
+// The correction a voltage at a time, written out as the calibration file describes it
+static double Corrected(const USB_Dac_Cal * cal, double v)
+{
+	double c = cal ? v * cal->gain + cal->offset : v;
+	if (cal && cal->inl.size() >= 2) {
+		double last = double(cal->inl.size() - 1);
+		double x = (v - MIN_VOLTAGE) * (last / (MAX_VOLTAGE - MIN_VOLTAGE));
+		x = (x > 0) ? x : 0;
+		x = (x < last) ? x : last;
+		int k = int((x < last - 1) ? x : last - 1);
+		double f = x - double(k);
+		c = c + (cal->inl[k] + f * (cal->inl[k + 1] - cal->inl[k]));
+	}
+	c = (c > MIN_VOLTAGE) ? c : MIN_VOLTAGE;
+	return (c < MAX_VOLTAGE) ? c : MAX_VOLTAGE;
+}
+
+// Apply on an odd length block, out of range voltages and all, gives the plain loop's numbers to the last bit
+static void CheckApply(const USB_Dac_Cal * cal)
+{
+	std::vector<double> vIn, vOut(1001), vWant(1001);
+	for (unsigned i = 0; i < vOut.size(); i++) {
+		vIn.push_back(-1.0 + i * 0.012345);
+		vWant[i] = Corrected(cal, vIn[i]);
+	}
+	USB_Dac_Calibration::Apply(cal, &vIn[0], &vOut[0], vIn.size());
+	TEST_CHECK(memcmp(&vOut[0], &vWant[0], vOut.size() * sizeof(double)) == 0);
+}
+
+// A channel sending out a * c + b + e(c) volts for c asked of it
+static double Channel(double c)
+{
+	return 1.02 * c - 0.03 + 0.002 * sin(0.6 * c);
+}
+
+int main()
+{
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+
+	// A table with nonlinearity corrections, one with only gain and offset, and none
+	std::string table = "TESTDEV0 0 1.001 -0.004";
+	for (unsigned p = 0; p < CALIBRATION_INL_POINTS; p++) {
+		table += " " + std::to_string(0.001 * ((p * 7) % 5) - 0.002);
+	}
+	WriteFile(TEST_CALIBRATION, table + "\nTESTDEV0 1 0.998 0.003\n");
+	TEST_CHECK(USB_Dac_Calibration::Load(TEST_CALIBRATION));
+	const USB_Dac_Cal * withInl = USB_Dac_Calibration::Find("TESTDEV0", 0);
+	const USB_Dac_Cal * plain = USB_Dac_Calibration::Find("TESTDEV0", 1);
+	TEST_CHECK(withInl && withInl->inl.size() == CALIBRATION_INL_POINTS);
+	TEST_CHECK(plain && plain->inl.empty());
+	CheckApply(withInl);
+	CheckApply(plain);
+	CheckApply(NULL);
+
+	// Held lines on the calibrated channel start on the codes of the corrected voltages
+	std::vector<double> vT, vV;
+	for (unsigned i = 1; i <= 40; i++) {
+		vT.push_back(i * 1.0);
+		vV.push_back(i * 0.25 - 0.1);
+	}
+	USB_Waveform_Manager::WvfFill(0, 0, vT, vV, vV);
+	TEST_CHECK(USB_Waveform_Manager::Write(0));
+	std::vector<unsigned short> words = TestBoardWords("TESTDEV0", 0, 0, 4 * unsigned(vV.size()));
+	TEST_CHECK(words.size() == 4 * vV.size());
+	for (unsigned i = 0; i < vV.size() && 4 * i < words.size(); i++) {
+		TEST_CHECK(words[4 * i + 1] == unsigned(ceil(Corrected(withInl, vV[i]) * USB_BYTE_RANGE / USB_MAX_VOLTAGE)));
+	}
+
+	// Fitting readings of a channel with gain, offset and a smooth nonlinearity gets them back
+	std::stringstream readings;
+	readings.precision(12);
+	for (unsigned i = 0; i <= 400; i++) {
+		double asked = i * 0.025;
+		readings << "TESTDEV0 0 " << asked << " " << Channel(asked) << "\n";
+	}
+	WriteFile(TEST_MEASUREMENTS, readings.str());
+	TEST_CHECK(USB_Dac_Calibration::Fit(TEST_MEASUREMENTS, TEST_CALIBRATION));
+	const USB_Dac_Cal * fitted = USB_Dac_Calibration::Find("TESTDEV0", 0);
+	TEST_CHECK(fitted && fitted->inl.size() == CALIBRATION_INL_POINTS);
+	if (fitted) {
+		TEST_CHECK(fabs(fitted->gain - 1 / 1.02) < 1e-3);
+		// the nonlinearity corrections take up some of the offset, as much as the nonlinearity is
+		TEST_CHECK(fabs(fitted->offset - 0.03 / 1.02) < 0.002 * 1.5);
+		// Through the fitted table the channel gives what was asked for to within half a millivolt; what is left
+		// is the nonlinearity of the channel at the corrected voltage rather than at the one asked for
+		double worst = 0;
+		for (double v = 0.5; v <= 9.5; v += 0.01) {
+			worst = std::max(worst, fabs(Channel(Corrected(fitted, v)) - v));
+		}
+		TEST_CHECK(worst < 5e-4);
+
+		// What was fitted is what was written
+		USB_Dac_Cal saved = *fitted;
+		TEST_CHECK(USB_Dac_Calibration::Load(TEST_CALIBRATION));
+		fitted = USB_Dac_Calibration::Find("TESTDEV0", 0);
+		TEST_CHECK(fitted && fabs(fitted->gain - saved.gain) < 1e-9 && fitted->inl.size() == saved.inl.size());
+	}
+
+	// A gain at or below 0 is refused, and leaves the channel uncalibrated
+	WriteFile(TEST_CALIBRATION, "TESTDEV0 0 0 0.1\nTESTDEV0 1 -1.0 0\nTESTDEV0 2 1.0 0\n");
+	TEST_CHECK(USB_Dac_Calibration::Load(TEST_CALIBRATION));
+	TEST_CHECK(USB_Dac_Calibration::Find("TESTDEV0", 0) == NULL);
+	TEST_CHECK(USB_Dac_Calibration::Find("TESTDEV0", 1) == NULL);
+	TEST_CHECK(USB_Dac_Calibration::Find("TESTDEV0", 2) != NULL);
+
+	USB_Dac_Calibration::Tables.clear();
+	remove(TEST_CALIBRATION);
+	remove(TEST_MEASUREMENTS);
+	return TestResult("test_calibration");
+}
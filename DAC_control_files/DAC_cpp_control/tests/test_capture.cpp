@@ -0,0 +1,100 @@
+// test_capture.cpp : a captured upload replayed to a fresh board leaves the same memory, and dumps as the board read it
+#include "stdafx.h"
+using namespace std;
+
+#include <stdio.h> // for removing the test files
+#include <unistd.h> // for sending the dump to a file
+#include <fcntl.h> // for opening the dump file
+#include "Test_Check.h"
+#include "Wire_Capture.h"
+
+#define TEST_CAPTURE "test_capture.cap"
+#define TEST_DUMP "test_capture.txt"
+
+// Dump a capture to a file in place of the console, and read it back
+static std::string DumpText(const char * capture)
+{
+	fflush(stdout);
+	std::cout.flush();
+	int console = dup(1);
+	int fd = open(TEST_DUMP, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	dup2(fd, 1);
+	close(fd);
+	TEST_CHECK(USB_Wire_Capture::Dump(capture));
+	fflush(stdout);
+	std::cout.flush();
+	dup2(console, 1);
+	close(console);
+
+	ifstream fs(TEST_DUMP);
+	std::stringstream text;
+	text << fs.rdbuf();
+	return text.str();
+}
+
+// Times a string is found in a text
+static unsigned Count(const std::string & text, const std::string & what)
+{
+	unsigned n = 0;
+	for (size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + 1)) {
+		n++;
+	}
+	return n;
+}
+
+int main()
+{
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+	unsigned logchan = USB_Waveform_Manager::LogicChannel(0);
+
+	// A DAC step long enough to take several bursts, and a logic step
+	std::vector<double> vT, vV, vD, vL;
+	for (unsigned i = 1; i <= 3000; i++) {
+		vT.push_back(i * 0.01);
+		vV.push_back((i % 100) * 0.1);
+		vD.push_back(((i + 7) % 100) * 0.1);
+		vL.push_back(double(i % 16));
+	}
+	TEST_CHECK(USB_Waveform_Manager::WvfFill(0, 0, vT, vV, vD));
+	vT.resize(200);
+	vL.resize(200);
+	TEST_CHECK(USB_Waveform_Manager::LogicFill(logchan, 0, vT, vL));
+
+	// Uploads end each burst on the end of memory word, so a burst command straight after has no length
+	// and the run command that follows it is a command, not data
+	TEST_CHECK(USB_Wire_Capture::Start(TEST_CAPTURE));
+	TEST_CHECK(USB_Waveform_Manager::Write(0));
+	TEST_CHECK(USB_Waveform_Manager::Write(logchan));
+	BYTE lone[2] = { 0x02, 0x05 };
+	TEST_CHECK(USB_Waveform_Manager::USBWaveDevList[0].Write(lone, 2) == FT_OK);
+	USB_Wire_Capture::Stop();
+
+	USB_Loopback_Transport::Board captured;
+	TEST_CHECK(USB_Loopback_Transport::Inspect("TESTDEV0", captured));
+	unsigned devIndex, local_chan;
+	TEST_CHECK(USB_Waveform_Manager::Route(logchan, devIndex, local_chan));
+	TEST_CHECK(captured.runs[local_chan] == 1 && captured.dataLeft == 0 && captured.cmd == -1);
+	std::vector<unsigned short> want = TestChannelWords(0);
+	TEST_CHECK(TestBoardWords("TESTDEV0", 0, 0, unsigned(want.size())) == want);
+
+	// The capture sent again to a fresh board leaves it as the upload did
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+	TEST_CHECK(USB_Wire_Capture::Replay(TEST_CAPTURE, true));
+	USB_Loopback_Transport::Board replayed;
+	TEST_CHECK(USB_Loopback_Transport::Inspect("TESTDEV0", replayed));
+	for (unsigned c = 0; c < USB_LOOPBACK_CHANNELS; c++) {
+		TEST_CHECK(replayed.memory[c] == captured.memory[c]);
+		TEST_CHECK(replayed.runs[c] == captured.runs[c]);
+	}
+	TEST_CHECK(replayed.bytes == captured.bytes);
+
+	// The dump reads the stream as the board did: every burst's data, then the run as a command
+	std::string dump = DumpText(TEST_CAPTURE);
+	TEST_CHECK(Count(dump, " burst data") == Count(dump, " burst") - 1);
+	TEST_CHECK(Count(dump, " burst run") == 1);
+	TEST_CHECK(Count(dump, " skip") == 0);
+
+	remove(TEST_CAPTURE);
+	remove(TEST_DUMP);
+	return TestResult("test_capture");
+}
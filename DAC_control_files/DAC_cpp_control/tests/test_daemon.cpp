@@ -0,0 +1,163 @@
+// test_daemon.cpp : the daemon protocol, from a local client, against emulated boards
+#include "stdafx.h"
+using namespace std;
+
+#include <thread> // the daemon serves on its own thread
+#include <chrono> // for waiting on the socket
+#include <string.h> // for memcpy
+#include <stdio.h> // for removing the test files
+#include <sys/socket.h> // for the client socket
+#include <sys/un.h> // for local sockets
+#include <unistd.h> // for close
+#include "Test_Check.h"
+#include "Seq_Daemon.h"
+#include "Step_Cache.h" // for the step kinds
+
+#define TEST_SOCKET "test_daemon.sock"
+#define TEST_BAD_LOGIC "test_daemon_bad.dat"
+#define TEST_GOOD_LOGIC "test_daemon_good.dat"
+
+// Connect to the daemon, waiting for it to start listening
+static int Connect()
+{
+	for (unsigned tries = 0; tries < 200; tries++) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, TEST_SOCKET, sizeof(addr.sun_path) - 1);
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+			return fd;
+		}
+		close(fd);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return -1;
+}
+
+static void PutWord(std::vector<unsigned char> & out, unsigned value, unsigned bytes)
+{
+	for (unsigned j = 0; j < bytes; j++) {
+		out.push_back((unsigned char) (value >> (8 * j)));
+	}
+}
+
+// Add a request to a batch
+static void Request(std::vector<unsigned char> & out, unsigned char op, unsigned char kind, unsigned channel,
+	unsigned id, unsigned step, const std::vector<unsigned char> & payload)
+{
+	out.push_back(op);
+	out.push_back(kind);
+	PutWord(out, channel, 2);
+	PutWord(out, id, 4);
+	PutWord(out, step, 4);
+	PutWord(out, unsigned(payload.size()), 4);
+	out.insert(out.end(), payload.begin(), payload.end());
+}
+
+// Send a batch of requests, then read a reply for each: its id and status
+static bool Exchange(int fd, const std::vector<unsigned char> & batch, unsigned replies,
+	std::vector<unsigned> & ids, std::vector<unsigned> & statuses)
+{
+	if (send(fd, &batch[0], batch.size(), 0) != ssize_t(batch.size())) {
+		return false;
+	}
+	std::vector<unsigned char> in;
+	unsigned char chunk[4096];
+	while (in.size() < replies * DAEMON_REPLY_SIZE) {
+		ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+		if (got <= 0) {
+			return false;
+		}
+		in.insert(in.end(), chunk, chunk + got);
+	}
+	for (unsigned r = 0; r < replies; r++) {
+		const unsigned char * p = &in[r * DAEMON_REPLY_SIZE];
+		ids.push_back(p[0] | (p[1] << 8) | (p[2] << 16) | (unsigned(p[3]) << 24));
+		statuses.push_back(p[5]);
+	}
+	return true;
+}
+
+int main()
+{
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+	std::thread daemon(Seq_Daemon::Serve, std::string(TEST_SOCKET));
+
+	// Pipelined requests are answered in order: load points, write them, and a request the daemon doesn't know
+	double lines[6] = { 1.0, 0.0, 5.0, 2.0, 5.0, 5.0 };
+	std::vector<unsigned char> points(sizeof(lines));
+	memcpy(&points[0], lines, sizeof(lines));
+	std::vector<unsigned char> batch;
+	Request(batch, DAEMON_OP_PING, 0, 0, 11, 0, std::vector<unsigned char>());
+	Request(batch, DAEMON_OP_LOAD_POINTS, STEP_KIND_DAC, 0, 12, 0, points);
+	Request(batch, DAEMON_OP_WRITE, 0, 0, 13, 0, std::vector<unsigned char>());
+	Request(batch, 99, 0, 0, 14, 0, std::vector<unsigned char>());
+	int fd = Connect();
+	TEST_CHECK(fd >= 0);
+	std::vector<unsigned> ids, statuses;
+	TEST_CHECK(Exchange(fd, batch, 4, ids, statuses));
+	close(fd);
+	if (ids.size() == 4) {
+		TEST_CHECK(ids[0] == 11 && ids[1] == 12 && ids[2] == 13 && ids[3] == 14);
+		TEST_CHECK(statuses[0] == DAEMON_OK && statuses[1] == DAEMON_OK && statuses[2] == DAEMON_OK);
+		TEST_CHECK(statuses[3] == DAEMON_BAD_REQUEST);
+	}
+
+	// The board holds what the same points encode to here
+	double t[2] = { 1.0, 2.0 }, v0[2] = { 0.0, 5.0 }, v1[2] = { 5.0, 5.0 };
+	USBWVF_data expected;
+	USB_Waveform_Manager::WvfEncode(expected, t, v0, v1, 2, NULL);
+	std::vector<unsigned short> want = TestWords(expected.bytes());
+	TEST_CHECK(TestBoardWords("TESTDEV0", 0, 0, unsigned(want.size())) == want);
+
+	// A logic file that fails leaves nothing behind: the good file loaded after it is encoded on its own
+	{
+		ofstream bad(TEST_BAD_LOGIC, ios::out | ios::trunc);
+		bad << "1 d0\n1 zz\n";
+		ofstream good(TEST_GOOD_LOGIC, ios::out | ios::trunc);
+		good << "1 d1\n";
+	}
+	std::string badName(TEST_BAD_LOGIC), goodName(TEST_GOOD_LOGIC);
+	batch.clear();
+	Request(batch, DAEMON_OP_LOAD_FILE, STEP_KIND_LOGIC, 0, 15, 0, std::vector<unsigned char>(badName.begin(), badName.end()));
+	Request(batch, DAEMON_OP_LOAD_FILE, STEP_KIND_LOGIC, 0, 16, 1, std::vector<unsigned char>(goodName.begin(), goodName.end()));
+	fd = Connect();
+	TEST_CHECK(fd >= 0);
+	ids.clear();
+	statuses.clear();
+	TEST_CHECK(Exchange(fd, batch, 2, ids, statuses));
+	close(fd);
+	TEST_CHECK(statuses.size() == 2 && statuses[0] == DAEMON_FAILED && statuses[1] == DAEMON_OK);
+	double goodT[1] = { 1.0 }, goodV[1] = { double(USB_Waveform_Manager::LogicBit("d1")) };
+	USBWVF_data goodStep;
+	USB_Waveform_Manager::LogicEncode(goodStep, goodT, goodV, 1);
+	TEST_CHECK(USB_Waveform_Manager::USBWvf[USB_Waveform_Manager::LogicChannel(0)][1] == goodStep);
+	remove(TEST_BAD_LOGIC);
+	remove(TEST_GOOD_LOGIC);
+
+	// A client that sends a burst of requests and leaves without reading the replies must not stop the daemon
+	batch.clear();
+	for (unsigned i = 0; i < 20000; i++) {
+		Request(batch, DAEMON_OP_PING, 0, 0, i, 0, std::vector<unsigned char>());
+	}
+	fd = Connect();
+	TEST_CHECK(fd >= 0);
+	TEST_CHECK(send(fd, &batch[0], batch.size(), 0) == ssize_t(batch.size()));
+	close(fd);
+
+	// The daemon still answers, then stops when asked
+	batch.clear();
+	Request(batch, DAEMON_OP_PING, 0, 0, 21, 0, std::vector<unsigned char>());
+	Request(batch, DAEMON_OP_SHUTDOWN, 0, 0, 22, 0, std::vector<unsigned char>());
+	fd = Connect();
+	TEST_CHECK(fd >= 0);
+	ids.clear();
+	statuses.clear();
+	TEST_CHECK(Exchange(fd, batch, 2, ids, statuses));
+	close(fd);
+	TEST_CHECK(ids.size() == 2 && ids[0] == 21 && ids[1] == 22);
+	daemon.join();
+
+	return TestResult("test_daemon");
+}
@@ -0,0 +1,104 @@
+// test_encoder.cpp : encoded steps add up to the time asked for, read back from the emulated board
+#include "stdafx.h"
+using namespace std;
+
+#include "Test_Check.h"
+
+// A waveform line as it sits in memory
+struct TestLine {
+	long long ticks;
+	unsigned start;
+};
+
+// Lines of a DAC step from a word address, up to the op-code that ends it
+static std::vector<TestLine> BoardLines(unsigned channel, unsigned address)
+{
+	std::vector<TestLine> lines;
+	std::vector<unsigned short> words = TestBoardWords("TESTDEV0", channel, address, USB_MEMORY_WORDS - address);
+	for (size_t i = 0; i + 3 < words.size() && words[i] < USB_BYTE_RANGE - 2; i += 4) {
+		TestLine line = { words[i], words[i + 1] };
+		lines.push_back(line);
+	}
+	return lines;
+}
+
+// Total updates of a DAC step, checking every line is one the FPGA can run
+static long long DacTotal(unsigned channel)
+{
+	std::vector<TestLine> lines = BoardLines(channel, 0);
+	long long total = 0;
+	for (size_t i = 0; i < lines.size(); i++) {
+		TEST_CHECK(lines[i].ticks >= MIN_LINE_TICKS && lines[i].ticks <= MAX_LINE_TICKS);
+		total += lines[i].ticks;
+	}
+	return total;
+}
+
+// Total updates of a logic step
+static long long LogicTotal(unsigned channel)
+{
+	std::vector<unsigned short> words = TestBoardWords("TESTDEV0", channel, 0, USB_MEMORY_WORDS);
+	long long total = 0;
+	for (size_t i = 0; i + 1 < words.size() && words[i] != USB_BYTE_RANGE - 1; i += 2) {
+		long long ticks = (words[i] >> 8) | ((long long) words[i + 1] << 8);
+		TEST_CHECK(ticks >= MIN_LOGIC_TICKS && ticks <= MAX_LOGIC_TICKS);
+		total += ticks;
+	}
+	return total;
+}
+
+// Load lines into step 0 of a channel on its own and write it
+static void WriteLines(unsigned channel, const std::vector<double> & vT, const std::vector<double> & vV, const std::vector<double> & vD)
+{
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	USB_Waveform_Manager::WvfFill(channel, 0, vT, vV, vD);
+	TEST_CHECK(USB_Waveform_Manager::Write(channel));
+}
+
+int main()
+{
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+	std::vector<double> vT, vV, vD;
+
+	// A ramp longer than one line is split into lines that add up to it exactly
+	vT.assign(1, 200.0);
+	vV.assign(1, 1.0);
+	vD.assign(1, 9.0);
+	WriteLines(0, vT, vV, vD);
+	TEST_CHECK(DacTotal(0) == USB_Waveform_Manager::DacTicks(200.0));
+	TEST_CHECK(BoardLines(0, 0).size() == 7);
+
+	// Lines shorter than a DAC update are merged on a straight ramp, and rounding never builds up
+	vT.clear(); vV.clear(); vD.clear();
+	for (unsigned i = 1; i <= 1000; i++) {
+		vT.push_back(i * 0.0011);
+		vV.push_back((i - 1) * 0.001);
+		vD.push_back(i * 0.001);
+	}
+	WriteLines(0, vT, vV, vD);
+	TEST_CHECK(DacTotal(0) == USB_Waveform_Manager::DacTicks(vT.back()));
+
+	// A line taken up by the line lengthened before it is made up by the next line, which starts where the waveform is
+	double t3[3] = { 0.0005, 0.0010, 0.005 }, v3[3] = { 0, 5, 5 }, d3[3] = { 1, 5, 9 };
+	WriteLines(0, std::vector<double>(t3, t3 + 3), std::vector<double>(v3, v3 + 3), std::vector<double>(d3, d3 + 3));
+	std::vector<TestLine> lines = BoardLines(0, 0);
+	TEST_CHECK(lines.size() == 2);
+	if (lines.size() == 2) {
+		TEST_CHECK(lines[0].ticks == MIN_LINE_TICKS && lines[1].ticks == 10 - MIN_LINE_TICKS);
+		TEST_CHECK(lines[1].start == unsigned(ceil(6.0 * USB_BYTE_RANGE / USB_MAX_VOLTAGE)));
+	}
+
+	// Logic vectors end on the update nearest their added up durations, not each rounded on its own
+	std::vector<double> vL;
+	vT.assign(5000, 0.00034);
+	for (unsigned i = 0; i < vT.size(); i++) {
+		vL.push_back(i & 1);
+	}
+	unsigned logchan = USB_Waveform_Manager::LogicChannel(0);
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	USB_Waveform_Manager::LogicFill(logchan, 0, vT, vL);
+	TEST_CHECK(USB_Waveform_Manager::Write(logchan));
+	TEST_CHECK(LogicTotal(logchan) == USB_Waveform_Manager::LogicTicks(1.7));
+
+	return TestResult("test_encoder");
+}
@@ -0,0 +1,82 @@
+// test_experiment.cpp : steps compiled in parallel ranges come out as they do loaded one at a time
+#include "stdafx.h"
+using namespace std;
+
+#include <stdio.h> // for removing the test files
+#include <chrono> // for content no earlier run has cached
+#include "Test_Check.h"
+#include "Experiment.h"
+
+#define TEST_EXPERIMENT "test_experiment.txt"
+#define TEST_DAC_SERIAL "test_experiment_dac0.dat"
+#define TEST_DAC_PARALLEL "test_experiment_dac1.dat"
+#define TEST_LOGIC_SERIAL "test_experiment_logic0.dat"
+#define TEST_LOGIC_PARALLEL "test_experiment_logic1.dat"
+
+// Lines of a step, well over two ranges long
+#define TEST_LINES (2 * COMPILE_SPLIT_LINES + 3000)
+
+static void WriteFile(const char * file, const std::string & text)
+{
+	ofstream fs(file, ios::out | ios::trunc);
+	fs << text;
+}
+
+int main()
+{
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+	unsigned logchan = USB_Waveform_Manager::LogicChannel(0);
+
+	// Each file starts with a skipped line of its own, so neither load is served from the other's cache image
+	long long now = (long long) std::chrono::system_clock::now().time_since_epoch().count();
+
+	// Waveform lines of every kind the encoder treats differently: too short, merged, held over the next, and split,
+	// with a run of short lines over each range boundary so the boundary has to move past them
+	double durations[6] = { 0.0013, 0.001, 0.02, 40.0, 0.0031, 0.5 };
+	std::stringstream dac;
+	dac.precision(12);
+	double t = 0;
+	for (unsigned i = 0; i < TEST_LINES; i++) {
+		bool boundary = (i % COMPILE_SPLIT_LINES) > COMPILE_SPLIT_LINES - 40 || (i % COMPILE_SPLIT_LINES) < 40;
+		t += boundary ? 0.0011 : durations[i % 6];
+		dac << t << " " << ((i * 37) % 100) * 0.1 << " " << ((i * 53) % 100) * 0.1 << "\n";
+	}
+	WriteFile(TEST_DAC_SERIAL, "-1 " + std::to_string(now) + "\n" + dac.str());
+	WriteFile(TEST_DAC_PARALLEL, "-1 " + std::to_string(now + 1) + "\n" + dac.str());
+
+	// Logic vectors too short, rounded, and too long for one entry
+	const char * symbols[5] = { "d0", "l1", "d1 l2", "i", "l3 l1" };
+	double ldurations[5] = { 0.00015, 0.0003, 0.00034, 2000.0, 0.0001 };
+	std::stringstream logic;
+	logic.precision(12);
+	for (unsigned i = 0; i < TEST_LINES; i++) {
+		logic << ldurations[i % 5] << " " << symbols[(i / 5) % 5] << "\n";
+	}
+	WriteFile(TEST_LOGIC_SERIAL, "-1 " + std::to_string(now) + "\n" + logic.str());
+	WriteFile(TEST_LOGIC_PARALLEL, "-1 " + std::to_string(now + 1) + "\n" + logic.str());
+
+	// One at a time, as the menu loads them
+	TEST_CHECK(Waveform(TEST_DAC_SERIAL, 0, 0, 0));
+	TEST_CHECK(Logicstep(TEST_LOGIC_SERIAL, 0, 0));
+	USBWVF_data dacSerial = USB_Waveform_Manager::USBWvf[0][0];
+	USBWVF_data logicSerial = USB_Waveform_Manager::USBWvf[logchan][0];
+	TEST_CHECK(dacSerial.size() > 8 * TEST_LINES / 2);
+	TEST_CHECK(logicSerial.size() > 4 * TEST_LINES);
+
+	// All together on the pool, each step encoded in ranges
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	WriteFile(TEST_EXPERIMENT, std::string("0 0 0 ") + TEST_DAC_PARALLEL + "\n0 2 0 " + TEST_LOGIC_PARALLEL + "\n");
+	std::vector<USB_Experiment_Entry> entries;
+	TEST_CHECK(USB_Experiment::Load(TEST_EXPERIMENT, entries));
+	TEST_CHECK(entries.size() == 2 && entries[1].wvfchan == logchan);
+	TEST_CHECK(USB_Experiment::Compile(entries, 4));
+	TEST_CHECK(USB_Waveform_Manager::USBWvf[0][0] == dacSerial);
+	TEST_CHECK(USB_Waveform_Manager::USBWvf[logchan][0] == logicSerial);
+
+	remove(TEST_EXPERIMENT);
+	remove(TEST_DAC_SERIAL);
+	remove(TEST_DAC_PARALLEL);
+	remove(TEST_LOGIC_SERIAL);
+	remove(TEST_LOGIC_PARALLEL);
+	return TestResult("test_experiment");
+}
@@ -0,0 +1,49 @@
+// test_send_burst.cpp : uploads resume after failed writes and still leave the right words on the board
+#include "stdafx.h"
+using namespace std;
+
+#include "Test_Check.h"
+
+// Fill two steps of a channel with sawtooth ramps, the first long enough to take several bursts
+static void FillSteps(unsigned wvfchan)
+{
+	std::vector<double> vT, vV, vD;
+	for (unsigned i = 1; i <= 3000; i++) {
+		vT.push_back(i * 0.01);
+		vV.push_back((i % 100) * 0.1);
+		vD.push_back(((i + 1) % 100) * 0.1);
+	}
+	USB_Waveform_Manager::WvfFill(wvfchan, 0, vT, vV, vD);
+	vT.resize(100);
+	vV.resize(100);
+	vD.resize(100);
+	USB_Waveform_Manager::WvfFill(wvfchan, 1, vT, vV, vD);
+}
+
+// Write the channel with every nth write failing after some bytes, and check the board holds the steps
+static void Upload(unsigned every, DWORD after)
+{
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+	FillSteps(0);
+	std::vector<unsigned short> want = TestChannelWords(0);
+
+	unsigned long retries = USB_Waveform_Manager::retries;
+	USB_Loopback_Transport::FailEvery(every, after);
+	TEST_CHECK(USB_Waveform_Manager::Write(0));
+	USB_Loopback_Transport::FailEvery(0, 0);
+	if (every) {
+		TEST_CHECK(USB_Waveform_Manager::retries > retries);
+	}
+	TEST_CHECK(TestBoardWords("TESTDEV0", 0, 0, unsigned(want.size())) == want);
+}
+
+int main()
+{
+	// No failures, then failures part way through a burst, on an odd byte, and in the commands before a burst
+	Upload(0, 0);
+	Upload(4, 1001);
+	Upload(3, 2048);
+	Upload(5, 3);
+
+	return TestResult("test_send_burst");
+}
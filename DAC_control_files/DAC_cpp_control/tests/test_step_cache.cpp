@@ -0,0 +1,109 @@
+// test_step_cache.cpp : encoded steps come back from the cache only for the same content and calibration
+#include "stdafx.h"
+using namespace std;
+
+#include <stdio.h> // for removing the test files
+#include <chrono> // for a line no earlier run has cached
+#include <dirent.h> // for finding the image of a step in the cache folder
+#include <unistd.h> // for truncate
+#include "Test_Check.h"
+#include "Step_Cache.h"
+#include "Dac_Calibration.h"
+
+#define TEST_WAVEFORM "test_step_cache.dat"
+#define TEST_CALIBRATION "test_step_cache.cal"
+
+static void WriteFile(const char * file, const std::string & text)
+{
+	ofstream fs(file, ios::out | ios::trunc);
+	fs << text;
+}
+
+// Name of the image on disk for a key, found by the content hash it starts with
+static std::string ImagePath(const USB_Step_Key & key)
+{
+	char prefix[32];
+	sprintf(prefix, "%016llx_", key.hash);
+	std::string found;
+	DIR * dir = opendir(STEP_CACHE_DIR);
+	if (dir) {
+		while (struct dirent * entry = readdir(dir)) {
+			std::string name(entry->d_name);
+			if (name.compare(0, 17, prefix) == 0 && name.find(".tmp") == std::string::npos) {
+				found = std::string(STEP_CACHE_DIR) + "/" + name;
+			}
+		}
+		closedir(dir);
+	}
+	return found;
+}
+
+// Look a file up in the cache as the menu would for channel 0
+static bool Cached(USBWVF_data & data)
+{
+	USB_Step_Key key;
+	TEST_CHECK(USB_Step_Cache::MakeKey(TEST_WAVEFORM, STEP_KIND_DAC, 0, key));
+	return USB_Step_Cache::Fetch(key, data);
+}
+
+int main()
+{
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+	USB_Dac_Calibration::Tables.clear();
+	USB_Step_Cache::Clear();
+
+	// A skipped line holding the time makes content no earlier run has left in the cache folder
+	long long now = (long long) std::chrono::system_clock::now().time_since_epoch().count();
+	std::string skipped = "-1 " + std::to_string(now) + "\n";
+	WriteFile(TEST_WAVEFORM, skipped + "1 0 5\n2 5 5\n");
+	USBWVF_data data;
+	TEST_CHECK(!Cached(data));
+
+	// A load encodes the file and stores it; the next lookup is a hit, from memory and then from disk
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	TEST_CHECK(Waveform(TEST_WAVEFORM, 0, 0, 0));
+	USBWVF_data encoded = USB_Waveform_Manager::USBWvf[0][0];
+	double t[2] = { 1, 2 }, v0[2] = { 0, 5 }, v1[2] = { 5, 5 };
+	USBWVF_data expected;
+	USB_Waveform_Manager::WvfEncode(expected, t, v0, v1, 2, NULL);
+	TEST_CHECK(encoded == expected);
+	TEST_CHECK(Cached(data) && data == expected);
+	USB_Step_Cache::Clear();
+	unsigned long hits = USB_Step_Cache::hits;
+	TEST_CHECK(Cached(data) && data == expected);
+	TEST_CHECK(USB_Step_Cache::hits == hits + 1);
+
+	// An image cut short on disk, as by a crash while it was written, is a miss and not a short step
+	USB_Step_Key key;
+	TEST_CHECK(USB_Step_Cache::MakeKey(TEST_WAVEFORM, STEP_KIND_DAC, 0, key));
+	std::string image = ImagePath(key);
+	TEST_CHECK(image != "" && truncate(image.c_str(), 16 + expected.size() - 2) == 0);
+	USB_Step_Cache::Clear();
+	TEST_CHECK(!Cached(data));
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	TEST_CHECK(Waveform(TEST_WAVEFORM, 0, 0, 0));
+	USB_Step_Cache::Clear();
+	TEST_CHECK(Cached(data) && data == expected);
+
+	// The same size saved again straight away with other values is a miss
+	WriteFile(TEST_WAVEFORM, skipped + "1 0 4\n2 4 4\n");
+	TEST_CHECK(!Cached(data));
+	WriteFile(TEST_WAVEFORM, skipped + "1 0 5\n2 5 5\n");
+	TEST_CHECK(Cached(data) && data == expected);
+
+	// A new calibration for the channel is a miss too, and the step is encoded with it
+	WriteFile(TEST_CALIBRATION, "TESTDEV0 0 1.001 0.002\n");
+	TEST_CHECK(USB_Dac_Calibration::Load(TEST_CALIBRATION));
+	TEST_CHECK(USB_Dac_Calibration::Hash(0) != 0);
+	TEST_CHECK(!Cached(data));
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	TEST_CHECK(Waveform(TEST_WAVEFORM, 0, 0, 0));
+	TEST_CHECK(!(USB_Waveform_Manager::USBWvf[0][0] == expected));
+	TEST_CHECK(Cached(data) && data == USB_Waveform_Manager::USBWvf[0][0]);
+	USB_Dac_Calibration::Tables.clear();
+	TEST_CHECK(Cached(data) && data == expected);
+
+	remove(TEST_WAVEFORM);
+	remove(TEST_CALIBRATION);
+	return TestResult("test_step_cache");
+}
@@ -0,0 +1,79 @@
+// test_timeline.cpp : a timeline compiles into DAC steps and the logic step that triggers them
+#include "stdafx.h"
+using namespace std;
+
+#include <stdio.h> // for removing the test file
+#include "Test_Check.h"
+#include "Timeline.h"
+
+#define TEST_TIMELINE "test_timeline.txt"
+
+// Load and compile a timeline written out here
+static bool CompileText(const std::string & text, std::vector<unsigned> & channels)
+{
+	{
+		ofstream fs(TEST_TIMELINE, ios::out | ios::trunc);
+		fs << text;
+	}
+	std::map<unsigned, USB_Timeline_Board> boards;
+	bool compiled = USB_Timeline::Load(TEST_TIMELINE, boards) && USB_Timeline::Compile(boards, channels);
+	remove(TEST_TIMELINE);
+	return compiled;
+}
+
+int main()
+{
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+	unsigned logchan = USB_Waveform_Manager::LogicChannel(0);
+	int d0 = USB_Waveform_Manager::LogicBit("d0");
+	int d1 = USB_Waveform_Manager::LogicBit("d1");
+	int l1 = USB_Waveform_Manager::LogicBit("l1");
+
+	// Two DAC channels, the first with a gap that starts a second step, and one pulse on a logic line
+	std::vector<unsigned> channels;
+	TEST_CHECK(CompileText(
+		"# two steps on DAC0, one on DAC1\n"
+		"dac 0 0 ramp 0 10 0 5\n"
+		"dac 0 0 hold 20 30 5\n"
+		"dac 0 1 hold 5 15 2\n"
+		"logic 0 l1 2 8\n", channels));
+	TEST_CHECK(channels.size() == 3);
+	TEST_CHECK(USB_Waveform_Manager::USBWvf[0].size() == 2);
+	TEST_CHECK(USB_Waveform_Manager::USBWvf[1].size() == 1);
+
+	// Each step is its segments with times from the start of the step
+	double t0[1] = { 10 }, a0[1] = { 0 }, b0[1] = { 5 };
+	double t1[1] = { 10 }, a1[1] = { 5 }, b1[1] = { 5 };
+	USBWVF_data first, second;
+	USB_Waveform_Manager::WvfEncode(first, t0, a0, b0, 1, NULL);
+	USB_Waveform_Manager::WvfEncode(second, t1, a1, b1, 1, NULL);
+	TEST_CHECK(USB_Waveform_Manager::USBWvf[0][0] == first);
+	TEST_CHECK(USB_Waveform_Manager::USBWvf[0][1] == second);
+
+	// d0 and d1 pulse for TIMELINE_TRIGGER_TIME as each step starts, around the l1 pulse, ending on the state after the last change
+	double durations[8] = { 0.001, 1.999, 3, 0.001, 2.999, 12, 0.001, MIN_LOGIC_TICKS * LOG_UPDATE };
+	double vectors[8] = { double(d0), 0, double(l1), double(l1 | d1), double(l1), 0, double(d0), 0 };
+	USBWVF_data logic;
+	USB_Waveform_Manager::LogicEncode(logic, durations, vectors, 8);
+	TEST_CHECK(USB_Waveform_Manager::USBWvf[logchan][0] == logic);
+
+	// The whole run lasts as long as the timeline, to the update
+	long long ticks = 0;
+	USB_Logic_Encode_State state;
+	for (unsigned i = 0; i < 8; i++) {
+		ticks += USB_Waveform_Manager::LogicVectorTicks(durations[i], state);
+	}
+	TEST_CHECK(ticks == USB_Waveform_Manager::LogicTicks(20.001) + MIN_LOGIC_TICKS);
+
+	// A step shorter than its trigger, a gap shorter than the trigger, overlapping segments,
+	// and logic changes closer than a logic entry can be, are all refused
+	TEST_CHECK(!CompileText("dac 0 0 hold 0 0.0008 1\n", channels));
+	TEST_CHECK(!CompileText("dac 0 0 hold 0 10 1\ndac 0 0 hold 10.0007 20 1\n", channels));
+	TEST_CHECK(!CompileText("dac 0 0 hold 0 10 1\ndac 0 0 hold 5 12 2\n", channels));
+	TEST_CHECK(!CompileText("dac 0 0 hold 0 10 1\nlogic 0 l1 2 2.0001\n", channels));
+	// and segments that only just touch are one step
+	TEST_CHECK(CompileText("dac 0 0 hold 0 10 1\ndac 0 0 hold 10.0004 20 1\n", channels));
+	TEST_CHECK(USB_Waveform_Manager::USBWvf[0].size() == 1);
+
+	return TestResult("test_timeline");
+}
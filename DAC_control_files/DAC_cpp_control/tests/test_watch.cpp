@@ -0,0 +1,87 @@
+// test_watch.cpp : watch mode pushes a changed file to the board, whatever its size and time say
+#include "stdafx.h"
+using namespace std;
+
+#include <stdio.h> // for removing the test files
+#include "Test_Check.h"
+#include "Wvf_Watch.h"
+#include "Step_Cache.h" // for the step kinds
+
+#define TEST_FIRST "test_watch_0.dat"
+#define TEST_SECOND "test_watch_1.dat"
+#define TEST_LOGIC "test_watch_logic.dat"
+
+static void WriteFile(const char * file, const char * text)
+{
+	ofstream fs(file, ios::out | ios::trunc);
+	fs << text;
+}
+
+int main()
+{
+	TEST_CHECK(TestOpenBoards("TESTDEV0 3") == 1);
+	unsigned wvfchan = USB_Waveform_Manager::GlobalChannel(0, 0);
+
+	// Two steps loaded from files and written, as the menu does
+	WriteFile(TEST_FIRST, "1 0 5\n2 5 5\n");
+	WriteFile(TEST_SECOND, "1 2 3\n");
+	TEST_CHECK(Waveform(TEST_FIRST, 0, 0, 0));
+	TEST_CHECK(Waveform(TEST_SECOND, 0, 0, 1));
+	USB_Wvf_Watch::Bind(TEST_FIRST, 0, 0, 0, STEP_KIND_DAC);
+	USB_Wvf_Watch::Bind(TEST_SECOND, 0, 0, 1, STEP_KIND_DAC);
+	TEST_CHECK(USB_Waveform_Manager::Write(wvfchan));
+	USB_Wvf_Watch::Snapshot(wvfchan);
+	TEST_CHECK(USB_Wvf_Watch::Bindings.size() == 2);
+	USBWVF_data second = USB_Waveform_Manager::USBWvf[wvfchan][1];
+
+	// The first file saved again at once with the same size: only its changed words are sent, and the board matches
+	WriteFile(TEST_FIRST, "1 0 4\n2 4 4\n");
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	TEST_CHECK(USB_Wvf_Watch::Reload(USB_Wvf_Watch::Bindings[0]));
+	TEST_CHECK(Waveform(TEST_FIRST, 0, 0, 0));
+	USB_Waveform_Manager::USBWvf[wvfchan][1] = second;
+	std::vector<unsigned short> want = TestChannelWords(wvfchan);
+	TEST_CHECK(TestBoardWords("TESTDEV0", 0, 0, unsigned(want.size())) == want);
+
+	// A new length moves the step after it, which is sent again behind it
+	WriteFile(TEST_FIRST, "1 0 4\n2 4 4\n3 4 1\n");
+	USB_Waveform_Manager::WvfClear(-1, -1);
+	TEST_CHECK(USB_Wvf_Watch::Reload(USB_Wvf_Watch::Bindings[0]));
+	TEST_CHECK(Waveform(TEST_FIRST, 0, 0, 0));
+	USB_Waveform_Manager::USBWvf[wvfchan][1] = second;
+	want = TestChannelWords(wvfchan);
+	TEST_CHECK(TestBoardWords("TESTDEV0", 0, 0, unsigned(want.size())) == want);
+
+	// A file that is gone leaves the board as it is
+	remove(TEST_FIRST);
+	TEST_CHECK(!USB_Wvf_Watch::Reload(USB_Wvf_Watch::Bindings[0]));
+	TEST_CHECK(TestBoardWords("TESTDEV0", 0, 0, unsigned(want.size())) == want);
+
+	// A logic file saved with a typo leaves the board as it is, and the next good save is encoded on its own
+	unsigned logchan = USB_Waveform_Manager::LogicChannel(0);
+	WriteFile(TEST_LOGIC, "1 d0\n");
+	TEST_CHECK(Logicstep(TEST_LOGIC, 0, 0));
+	USB_Wvf_Watch::Bind(TEST_LOGIC, 0, 0, 0, STEP_KIND_LOGIC);
+	TEST_CHECK(USB_Waveform_Manager::Write(logchan));
+	USB_Wvf_Watch::Snapshot(logchan);
+	TEST_CHECK(USB_Wvf_Watch::Bindings.size() == 3);
+	USB_Watch_Binding & logic = USB_Wvf_Watch::Bindings.back();
+	want = TestChannelWords(logchan);
+
+	WriteFile(TEST_LOGIC, "1 d1\n2 zz\n");
+	TEST_CHECK(!USB_Wvf_Watch::Reload(logic));
+	TEST_CHECK(TestBoardWords("TESTDEV0", logchan, 0, unsigned(want.size())) == want);
+
+	WriteFile(TEST_LOGIC, "3 d1\n");
+	TEST_CHECK(USB_Wvf_Watch::Reload(logic));
+	double goodT[1] = { 3 }, goodV[1] = { double(USB_Waveform_Manager::LogicBit("d1")) };
+	USBWVF_data good;
+	USB_Waveform_Manager::LogicEncode(good, goodT, goodV, 1);
+	want = TestWords(good.bytes());
+	want.push_back(0xFFFF);
+	TEST_CHECK(TestBoardWords("TESTDEV0", logchan, 0, unsigned(want.size())) == want);
+
+	remove(TEST_SECOND);
+	remove(TEST_LOGIC);
+	return TestResult("test_watch");
+}
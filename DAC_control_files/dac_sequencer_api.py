@@ -0,0 +1,199 @@
+## ctypes wrapper for the DAC_sequencer_api library: DAC_sequencer_api.dll, or libDAC_sequencer_api.so from the CMake build
+## Waveforms and logic steps are passed as numpy arrays, with no text files in between
+import ctypes
+import sys
+import numpy as np
+
+def _default_library():
+    ## name the library is built under on this platform
+    if sys.platform.startswith('win'):
+        return 'DAC_sequencer_api.dll'
+    if sys.platform == 'darwin':
+        return 'libDAC_sequencer_api.dylib'
+    return 'libDAC_sequencer_api.so'
+
+class Timing(ctypes.Structure):
+    _fields_ = [('encode_ms', ctypes.c_double),
+                ('upload_ms', ctypes.c_double),
+                ('bytes', ctypes.c_ulong)]
+
+_dbl_p = ctypes.POINTER(ctypes.c_double)
+
+class Sequencer(object):
+    """
+    Opens the DAC boards through the sequencer library
+    Arrays are handed over by pointer; float64 C-ordered arrays are not copied
+    """
+
+    def __init__(self, library=None, device_list=None, transport=None, calibration=None):
+        ## transport is 'd2xx', 'ftdi' or 'loopback'; the library picks one when it is None
+        ## calibration is a calibration file read in place of calibration.txt; voltages are corrected by the library
+        ## library is a path to the library, or its usual name on this platform when None
+        self.lib = ctypes.CDLL(library if library is not None else _default_library())
+        self.lib.dacseq_set_transport.argtypes = [ctypes.c_char_p]
+        self.lib.dacseq_load_calibration.argtypes = [ctypes.c_char_p]
+        self.lib.dacseq_open.argtypes = [ctypes.c_char_p]
+        self.lib.dacseq_load_waveform.argtypes = [ctypes.c_uint, ctypes.c_uint,
+            _dbl_p, _dbl_p, _dbl_p, ctypes.c_size_t, ctypes.POINTER(Timing)]
+        self.lib.dacseq_load_logic.argtypes = [ctypes.c_uint, ctypes.c_uint,
+            _dbl_p, _dbl_p, ctypes.c_size_t, ctypes.POINTER(Timing)]
+        self.lib.dacseq_copy_step.argtypes = [ctypes.c_uint, ctypes.c_uint, ctypes.c_uint, ctypes.c_uint]
+        self.lib.dacseq_write.argtypes = [ctypes.c_uint, ctypes.POINTER(Timing)]
+        self.lib.dacseq_run.argtypes = [ctypes.c_uint]
+        self.lib.dacseq_clear.argtypes = [ctypes.c_int, ctypes.c_int]
+        self.lib.dacseq_step_size.argtypes = [ctypes.c_uint, ctypes.c_uint]
+        self.lib.dacseq_step_size.restype = ctypes.c_size_t
+        self.lib.dacseq_global_channel.argtypes = [ctypes.c_uint, ctypes.c_uint]
+        self.lib.dacseq_global_channel.restype = ctypes.c_uint
+        self.lib.dacseq_logic_channel.argtypes = [ctypes.c_uint]
+        self.lib.dacseq_logic_channel.restype = ctypes.c_uint
+        self.lib.dacseq_wvf_segments.argtypes = [_dbl_p, _dbl_p, _dbl_p, ctypes.c_size_t]
+        self.lib.dacseq_wvf_segments.restype = ctypes.c_uint
+        self.lib.dacseq_wvf_file.argtypes = [ctypes.c_char_p]
+        self.lib.dacseq_wvf_file.restype = ctypes.c_uint
+        self.lib.dacseq_wvf_concat.argtypes = [ctypes.POINTER(ctypes.c_uint), ctypes.c_size_t]
+        self.lib.dacseq_wvf_concat.restype = ctypes.c_uint
+        for name in ('offset', 'scale', 'stretch'):
+            getattr(self.lib, 'dacseq_wvf_' + name).argtypes = [ctypes.c_uint, ctypes.c_double]
+            getattr(self.lib, 'dacseq_wvf_' + name).restype = ctypes.c_uint
+        self.lib.dacseq_wvf_repeat.argtypes = [ctypes.c_uint, ctypes.c_uint]
+        self.lib.dacseq_wvf_repeat.restype = ctypes.c_uint
+        self.lib.dacseq_wvf_slice.argtypes = [ctypes.c_uint, ctypes.c_double, ctypes.c_double]
+        self.lib.dacseq_wvf_slice.restype = ctypes.c_uint
+        self.lib.dacseq_wvf_splice.argtypes = [ctypes.c_uint, ctypes.c_double, ctypes.c_double, ctypes.c_uint]
+        self.lib.dacseq_wvf_splice.restype = ctypes.c_uint
+        self.lib.dacseq_wvf_duration.argtypes = [ctypes.c_uint]
+        self.lib.dacseq_wvf_duration.restype = ctypes.c_double
+        self.lib.dacseq_wvf_load.argtypes = [ctypes.c_uint, ctypes.c_uint, ctypes.c_uint, ctypes.POINTER(Timing)]
+        self.lib.dacseq_wvf_release.argtypes = [ctypes.c_uint]
+        if transport is not None:
+            self._check(self.lib.dacseq_set_transport(transport.encode('ascii')))
+        if calibration is not None:
+            self.load_calibration(calibration)
+        if device_list is not None:
+            device_list = device_list.encode('ascii')
+        self.devices = self.lib.dacseq_open(device_list)
+        if self.devices < 0:
+            raise IOError('no DAC boards could be opened')
+
+    @staticmethod
+    def _array(values):
+        ## only copies when the input isn't already float64 and contiguous
+        return np.ascontiguousarray(values, dtype=np.float64)
+
+    def _check(self, result):
+        if result < 0:
+            raise IOError('sequencer call failed with code %d' % result)
+        return result
+
+    def load_calibration(self, filename=None):
+        ## waveforms loaded after this are corrected with the file's tables; returns the channels calibrated
+        if filename is not None:
+            filename = filename.encode('ascii')
+        return self._check(self.lib.dacseq_load_calibration(filename))
+
+    def load_waveform(self, channel, step, times, starts, ends):
+        ## times are line end times from the start of the step, as in the .dat files
+        times, starts, ends = self._array(times), self._array(starts), self._array(ends)
+        timing = Timing()
+        self._check(self.lib.dacseq_load_waveform(channel, step,
+            times.ctypes.data_as(_dbl_p), starts.ctypes.data_as(_dbl_p), ends.ctypes.data_as(_dbl_p),
+            min(len(times), len(starts), len(ends)), ctypes.byref(timing)))
+        return timing
+
+    def load_logic(self, channel, step, durations, logic):
+        durations, logic = self._array(durations), self._array(logic)
+        timing = Timing()
+        self._check(self.lib.dacseq_load_logic(channel, step,
+            durations.ctypes.data_as(_dbl_p), logic.ctypes.data_as(_dbl_p),
+            min(len(durations), len(logic)), ctypes.byref(timing)))
+        return timing
+
+    def channel(self, device, channel):
+        ## global channel number of a channel on a device
+        return self.lib.dacseq_global_channel(device, channel)
+
+    def logic_channel(self, device):
+        return self.lib.dacseq_logic_channel(device)
+
+    def copy_step(self, src_channel, src_step, dst_channel, dst_step):
+        ## the step is shared, not encoded again
+        self._check(self.lib.dacseq_copy_step(src_channel, src_step, dst_channel, dst_step))
+
+    def write(self, channel):
+        timing = Timing()
+        self._check(self.lib.dacseq_write(channel, ctypes.byref(timing)))
+        return timing
+
+    def run(self, channel):
+        self._check(self.lib.dacseq_run(channel))
+
+    def clear(self, channel=-1, step=-1):
+        self._check(self.lib.dacseq_clear(channel, step))
+
+    def step_size(self, channel, step):
+        return self.lib.dacseq_step_size(channel, step)
+
+    def segments(self, durations, starts, ends):
+        ## a waveform expression from linear segments; nothing is encoded until it is loaded
+        durations, starts, ends = self._array(durations), self._array(starts), self._array(ends)
+        return Wvf(self, self.lib.dacseq_wvf_segments(durations.ctypes.data_as(_dbl_p),
+            starts.ctypes.data_as(_dbl_p), ends.ctypes.data_as(_dbl_p), min(len(durations), len(starts), len(ends))))
+
+    def wvf_file(self, filename):
+        return Wvf(self, self.lib.dacseq_wvf_file(filename.encode('ascii')))
+
+    def concat(self, *parts):
+        handles = (ctypes.c_uint * len(parts))(*[p.handle for p in parts])
+        return Wvf(self, self.lib.dacseq_wvf_concat(handles, len(parts)))
+
+    def load(self, channel, step, wvf):
+        timing = Timing()
+        self._check(self.lib.dacseq_wvf_load(channel, step, wvf.handle, ctypes.byref(timing)))
+        return timing
+
+    def close(self):
+        self._check(self.lib.dacseq_close())
+
+class Wvf(object):
+    """
+    A waveform expression held by the sequencer library
+    a + b concatenates, and the other operations return new expressions sharing the parts of this one
+    """
+
+    def __init__(self, seq, handle):
+        if not handle:
+            raise ValueError('waveform expression could not be built')
+        self.seq = seq
+        self.handle = handle
+
+    def __del__(self):
+        try:
+            self.seq.lib.dacseq_wvf_release(self.handle)
+        except Exception:
+            pass
+
+    def __add__(self, other):
+        return self.seq.concat(self, other)
+
+    def offset(self, volts):
+        return Wvf(self.seq, self.seq.lib.dacseq_wvf_offset(self.handle, volts))
+
+    def scale(self, factor):
+        return Wvf(self.seq, self.seq.lib.dacseq_wvf_scale(self.handle, factor))
+
+    def stretch(self, factor):
+        return Wvf(self.seq, self.seq.lib.dacseq_wvf_stretch(self.handle, factor))
+
+    def repeat(self, times):
+        return Wvf(self.seq, self.seq.lib.dacseq_wvf_repeat(self.handle, times))
+
+    def slice(self, t_start, t_end):
+        return Wvf(self.seq, self.seq.lib.dacseq_wvf_slice(self.handle, t_start, t_end))
+
+    def splice(self, t_start, t_end, insert):
+        return Wvf(self.seq, self.seq.lib.dacseq_wvf_splice(self.handle, t_start, t_end, insert.handle))
+
+    @property
+    def duration(self):
+        return self.seq.lib.dacseq_wvf_duration(self.handle)
@@ -0,0 +1,83 @@
+## Client for the DAC sequencer daemon (DAC_sequencer --daemon [socket])
+import socket
+import struct
+
+## Request op-codes, matching Seq_Daemon.h
+OP_PING = 0
+OP_LOAD_FILE = 1
+OP_LOAD_POINTS = 2
+OP_WRITE = 3
+OP_RUN = 4
+OP_CLEAR = 5
+OP_SHUTDOWN = 6
+
+## Step kinds, matching Step_Cache.h
+KIND_DAC = 0
+KIND_LOGIC = 1
+
+HEADER = struct.Struct('<BBHIII')
+REPLY = struct.Struct('<IBBHII')
+
+class SequencerClient(object):
+    """
+    Sends requests to the sequencer daemon
+    Requests are queued with the op methods and sent together by flush(),
+    so many requests travel in one pipelined burst
+    """
+
+    def __init__(self, path='dac_sequencer.sock'):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.pending = []
+        self.next_id = 0
+
+    def _queue(self, op, kind=0, channel=0, step=0, payload=b''):
+        self.next_id += 1
+        self.pending.append(HEADER.pack(op, kind, channel, self.next_id, step, len(payload)) + payload)
+        return self.next_id
+
+    def ping(self):
+        return self._queue(OP_PING)
+
+    def load_file(self, channel, step, filename, kind=KIND_DAC):
+        return self._queue(OP_LOAD_FILE, kind, channel, step, filename.encode('ascii'))
+
+    def load_points(self, channel, step, rows, kind=KIND_DAC):
+        ## rows of (time, start, end) for DAC steps, or (duration, logic) for logic steps
+        flat = [float(v) for row in rows for v in row]
+        return self._queue(OP_LOAD_POINTS, kind, channel, step, struct.pack('<%dd' % len(flat), *flat))
+
+    def write(self, channel):
+        return self._queue(OP_WRITE, 0, channel)
+
+    def run(self, channel):
+        return self._queue(OP_RUN, 0, channel)
+
+    def clear(self, channel=0xFFFF, step=0xFFFFFFFF):
+        return self._queue(OP_CLEAR, 0, channel, step)
+
+    def shutdown(self):
+        return self._queue(OP_SHUTDOWN)
+
+    def flush(self):
+        """
+        send the queued requests and wait for all the replies
+        returns a list of (id, op, status, latency_us)
+        """
+        count = len(self.pending)
+        self.sock.sendall(b''.join(self.pending))
+        self.pending = []
+        data = b''
+        while len(data) < count*REPLY.size:
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise IOError('daemon closed the connection')
+            data += chunk
+        replies = []
+        for i in range(count):
+            rid, op, status, _, latency, _ = REPLY.unpack_from(data, i*REPLY.size)
+            replies.append((rid, op, status, latency))
+        return replies
+
+    def close(self):
+        self.sock.close()